@@ -5,6 +5,11 @@
  * Multiple producers, single conusmer is totally lock free. (N:1)
  * Multiple producers, multiple conusmers is making use of a spinlock. (N:N)
  *
+ * amlstack_tagged_t is lock free for multiple consumers as well.
+ * Its head carries a generation tag in the upper 16 bits of the pointer, so a pop racing with pop+push of the same node fails.
+ * This assumes 48 bit user-space addresses, and that popped nodes remain readable memory for as long as the stack is in use,
+ * since a racing consumer may still read their next pointer (the value it reads is then discarded).
+ *
  * No memory allocation is happening within the data structure, it merely links existing structures
  *
  * Usage examples:
@@ -71,6 +76,31 @@ void amlstack_push(amlstack_t* stk, amlstack_node_t* node);
  */
 amlstack_node_t* amlstack_pop(amlstack_t* stk);
 
+typedef struct amlstack_tagged {
+	volatile uint64_t size;
+	volatile uint64_t head; /* Node address in the lower 48 bits, generation tag in the upper 16 */
+} amlstack_tagged_t;
+
+/**
+ * Initializes and terminates a tagged stack.
+ *
+ * WARNING: This operation is not threading-safe, all users of thread must be done between invokations
+ */
+void amlstack_tagged_init(amlstack_tagged_t* stk);
+#define amlstack_tagged_term(stk) amlstack_tagged_init((stk))
+
+/**
+ * Insert a node into the tagged stack
+ * WARNING: This code does not check for double insertion.
+ */
+void amlstack_tagged_push(amlstack_tagged_t* stk, amlstack_node_t* node);
+
+/**
+ * Pop a node from the tagged stack, safe for any number of consumers.
+ * Returns NULL if empty.
+ */
+amlstack_node_t* amlstack_tagged_pop(amlstack_tagged_t* stk);
+
 /**
  * Usability macro
  */
@@ -0,0 +1,111 @@
+#ifndef _LIBAM_OBJCACHE_H_
+#define _LIBAM_OBJCACHE_H_
+
+#include "libam/libam_types.h"
+#include "libam/libam_pool.h"
+
+/* Typed object cache, on top of an ampool_t.
+ * All objects of a cache share one size. The constructor runs when an object enters the cache, that is when it is first
+ * allocated from the pool, and the destructor when it leaves it, on amobjcache_trim() or amobjcache_free().
+ * In between, objects go back and forth between the user and the cache as they are: objects put back must be in their
+ * constructed state (mutexes unlocked, lists empty...), and come out of amobjcache_get() just as they were put back.
+ *
+ * Each thread has a slot of free objects of its own, so the common get and put touch no shared state.
+ * Slots overflow into / refill from a shared depot in magazines of AMOBJCACHE_MAG_SIZE objects.
+ *
+ * Usage examples:
+
+typedef struct conn {
+	pthread_mutex_t lock;
+	amlist_t requests;
+	int fd;
+} conn_t;
+
+static amrc_t conn_ctor(void* obj, void* user_data)
+{
+	conn_t* conn = obj;
+	amlist_init(&conn->requests);
+	return (pthread_mutex_init(&conn->lock, NULL) == 0 ? AMRC_SUCCESS : AMRC_ERROR);
+}
+
+static void conn_dtor(void* obj, void* user_data)
+{
+	pthread_mutex_destroy(&((conn_t*)obj)->lock);
+}
+
+{
+	const amobjcache_config_t config = { .size = sizeof(conn_t), .ctor = conn_ctor, .dtor = conn_dtor };
+	amobjcache_t* cache = amobjcache_alloc(pool, &config);
+	conn_t* conn;
+
+	conn = amobjcache_get(cache); // Lock and list are ready to use
+	conn->fd = fd;
+	...
+	conn->fd = -1;
+	amobjcache_put(cache, conn); // Lock unlocked and list empty again
+
+	amobjcache_free(cache);
+}
+ */
+
+#define AMOBJCACHE_MAG_SIZE 32 /* Objects moved between thread slots and the depot at once */
+
+typedef amrc_t (*amobjcache_ctor_t)(void* obj, void* user_data); /* AMRC_ERROR fails the allocation */
+typedef void (*amobjcache_dtor_t)(void* obj, void* user_data);
+
+typedef struct amobjcache_config {
+	uint32_t size; /* Object size */
+	amobjcache_ctor_t ctor; /* May be NULL, objects then start out zeroed */
+	amobjcache_dtor_t dtor; /* May be NULL */
+	void* user_data; /* Passed to ctor and dtor */
+	uint64_t max_free; /* Cap on free objects kept in the depot, 0 for unlimited. Objects past it are destructed */
+} amobjcache_config_t;
+
+typedef struct amobjcache_stats {
+	uint64_t used; /* Handed out to the user */
+	uint64_t cached; /* Constructed and free, in thread slots or the depot */
+	uint64_t constructed; /* Constructor calls over the life of the cache */
+	uint64_t destructed; /* Destructor calls over the life of the cache */
+} amobjcache_stats_t;
+
+struct amobjcache;
+typedef struct amobjcache amobjcache_t;
+
+/**
+ * Creates a cache of objects allocated from <pool>, which must outlive it.
+ * @Returns new cache / NULL on error
+ */
+amobjcache_t* amobjcache_alloc_named(ampool_t* pool, const amobjcache_config_t* config, const char* name);
+#define amobjcache_alloc(pool, config) amobjcache_alloc_named((pool), (config), __LOCATION__)
+
+/**
+ * Destructs all cached objects and releases the cache.
+ * Objects still in use are left allocated in the pool, without running their destructor.
+ *
+ * WARNING: Not thread safe, all users of the cache must be done
+ */
+void amobjcache_free(amobjcache_t* cache);
+
+/**
+ * Takes a constructed object, out of the calling thread's slot when it has one.
+ * @Returns object / NULL on error
+ */
+void* amobjcache_get(amobjcache_t* cache);
+
+/**
+ * Returns an object to the calling thread's slot. Objects may be put back by any thread.
+ */
+void amobjcache_put(amobjcache_t* cache, void* obj);
+
+/**
+ * Destructs the free objects of the cache and returns them to the pool, those of thread slots included.
+ * @Returns number of objects destructed
+ */
+uint64_t amobjcache_trim(amobjcache_t* cache);
+
+/**
+ * Counters are read while they change, so they may be off by in-flight operations
+ */
+void amobjcache_get_stats(amobjcache_t* cache, amobjcache_stats_t* stats);
+
+#endif /* _LIBAM_OBJCACHE_H_ */
@@ -5,14 +5,65 @@
 #include "libam/libam_stats.h"
 
 /* THIS IS A MUTEXED memory allocation pool.
- * Any data larger than AMPOOL_MAX_STEPPED bytes is allocated and freed as it is
- * Anything lower than the cutoff is re-used.
+ * Sizes up to the pool's ceiling are grouped in size classes and re-used: 16 byte steps up to 512 bytes,
+ * then 4 geometric classes per power of two. Any data larger than the ceiling is allocated and freed as it is.
+ * The ceiling is 512 bytes unless set through ampool_config_t.
+ *
+ * With AMPOOL_THREAD_CACHE, each thread keeps small magazines of free chunks per size step.
+ * Magazines are refilled from / flushed to the shared buckets in batches, so the common path takes no lock.
+ *
+ * With AMPOOL_SLAB, stepped chunks are carved out of large aligned slabs rather than malloc'd one by one.
+ * Slabs are released to the system when the pool is freed, or by ampool_trim() once all their chunks are free.
+ *
+ * With AMPOOL_COMPACT, objects carry no header at all. Size class and owning bucket are derived from the
+ * address through the slab it lives in, so ampool_free() needs no size. Sizes are accounted per size class,
+ * element names are not kept, and AMPOOL_VALIDATE_ON_FREE is limited to catching double frees.
+ *
+ * With AMPOOL_FAST, stepped buckets take no lock on alloc/free. Free slots sit on a lock-free stack,
+ * no list of used chunks is kept and used counts live in per-thread shards rather than the bucket stats.
+ * The lock is only taken to carve new slots.
+ *
+ * With AMPOOL_NUMA, the pool keeps a set of stepped buckets per NUMA node. Allocations come from the caller's node,
+ * with slabs bound to it, and frees return chunks to the node they came from. Without NUMA support, there is a single node.
+ *
+ * With AMPOOL_HUGEPAGE, slabs are carved out of 2MB regions backed by hugepages, to cut TLB misses of large long-lived pools.
+ * Regions come from the explicit hugepage pool if one is reserved, otherwise transparent hugepages are asked for,
+ * and all size classes (of a node) share them. Slabs released by ampool_trim() are kept for reuse by any class,
+ * regions are only unmapped along with the pool. Without hugepage support, regions fall back to small pages.
+ *
+ * With AMPOOL_GUARD, 1 in guard_rate allocations of each thread get a canary past their data, checked when freed.
+ * Freed sampled elements are poisoned and held in a quarantine of the pool, writes to them are caught once they leave it,
+ * as are double frees while they are in it. Reports carry the element's allocation site, see ampool_guard_handler().
+ * Cheap enough to leave on where AMPOOL_VALIDATE_ON_FREE is not. Not available with AMPOOL_COMPACT, which has no headers.
+ *
+ * With AMPOOL_PROFILE, 1 in profile_rate allocations of each thread is sampled and accounted to its call site,
+ * in a lock-free table of the pool that ampool_profile() reads while allocation goes on.
+ * With AMPOOL_COMPACT, objects cannot be tied back to their site, so only allocations are counted.
  */
 
+#define AMPOOL_MAX_NODES 8
+#define AMPOOL_MAX_POOLED (1024 * 1024) /* Highest ceiling for pooled sizes */
+#define AMPOOL_MAX_SLAB_POOLED (8 * 1024) /* Highest ceiling for slab backed pools (AMPOOL_SLAB and the modes implying it) */
+#define AMPOOL_ARENA_BLOCK_SIZE (256 * 1024) /* Default block size of arena pools */
+#define AMPOOL_PROFILE_SITES 256 /* Call sites a profiled pool tells apart, others are accounted together */
+#define AMPOOL_PROFILE_RATE 64 /* Default sampling rate of AMPOOL_PROFILE */
+#define AMPOOL_GUARD_RATE 1024 /* Default sampling rate of AMPOOL_GUARD */
+#define AMPOOL_GUARD_QUARANTINE 64 /* Freed guarded elements a pool holds back from reuse */
+
 typedef enum ampool_flags {
 	AMPOOL_VALIDATE_ON_FREE	= 1 << 0, /* Run a simple validation of memory before freeing a chunk */
+	AMPOOL_THREAD_CACHE	= 1 << 1, /* Keep per-thread magazines of free chunks for stepped sizes */
+	AMPOOL_SLAB		= 1 << 2, /* Carve stepped chunks out of slabs, rather than a malloc per chunk */
+	AMPOOL_COMPACT		= 1 << 3, /* No per-object header, implies AMPOOL_SLAB */
+	AMPOOL_FAST		= 1 << 4, /* Lock-free stepped buckets, implies AMPOOL_SLAB */
+	AMPOOL_NUMA		= 1 << 5, /* Stepped buckets per NUMA node, implies AMPOOL_SLAB */
+	AMPOOL_PROFILE		= 1 << 6, /* Sample allocations per call site, see ampool_profile() */
+	AMPOOL_HUGEPAGE		= 1 << 7, /* Slabs packed in hugepage regions, implies AMPOOL_SLAB */
+	AMPOOL_GUARD		= 1 << 8, /* Sampled canaries and quarantine, see ampool_guard_handler() */
 } ampool_flags_t;
 
+/* NOTE: With AMPOOL_THREAD_CACHE, chunks parked in thread magazines count as used, in units of element_size
+ * NOTE: With AMPOOL_FAST, used counts and ranges of stepped buckets are not maintained */
 typedef struct ampool_bucket_stats {
 	uint64_t		element_size;
 
@@ -31,32 +82,76 @@ struct ampool;
 
 typedef void*	(*ampool_alloc_t)(struct ampool* pool, uint32_t size, const char* name);
 typedef void*	(*ampool_realloc_t)(struct ampool* pool, void * ptr, uint32_t old_size, uint32_t new_size, const char* name);
-typedef void	(*ampool_free_t)(struct ampool* pool, void * ptr, uint32_t size);
+typedef void	(*ampool_free_t)(struct ampool* pool, void * ptr, uint32_t size); /* size may be 0, pool then derives it */
 typedef uint64_t (*ampool_get_size_t)(struct ampool* pool);
+typedef uint32_t (*ampool_elem_size_t)(struct ampool* pool, const void* ptr);
 typedef void	(*ampool_pool_free_t)(struct ampool* pool);
+typedef amrc_t	(*ampool_alloc_bulk_t)(struct ampool* pool, uint32_t size, uint32_t count, void** ptrs, const char* name);
+typedef void	(*ampool_free_bulk_t)(struct ampool* pool, void** ptrs, uint32_t count, uint32_t size); /* size may be 0, as with free */
 
 typedef struct ampool {
 	ampool_alloc_t alloc;
 	ampool_realloc_t realloc;
 	ampool_free_t free;
 	ampool_get_size_t get_size; /* Size is only for the current pool, lineage doesn't count. */
+	ampool_elem_size_t elem_size; /* Size accounted for a single allocation */
 	ampool_pool_free_t pool_free; /* Frees this pool, and all children */
+	ampool_alloc_bulk_t alloc_bulk; /* All or nothing, <count> elements of <size> into <ptrs> */
+	ampool_free_bulk_t free_bulk;
 } ampool_t;
 
 void ampool_init();
 void ampool_term();
 
+typedef struct ampool_config {
+	ampool_flags_t flags;
+	uint32_t max_pooled; /* Ceiling of pooled sizes, rounded up to a class. 0 (or anything up to 512) for the default 512 */
+	uint64_t retain_bytes; /* Per class cap on free bytes kept for reuse, 0 for unlimited. Slab backed classes are not capped */
+	uint32_t profile_rate; /* AMPOOL_PROFILE: 1 in profile_rate allocations is sampled, 0 for AMPOOL_PROFILE_RATE */
+	uint32_t guard_rate; /* AMPOOL_GUARD: 1 in guard_rate allocations is guarded, 0 for AMPOOL_GUARD_RATE */
+} ampool_config_t;
+
+ampool_t* ampool_pool_alloc_config_named(ampool_t* parent, const ampool_config_t* config, const char* name);
+#define ampool_pool_alloc_config(parent, config) ampool_pool_alloc_config_named((parent), (config), __LOCATION__)
+
 ampool_t* ampool_pool_alloc_flags_named(ampool_t* parent, ampool_flags_t flags, const char* name);
 #define ampool_pool_alloc_flags(parent, flags) ampool_pool_alloc_flags_named((parent), (flags), __LOCATION__)
 #define ampool_pool_alloc(parent) ampool_pool_alloc_flags((parent), (parent) != NULL ? (parent)->flags : 0)
+#define ampool_pool_alloc_numa_named(parent, flags, name) ampool_pool_alloc_flags_named((parent), (flags) | AMPOOL_NUMA, (name))
+#define ampool_pool_alloc_numa(parent, flags) ampool_pool_alloc_flags((parent), (flags) | AMPOOL_NUMA)
+
+/* Arena pools share the ampool_t interface and the pool hierarchy, but allocate by bumping a pointer through large blocks.
+ * Free is a no-op, all memory is released at once along with the pool, and get_size counts all bytes handed out.
+ * Arenas keep no per-object data: realloc requires old_size, elem_size returns 0 and ampool_elem_diag reports nothing.
+ * block_size of 0 selects AMPOOL_ARENA_BLOCK_SIZE. Allocations above a quarter block get a block of their own. */
+ampool_t* ampool_arena_alloc_named(ampool_t* parent, uint64_t block_size, const char* name);
+#define ampool_arena_alloc(parent, block_size) ampool_arena_alloc_named((parent), (block_size), __LOCATION__)
 
 #define ampool_pool_free(pool)		((pool)->pool_free((pool)))
 
+/* Returns free memory kept for reuse to the system, for <pool> and its children, or for all pools if <pool> is NULL.
+ * Unless <all> is set, only elements that stayed free since the previous trim are released, so calling this
+ * periodically (e.g. from a background thread) decays pools back towards their working set after a burst.
+ * Slab backed classes release whole slabs only. AMPOOL_FAST classes and thread magazines are not trimmed.
+ * May run concurrently with any pool operation.
+ * @Returns number of bytes released */
+uint64_t ampool_trim(ampool_t* pool, ambool_t all);
+
 #define ampool_get_size(pool)		((pool)->get_size((pool)))
 
 #define ampool_alloc(pool, size)	((pool)->alloc((pool), (size), __LOCATION__))
+/* Resizes in place while the new size stays within the element's size class, and oversized elements are
+ * resized by the system allocator (or mremap with AMPOOL_COMPACT), so they may avoid copying. */
 #define ampool_realloc(pool, ptr, old_size, new_size) ((pool)->realloc((pool), (ptr), (old_size), (new_size), __LOCATION__))
-#define ampool_free(pool, ptr)		((pool)->free((pool), (ptr)))
+#define ampool_elem_size(pool, ptr)	((pool)->elem_size((pool), (ptr)))
+#define ampool_free(pool, ptr)		((pool)->free((pool), (ptr), 0))
+#define ampool_free_sized(pool, ptr, size) ((pool)->free((pool), (ptr), (size)))
+
+/* Batched counterparts of ampool_alloc / ampool_free_sized, a size class bucket is locked once per batch rather than
+ * once per element. Elements may be freed individually or in batches of any composition, batches of elements that
+ * share a size class are the fast ones. */
+#define ampool_alloc_bulk(pool, size, count, ptrs) ((pool)->alloc_bulk((pool), (size), (count), (ptrs), __LOCATION__))
+#define ampool_free_bulk(pool, ptrs, count, size) ((pool)->free_bulk((pool), (ptrs), (count), (size)))
 
 
 /*
@@ -74,6 +169,16 @@ typedef struct ampool_diag {
 
 	uint64_t size; /* Total allocated bytes, excluding overhead and free blocks */
 	uint64_t elements; /* Total number of allocated elemens in the pool, does not include children */
+
+	uint64_t realloc_inplace; /* Reallocs resized within their existing slot */
+	uint64_t realloc_moved; /* Reallocs that had to move the data to a new allocation */
+	uint64_t trimmed; /* Bytes released by ampool_trim() so far */
+
+	uint32_t nodes; /* Number of NUMA nodes the pool keeps buckets for */
+	uint64_t node_size[AMPOOL_MAX_NODES]; /* AMPOOL_NUMA only: Bytes of stepped (not oversized) elements per node */
+
+	uint64_t reserved; /* Arenas only: Bytes mapped for blocks, including unused space */
+	uint64_t hugepage_bytes; /* AMPOOL_HUGEPAGE only: Bytes of regions backed by hugepages, explicit or transparent */
 } ampool_diag_t;
 
 /* Return AMRC_SUCCESS to keep looping */
@@ -81,17 +186,62 @@ typedef amrc_t (*ampool_diag_cb_t)(const ampool_diag_t* diag_info, void* user_da
 
 
 /* This will iterate over all allocated pools and call the provided callback with the proper stats for each
- * WARNING: While this is running, no other task may add or delete pools
- * USE WITH CAUTION */
+ * Pools may be added and freed meanwhile, those linked under a pool that is being walked wait for the walk to leave it.
+ * The callback must not add or free pools itself. */
 void ampool_diag(ampool_diag_cb_t callback, void* user_data);
 
 
+typedef struct ampool_profile {
+	ampool_t* pool;
+	const char* pool_name;
+
+	const char* site; /* As given by __LOCATION__, NULL for the sites that did not fit in the table */
+	uint32_t sample_rate; /* Counts below are of sampled allocations, multiply by this for estimates */
+	uint64_t allocs; /* Since the pool was created, diff between calls for a rate */
+	uint64_t frees;
+	int64_t live_count; /* Still allocated. Counters are read while they change, so these may be off by in-flight updates */
+	int64_t live_bytes;
+} ampool_profile_t;
+
+/* Return AMRC_SUCCESS to keep looping */
+typedef amrc_t (*ampool_profile_cb_t)(const ampool_profile_t* site, void* user_data);
+
+/* Calls <callback> for each call site of a pool with AMPOOL_PROFILE that had sampled allocations.
+ * Takes no lock, allocation and free go on undisturbed. Pools without AMPOOL_PROFILE report nothing */
+void ampool_profile(ampool_t* pool, ampool_profile_cb_t callback, void* user_data);
+
+
+typedef enum ampool_guard_error {
+	AMPOOL_GUARD_OVERFLOW, /* Canary past the element's data was overwritten */
+	AMPOOL_GUARD_USE_AFTER_FREE, /* Element was written to while in quarantine */
+	AMPOOL_GUARD_DOUBLE_FREE, /* Element was freed while in quarantine */
+} ampool_guard_error_t;
+
+typedef struct ampool_guard_report {
+	ampool_t* pool;
+	const char* pool_name;
+
+	const void* elem;
+	const char* elem_name; /* As given by __LOCATION__ when it was allocated */
+	uint32_t elem_size;
+
+	ampool_guard_error_t error;
+	uint32_t offset; /* Of the first corrupted byte, from elem */
+} ampool_guard_report_t;
+
+typedef void (*ampool_guard_cb_t)(const ampool_guard_report_t* report, void* user_data);
+
+/* Sets the callback AMPOOL_GUARD reports corruption to, for all pools. Corrupted elements are still released afterwards, double frees are ignored.
+ * With no callback (the default, or NULL) reports are printed to stderr, and the process aborts */
+void ampool_guard_handler(ampool_guard_cb_t callback, void* user_data);
+
+
 typedef struct ampool_elem_diag {
 	ampool_t* pool;
 	const char* pool_name;
 
 	const void* elem;
-	const char* elem_name;
+	const char* elem_name; /* NULL with AMPOOL_COMPACT */
 	uint32_t elem_size;
 } ampool_elem_diag_t;
 
@@ -45,6 +45,19 @@ amrc_t amstack_push(amstack_t* stk, void* data);
  */
 amrc_t amstack_pop(amstack_t* stk, void** data);
 
+/**
+ * Pushes up to <count> pointers, in order, reserving their slots at once
+ * Does not support NULL pointers
+ * Returns   Number of pointers pushed, short of <count> when the stack fills up
+ */
+uint64_t amstack_push_bulk(amstack_t* stk, void* const* data, uint64_t count);
+
+/**
+ * Pops up to <count> pointers, top of the stack first, reserving their slots at once
+ * Returns   Number of pointers popped, short of <count> when the stack empties
+ */
+uint64_t amstack_pop_bulk(amstack_t* stk, void** data, uint64_t count);
+
 /**
  * Returns current stack size
  */
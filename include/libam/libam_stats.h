@@ -111,5 +111,64 @@ static inline void amstat_add(amstat_range_t* to, amstat_range_t* from)
  */
 void amstat_2str(const amstat_range_t* stat, char* buff, uint64_t buf_len);
 
+/* Log-linear histogram, for percentiles. Each power of 2 range is split in 2^AMSTAT_HIST_SUB_BITS buckets,
+ * so values are known to within 25% */
+#define AMSTAT_HIST_SUB_BITS	2
+#define AMSTAT_HIST_SUB_COUNT	(1 << AMSTAT_HIST_SUB_BITS)
+#define AMSTAT_HIST_BUCKETS	(64 * AMSTAT_HIST_SUB_COUNT)
+
+typedef struct amstat_hist {
+	uint64_t	num;
+	uint64_t	buckets[AMSTAT_HIST_BUCKETS];
+} amstat_hist_t;
+
+static inline void amstat_hist_init(amstat_hist_t* hist)
+{
+	uint64_t i;
+
+	hist->num = 0;
+	for (i = 0; i < AMSTAT_HIST_BUCKETS; i++)
+		hist->buckets[i] = 0;
+}
+
+static inline uint64_t amstat_hist_bucket(uint64_t val)
+{
+	uint64_t msb;
+
+	if (val < AMSTAT_HIST_SUB_COUNT)
+		return val;
+	msb = 63 - __builtin_clzl(val);
+	return ((msb - AMSTAT_HIST_SUB_BITS + 1) << AMSTAT_HIST_SUB_BITS) + ((val >> (msb - AMSTAT_HIST_SUB_BITS)) & (AMSTAT_HIST_SUB_COUNT - 1));
+}
+
+/**
+ * Adds a value to the histogram
+ * THIS FUNCTION IS NOTH THREAD SAFE
+ */
+static inline void amstat_hist_upd(amstat_hist_t* hist, uint64_t val)
+{
+	hist->buckets[amstat_hist_bucket(val)]++;
+	hist->num++;
+}
+
+/**
+ * Adds the contents of one histogram to the other
+ * THIS FUNCTION IS NOTH THREAD SAFE
+ */
+static inline void amstat_hist_add(amstat_hist_t* to, const amstat_hist_t* from)
+{
+	uint64_t i;
+
+	for (i = 0; i < AMSTAT_HIST_BUCKETS; i++)
+		to->buckets[i] += from->buckets[i];
+	to->num += from->num;
+}
+
+/**
+ * Returns the value at or under which <percentile> (0 to 100) percent of the values fall, rounded up to its bucket's
+ * upper bound. 0 when empty
+ */
+uint64_t amstat_hist_percentile(const amstat_hist_t* hist, double percentile);
+
 
 #endif
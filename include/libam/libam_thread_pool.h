@@ -11,12 +11,36 @@ typedef void* (*lam_thread_func_t)(void* arg);
 
 typedef	enum  lam_thread_pool_flags {
 	LIBAM_THREAD_POOL_NONE			= 0 << 0,
-	LIBAM_THREAD_POOL_BLOCKING		= 1 << 0, /* Use locks & block. Better idle CPU usage & lower task execution latencies.
-	 	 	 	 	 	 	 	 	 	 	 	 However, this also adds some latency to all tasks, especially durin high-concurrenly. */
+	LIBAM_THREAD_POOL_BLOCKING		= 1 << 0, /* Idle workers park on a futex, and are woken one at a time as tasks are queued.
+												 Better idle CPU usage & lower task execution latencies than polling.
+												 However, this adds a wakeup check to all submissions. See spin_time */
 	LIBAM_THREAD_POOL_LAZY_START	= 1 << 1, /* Do not immediately start min_threads, wait until first tasks are scheduled */
 	LIBAM_THREAD_POOL_FUNC_OVERRIDE	= 1 << 2, /* Allow specification of custom functions when default function is set */
+	LIBAM_THREAD_POOL_FIFO			= 1 << 3, /* Run queued tasks oldest first, off a ring. Default with LIBAM_THREAD_POOL_BLOCKING.
+												 Keeps task delays bounded under load, where LIFO starves the oldest tasks */
+	LIBAM_THREAD_POOL_LIFO			= 1 << 4, /* Run queued tasks newest first, off a stack. Default without LIBAM_THREAD_POOL_BLOCKING */
 } lam_thread_pool_flags_t;
 
+/* What submitting a task does when the backlog is full */
+typedef enum lam_thread_pool_overflow {
+	LIBAM_THREAD_POOL_OVERFLOW_FAIL			= 0, /* Fail the submission */
+	LIBAM_THREAD_POOL_OVERFLOW_BLOCK		= 1, /* Wait for room, for up to submit_timeout. Submissions from the pool's own workers
+													are run by the caller instead, as they could be waiting on themselves */
+	LIBAM_THREAD_POOL_OVERFLOW_CALLER_RUNS	= 2, /* Run the task in the submitting thread, before returning */
+	LIBAM_THREAD_POOL_OVERFLOW_GROW			= 3, /* Queue it anyway, past the backlog. Unbounded */
+} lam_thread_pool_overflow_t;
+
+/* Where workers run */
+typedef enum lam_thread_pool_affinity {
+	LIBAM_THREAD_POOL_AFFINITY_NONE	= 0, /* Wherever the scheduler puts them */
+	LIBAM_THREAD_POOL_AFFINITY_CPUS	= 1, /* Each worker pinned to one of the pool's CPUs, round robin */
+	LIBAM_THREAD_POOL_AFFINITY_NUMA	= 2, /* Workers spread round robin across NUMA nodes, each free to run on the pool's
+											CPUs of its node */
+} lam_thread_pool_affinity_t;
+
+/* Smallest worker stack, room for the nested pieces of parallel loops, see lam_parallel_for(), on top of tasks' own */
+#define LAM_THREAD_POOL_STACK_MIN (256UL * 1024)
+
 typedef struct lam_thread_pool_config {
 	lam_thread_pool_flags_t flags; /* See libam_thread_pool_flags_t */
 	lam_thread_func_t default_func; /* Default thread function to execute */
@@ -24,12 +48,22 @@ typedef struct lam_thread_pool_config {
 	amtime_t	idle_timeout;	/* Time, in microseconds, a thread will remain idle before halting. 0 for never shutting down idle threads. */
 	uint64_t	max_threads;	/* Maximum number of concurrent threads to have running. 0 to have no cap */
 	uint64_t	min_threads;	/* Number of threads that always must be running at any given time. Set 0 for default value. */
-	uint64_t	backlog;		/* Max depth of task queue. Set 0 for default value. */
+	uint64_t	backlog;		/* Max depth of task queue. Set 0 for default value. Rounded up to a power of 2 with FIFO */
+	amtime_t	spin_time;		/* Time, in microseconds, an idle worker keeps looking for tasks before parking, with
+								   LIBAM_THREAD_POOL_BLOCKING. Saves the wakeup on busy pools, for low latency. 0 to park right away */
+	lam_thread_pool_overflow_t overflow; /* See lam_thread_pool_overflow_t, applies to lam_thread_pool_run() */
+	amtime_t	submit_timeout;	/* Time, in microseconds, LIBAM_THREAD_POOL_OVERFLOW_BLOCK waits for. 0 to wait for as long as it takes */
+	lam_thread_pool_affinity_t affinity; /* See lam_thread_pool_affinity_t */
+	const uint32_t* cpus;	/* CPUs of the pool, for affinity. NULL for all those the process may run on. Copied */
+	uint64_t	cpus_len;	/* Number of cpus */
+	uint64_t	stack_size;	/* Stack size of workers, in bytes. Set 0 for default value. Raised to LAM_THREAD_POOL_STACK_MIN */
 } lam_thread_pool_config_t;
 
 typedef struct lam_thread_pool_stats {
 	uint64_t		threads_created;	/* Total number of threads created over the lifetime of the pool */
 	uint64_t		tasks_created;	/* Total number of tasks scheduled over the lifetime of the pool */
+	uint64_t		tasks_caller_run;	/* Tasks run by the submitter on a full backlog, not part of tasks_created */
+	uint64_t		tasks_overflowed;	/* Tasks queued past the backlog */
 
 	amstat_range_t	active_thread_count; /* Total thread count at time of scheduling of a task */
 	amstat_range_t	idle_thread_count; /* Idle thread count at time of scheduling of a task (Subset of active) */
@@ -37,11 +71,42 @@ typedef struct lam_thread_pool_stats {
 	amstat_range_t	tasks_processed;	/* Number of tasks thread have processed before idle_timeout expired. */
 	amstat_range_t	busy_task_num;	/* Number of tasks threads process before becoming idle */
 	amstat_range_t	queue_depth;	/* Number of tassks in queue at the time of scheduling */
+
+	amstat_hist_t	task_delay_hist;	/* Distribution of task_delay */
+	amtime_t		task_delay_p50;	/* Percentiles of task_delay, filled by lam_thread_pool_destroy() */
+	amtime_t		task_delay_p90;
+	amtime_t		task_delay_p99;
+	amtime_t		task_delay_p999;
 } lam_thread_pool_stats_t;
 
 struct lam_thread_pool;
 typedef struct lam_thread_pool lam_thread_pool_t;
 
+typedef enum lam_thread_pool_task_state {
+	LIBAM_THREAD_POOL_TASK_PENDING	= 0,
+	LIBAM_THREAD_POOL_TASK_WAITED	= 1, /* Pending, and someone is parked waiting for it */
+	LIBAM_THREAD_POOL_TASK_DONE		= 2,
+} lam_thread_pool_task_state_t;
+
+/* Task descriptor. Those of lam_thread_pool_run() are recycled by the pool, lam_thread_pool_run_task() takes
+ * caller-owned ones, from the stack, embedded in the caller's own structures...
+ * Fields are internal to the pool, do not touch */
+typedef struct lam_thread_pool_task {
+	uint64_t id;
+	lam_thread_func_t func;
+	void *arg;
+	void **ret_ptr;
+	struct lam_thread_pool_task *next; /* Overflow list */
+	uint32_t pooled; /* Recycled by the pool once run, otherwise owned by the caller */
+	volatile uint32_t done; /* Caller-owned descriptors only, see lam_thread_pool_task_state_t */
+
+	/* Stat-related numbers */
+	amtime_t queue_time;
+	uint64_t active_thread_count;
+	uint64_t idle_thread_count;
+	uint64_t queue_depth;
+} lam_thread_pool_task_t;
+
 lam_thread_pool_t* lam_thread_pool_create(const lam_thread_pool_config_t* config);
 amrc_t lam_thread_pool_destroy(lam_thread_pool_t* tp, lam_thread_pool_stats_t* stats);
 
@@ -50,14 +115,110 @@ uint64_t lam_thread_pool_get_thread_count(const lam_thread_pool_t* tp);
 uint64_t lam_thread_pool_get_idle_thread_count(const lam_thread_pool_t* tp);
 uint64_t lam_thread_pool_get_min_thread_count(const lam_thread_pool_t* tp);
 uint64_t lam_thread_pool_get_max_thread_count(const lam_thread_pool_t* tp);
+uint64_t lam_thread_pool_get_node_count(lam_thread_pool_t* tp); /* Read from the system on first use without affinity */
 
 amrc_t lam_thread_pool_set_default_func(lam_thread_pool_t* tp, lam_thread_func_t value);
 amrc_t lam_thread_pool_set_idle_timeout(lam_thread_pool_t* tp, amtime_t value);
 amrc_t lam_thread_pool_set_min_thread_count(lam_thread_pool_t* tp, uint64_t value);
 amrc_t lam_thread_pool_set_max_thread_count(lam_thread_pool_t* tp, uint64_t value);
 
-/* Queue a task to execute via the thread pool
+/* Queue a task to execute via the thread pool. When the backlog is full, config.overflow decides what happens.
+ * Tasks queued from within the pool's own workers go to the calling worker's deque, and are stolen by idle workers.
  * @Returns AMRC_SUCCESS / AMRC_ERROR. Nothing is queued when errors happen */
 amrc_t lam_thread_pool_run(lam_thread_pool_t* tp, lam_thread_func_t func, void* arg, void** ret_ptr);
 
+/* Queue a task, failing when the backlog is full whatever config.overflow says
+ * @Returns AMRC_SUCCESS / AMRC_ERROR. Nothing is queued when errors happen */
+amrc_t lam_thread_pool_try_run(lam_thread_pool_t* tp, lam_thread_func_t func, void* arg, void** ret_ptr);
+
+/* Queue a task, waiting for up to <timeout> microseconds for room when the backlog is full, or forever when 0
+ * @Returns AMRC_SUCCESS / AMRC_ERROR. Nothing is queued when errors happen */
+amrc_t lam_thread_pool_run_timeout(lam_thread_pool_t* tp, lam_thread_func_t func, void* arg, void** ret_ptr, amtime_t timeout);
+
+/* Queue <count> tasks, running funcs[i](args[i]), or the default function for all when <funcs> is NULL. Their return
+ * values go to rets[i] when <rets> is not NULL.
+ * Tasks are reserved room for, timestamped, and woken workers for in chunks rather than one by one. Tasks that do not
+ * fit in the backlog are subject to config.overflow, one by one.
+ * @Returns number of tasks queued (or run by the caller), from the start of the batch. Short of <count> only when the
+ * backlog fills up, or 0 when a function is missing */
+uint64_t lam_thread_pool_run_batch(lam_thread_pool_t* tp, const lam_thread_func_t* funcs, void* const* args, void** rets, uint64_t count);
+
+/* Queue a task on the queue of NUMA node <node>, numbered as the system does, below lam_thread_pool_get_node_count().
+ * Workers bound to the node run these tasks first, oldest first. Nodes without workers bound to them have their tasks
+ * run by any worker. Workers are only bound to nodes with an affinity set, see lam_thread_pool_affinity_t, pools
+ * without one queue these tasks as lam_thread_pool_try_run() does
+ * @Returns AMRC_SUCCESS / AMRC_ERROR when the node's queue is full. Nothing is queued when errors happen */
+amrc_t lam_thread_pool_run_on_node(lam_thread_pool_t* tp, uint64_t node, lam_thread_func_t func, void* arg, void** ret_ptr);
+
+/* Queue a task on a descriptor owned by the caller, which must remain valid until lam_thread_pool_task_done() says so.
+ * Nothing is allocated. The descriptor may then be reused for another task
+ * @Returns AMRC_SUCCESS / AMRC_ERROR. Nothing is queued when errors happen */
+amrc_t lam_thread_pool_run_task(lam_thread_pool_t* tp, lam_thread_pool_task_t* task, lam_thread_func_t func, void* arg, void** ret_ptr);
+
+/* @Returns am_true once the task queued on <task> has run, and *ret_ptr is set */
+static inline ambool_t lam_thread_pool_task_done(const lam_thread_pool_task_t* task)
+{
+	return (__atomic_load_n(&task->done, __ATOMIC_ACQUIRE) == LIBAM_THREAD_POOL_TASK_DONE ? am_true : am_false);
+}
+
+/* Completion handle of a task, in storage of the caller's: on the stack, embedded in its structures...
+ * Waiters park on a futex until the task completes. Nothing is allocated */
+typedef struct lam_thread_pool_future {
+	lam_thread_pool_task_t task;
+	lam_thread_pool_t* tp;
+	void* ret;
+} lam_thread_pool_future_t;
+
+/* Queue a task, whose completion <future> tracks. <future> must remain valid until waited for.
+ * @Returns future / NULL on error, then nothing is queued */
+lam_thread_pool_future_t* lam_thread_pool_async(lam_thread_pool_t* tp, lam_thread_pool_future_t* future, lam_thread_func_t func, void* arg);
+
+static inline ambool_t lam_thread_pool_future_done(const lam_thread_pool_future_t* future)
+{
+	return lam_thread_pool_task_done(&future->task);
+}
+
+/* Waits for the task to complete. The pool's own workers run other tasks of the pool while they wait.
+ * @Returns value returned by the task */
+void* lam_thread_pool_future_wait(lam_thread_pool_future_t* future);
+
+/* Waits for up to <timeout> microseconds, or forever when 0. Sets *<ret> to the value returned by the task if not NULL
+ * @Returns AMRC_SUCCESS / AMRC_ERROR on timeout */
+amrc_t lam_thread_pool_future_wait_timeout(lam_thread_pool_future_t* future, amtime_t timeout, void** ret);
+
+/* Waits for up to <timeout> microseconds, or forever when 0, for all <count> futures
+ * @Returns AMRC_SUCCESS / AMRC_ERROR on timeout */
+amrc_t lam_thread_pool_future_wait_all(lam_thread_pool_future_t* futures, uint64_t count, amtime_t timeout);
+
+/* Waits for up to <timeout> microseconds, or forever when 0, for any of <count> futures, all of the same pool.
+ * Sets *<index> to that of a completed one if not NULL
+ * @Returns AMRC_SUCCESS / AMRC_ERROR on timeout */
+amrc_t lam_thread_pool_future_wait_any(lam_thread_pool_future_t* futures, uint64_t count, amtime_t timeout, uint64_t* index);
+
+/* Body of a parallel loop, runs over indexes [begin, end) */
+typedef void (*lam_parallel_func_t)(uint64_t begin, uint64_t end, void* ctx);
+
+/* Body of a parallel reduction, folds indexes [begin, end) into <acc> */
+typedef void (*lam_parallel_reduce_func_t)(uint64_t begin, uint64_t end, void* ctx, void* acc);
+
+/* Folds <other> into <acc>, <other> being the result over the indexes right after those of <acc> */
+typedef void (*lam_parallel_join_func_t)(void* acc, const void* other, void* ctx);
+
+#define LAM_PARALLEL_ACC_MAX 64 /* Max size of reduction results, larger ones go through pointers */
+
+/* Runs <func> over [begin, end), in pieces of at least <grain> indexes, or of a size picked from the CPU count when 0.
+ * The calling thread runs part of the range itself. Its range is halved, and the other half queued, only when workers
+ * are there to take it. Those split their halves the same way. Halves are joined through futures: callers from outside
+ * the pool park, workers run other tasks meanwhile. May be called from within tasks of the pool. Pieces nest on the
+ * stacks of the threads running them, up to a bounded depth past which they no longer split.
+ * @Returns AMRC_SUCCESS once the whole range has run / AMRC_ERROR */
+amrc_t lam_parallel_for(lam_thread_pool_t* tp, uint64_t begin, uint64_t end, uint64_t grain, lam_parallel_func_t func, void* ctx);
+
+/* Same as lam_parallel_for(), with each piece folding its indexes into a result of its own. Those start out as copies
+ * of *<result>, which must hold the identity of <join>, of <size> bytes. Results are joined in range order, so <join>
+ * need only be associative.
+ * @Returns AMRC_SUCCESS with *<result> over the whole range / AMRC_ERROR */
+amrc_t lam_parallel_reduce(lam_thread_pool_t* tp, uint64_t begin, uint64_t end, uint64_t grain, lam_parallel_reduce_func_t func,
+		lam_parallel_join_func_t join, void* ctx, void* result, uint32_t size);
+
 #endif /* _LIBAM_THREAD_POOL_H_ */
@@ -4,6 +4,10 @@
 #include "libam/libam_lstack.h"
 #include "libam/libam_atomic.h"
 
+#define AMLSTACK_TAG_SHIFT 48
+#define AMLSTACK_TAG_ONE (1UL << AMLSTACK_TAG_SHIFT)
+#define AMLSTACK_PTR_MASK (AMLSTACK_TAG_ONE - 1)
+
 /**
  * Initializes and terminates a stack.
  *
@@ -82,3 +86,62 @@ out:
 		abort();
 	return head;
 }
+
+/**
+ * Initializes and terminates a tagged stack.
+ *
+ * WARNING: This operation is not threading-safe, all users of thread must be done between invokations
+ */
+void amlstack_tagged_init(amlstack_tagged_t* stk)
+{
+	stk->size = 0;
+	stk->head = 0;
+}
+
+/**
+ * Insert a node into the tagged stack
+ * WARNING: This code does not check for double insertion.
+ */
+void amlstack_tagged_push(amlstack_tagged_t* stk, amlstack_node_t* node)
+{
+	uint64_t head;
+	uint64_t next;
+
+	assert(stk != NULL && node != NULL);
+	assert(((uintptr_t)node & ~AMLSTACK_PTR_MASK) == 0);
+
+	do {
+		head = stk->head;
+		node->next = (amlstack_node_t*)(head & AMLSTACK_PTR_MASK);
+		next = ((head & ~AMLSTACK_PTR_MASK) + AMLSTACK_TAG_ONE) | (uintptr_t)node;
+	} while (!amsync_swap(&stk->head, head, next));
+	amsync_inc(&stk->size);
+}
+
+/**
+ * Pop a node from the tagged stack, safe for any number of consumers.
+ * Returns NULL if empty.
+ */
+amlstack_node_t* amlstack_tagged_pop(amlstack_tagged_t* stk)
+{
+	amlstack_node_t* node;
+	uint64_t head;
+	uint64_t next;
+
+	assert(stk != NULL);
+
+	do {
+		head = stk->head;
+		node = (amlstack_node_t*)(head & AMLSTACK_PTR_MASK);
+		if (node == NULL)
+			return NULL;
+
+		/* node may have been popped and reused since head was read, in which case next is garbage.
+		 * The tag has moved on by then, so the swap below fails and we retry */
+		next = ((head & ~AMLSTACK_PTR_MASK) + AMLSTACK_TAG_ONE) | (uintptr_t)node->next;
+	} while (!amsync_swap(&stk->head, head, next));
+
+	node->next = NULL;
+	amsync_dec(&stk->size);
+	return node;
+}
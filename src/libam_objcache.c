@@ -0,0 +1,308 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "libam/libam_objcache.h"
+#include "libam/libam_list.h"
+#include "libam/libam_atomic.h"
+#include "libam/libam_replace.h"
+
+enum amobjcache_constants {
+	AMOBJCACHE_SLOT_COUNT = 16, /* Thread slots of a cache, threads are spread across them */
+	AMOBJCACHE_SLOT_SIZE = AMOBJCACHE_MAG_SIZE * 2, /* A slot takes a full magazine when empty, gives one when full */
+	AMOBJCACHE_CACHE_LINE = 64,
+};
+
+/* Free objects moving between slots and the depot */
+typedef struct amobjcache_mag {
+	amlink_t link;
+	void* objs[AMOBJCACHE_MAG_SIZE];
+} amobjcache_mag_t;
+
+/* Free objects of the threads using this slot, with a single thread per slot, its lock is never contended */
+typedef struct amobjcache_slot {
+	pthread_mutex_t mutex;
+	uint32_t count;
+	int64_t used; /* Objects handed out through this slot, minus those put back through it. May go negative */
+	void* objs[AMOBJCACHE_SLOT_SIZE];
+} __attribute__((aligned(AMOBJCACHE_CACHE_LINE))) amobjcache_slot_t;
+
+struct amobjcache {
+	/* Characteristics - Fixed for the life of the cache */
+	ampool_t* pool;
+	const char* name;
+	uint32_t size;
+	amobjcache_ctor_t ctor;
+	amobjcache_dtor_t dtor;
+	void* user_data;
+	uint64_t max_free;
+
+	/* Depot - Locked behind mutex */
+	pthread_mutex_t mutex;
+	amlist_t full_mags;
+	amlist_t empty_mags; /* Kept for reuse, so steady state traffic does not malloc */
+	uint64_t depot_count; /* Objects in full_mags */
+
+	volatile uint64_t constructed;
+	volatile uint64_t destructed;
+
+	amobjcache_slot_t slots[AMOBJCACHE_SLOT_COUNT];
+};
+
+static volatile uint32_t slot_seq; /* Hands out slots to threads */
+static __thread uint32_t slot_index; /* 0 until assigned, slot index + 1 otherwise */
+
+static inline amobjcache_slot_t* cache_slot(amobjcache_t* cache)
+{
+	if (UNLIKELY(slot_index == 0))
+		slot_index = (amsync_inc(&slot_seq) % AMOBJCACHE_SLOT_COUNT) + 1;
+	return &cache->slots[slot_index - 1];
+}
+
+/* Allocates and constructs an object entering the cache
+ * @Returns object / NULL on error */
+static void* cache_obj_new(amobjcache_t* cache)
+{
+	void* obj;
+
+	obj = cache->pool->alloc(cache->pool, cache->size, cache->name);
+	if (obj == NULL)
+		return NULL;
+
+	if (cache->ctor == NULL) {
+		memset(obj, 0, cache->size);
+	}
+	else if (cache->ctor(obj, cache->user_data) != AMRC_SUCCESS) {
+		ampool_free_sized(cache->pool, obj, cache->size);
+		return NULL;
+	}
+
+	amsync_inc(&cache->constructed);
+	return obj;
+}
+
+/* Destructs objects leaving the cache, and returns them to the pool */
+static void cache_obj_release(amobjcache_t* cache, void** objs, uint32_t count)
+{
+	uint32_t i;
+
+	if (count == 0)
+		return;
+
+	if (cache->dtor != NULL) {
+		for (i = 0; i < count; i++)
+			cache->dtor(objs[i], cache->user_data);
+	}
+	ampool_free_bulk(cache->pool, objs, count, cache->size);
+	amsync_add(&cache->destructed, count);
+}
+
+/* Refills an empty slot with a full magazine of the depot. Slot must be locked.
+ * @Returns AMRC_SUCCESS / AMRC_ERROR if the depot is empty */
+static amrc_t cache_depot_take(amobjcache_t* cache, amobjcache_slot_t* slot)
+{
+	amobjcache_mag_t* mag;
+
+	pthread_mutex_lock(&cache->mutex);
+	if (amlist_empty(&cache->full_mags)) {
+		pthread_mutex_unlock(&cache->mutex);
+		return AMRC_ERROR;
+	}
+
+	mag = amlist_first_entry(&cache->full_mags, amobjcache_mag_t, link);
+	amlist_del(&mag->link);
+	cache->depot_count -= AMOBJCACHE_MAG_SIZE;
+
+	memcpy(&slot->objs[slot->count], mag->objs, sizeof(mag->objs));
+	slot->count += AMOBJCACHE_MAG_SIZE;
+
+	amlist_add(&cache->empty_mags, &mag->link);
+	pthread_mutex_unlock(&cache->mutex);
+
+	return AMRC_SUCCESS;
+}
+
+/* Moves a magazine worth of objects out of a full slot, into the depot or out of the cache. Slot must be locked */
+static void cache_depot_give(amobjcache_t* cache, amobjcache_slot_t* slot)
+{
+	amobjcache_mag_t* mag = NULL;
+
+	slot->count -= AMOBJCACHE_MAG_SIZE;
+
+	pthread_mutex_lock(&cache->mutex);
+	if (cache->max_free == 0 || cache->depot_count + AMOBJCACHE_MAG_SIZE <= cache->max_free) {
+		if (!amlist_empty(&cache->empty_mags)) {
+			mag = amlist_first_entry(&cache->empty_mags, amobjcache_mag_t, link);
+			amlist_del(&mag->link);
+		}
+		else {
+			mag = malloc(sizeof(*mag));
+		}
+	}
+	if (mag != NULL) {
+		memcpy(mag->objs, &slot->objs[slot->count], sizeof(mag->objs));
+		amlist_add(&cache->full_mags, &mag->link);
+		cache->depot_count += AMOBJCACHE_MAG_SIZE;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	/* No room in the depot */
+	if (mag == NULL)
+		cache_obj_release(cache, &slot->objs[slot->count], AMOBJCACHE_MAG_SIZE);
+}
+
+amobjcache_t* amobjcache_alloc_named(ampool_t* pool, const amobjcache_config_t* config, const char* name)
+{
+	amobjcache_t* cache;
+	uint32_t i;
+
+	if (pool == NULL || config == NULL || config->size == 0)
+		return NULL;
+
+	cache = aligned_alloc(AMOBJCACHE_CACHE_LINE, sizeof(*cache));
+	if (cache == NULL)
+		return NULL;
+	memset(cache, 0, sizeof(*cache));
+
+	if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+		free(cache);
+		return NULL;
+	}
+	for (i = 0; i < AMOBJCACHE_SLOT_COUNT; i++) {
+		if (pthread_mutex_init(&cache->slots[i].mutex, NULL) != 0) {
+			while (i-- > 0)
+				pthread_mutex_destroy(&cache->slots[i].mutex);
+			pthread_mutex_destroy(&cache->mutex);
+			free(cache);
+			return NULL;
+		}
+	}
+
+	cache->pool = pool;
+	cache->name = name;
+	cache->size = config->size;
+	cache->ctor = config->ctor;
+	cache->dtor = config->dtor;
+	cache->user_data = config->user_data;
+	cache->max_free = config->max_free;
+	amlist_init(&cache->full_mags);
+	amlist_init(&cache->empty_mags);
+
+	return cache;
+}
+
+void amobjcache_free(amobjcache_t* cache)
+{
+	amobjcache_mag_t* mag;
+	uint32_t i;
+
+	if (cache == NULL)
+		return;
+
+	amobjcache_trim(cache);
+
+	while (!amlist_empty(&cache->empty_mags)) {
+		mag = amlist_first_entry(&cache->empty_mags, amobjcache_mag_t, link);
+		amlist_del(&mag->link);
+		free(mag);
+	}
+	assert(amlist_empty(&cache->full_mags));
+
+	for (i = 0; i < AMOBJCACHE_SLOT_COUNT; i++)
+		pthread_mutex_destroy(&cache->slots[i].mutex);
+	pthread_mutex_destroy(&cache->mutex);
+	free(cache);
+}
+
+void* amobjcache_get(amobjcache_t* cache)
+{
+	amobjcache_slot_t* slot = cache_slot(cache);
+	void* obj;
+
+	pthread_mutex_lock(&slot->mutex);
+	if (LIKELY(slot->count > 0) || cache_depot_take(cache, slot) == AMRC_SUCCESS) {
+		obj = slot->objs[--slot->count];
+		slot->used++;
+		pthread_mutex_unlock(&slot->mutex);
+		return obj;
+	}
+	pthread_mutex_unlock(&slot->mutex);
+
+	/* Nothing cached, a new object enters the cache. Constructed outside the lock, constructors may take a while */
+	obj = cache_obj_new(cache);
+	if (obj == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&slot->mutex);
+	slot->used++;
+	pthread_mutex_unlock(&slot->mutex);
+	return obj;
+}
+
+void amobjcache_put(amobjcache_t* cache, void* obj)
+{
+	amobjcache_slot_t* slot = cache_slot(cache);
+
+	assert(obj != NULL);
+
+	pthread_mutex_lock(&slot->mutex);
+	if (UNLIKELY(slot->count == AMOBJCACHE_SLOT_SIZE))
+		cache_depot_give(cache, slot);
+	slot->objs[slot->count++] = obj;
+	slot->used--;
+	pthread_mutex_unlock(&slot->mutex);
+}
+
+uint64_t amobjcache_trim(amobjcache_t* cache)
+{
+	amobjcache_slot_t* slot;
+	amobjcache_mag_t* mag;
+	amlist_t full_mags;
+	uint64_t released = 0;
+	uint32_t i;
+
+	for (i = 0; i < AMOBJCACHE_SLOT_COUNT; i++) {
+		slot = &cache->slots[i];
+		pthread_mutex_lock(&slot->mutex);
+		cache_obj_release(cache, slot->objs, slot->count);
+		released += slot->count;
+		slot->count = 0;
+		pthread_mutex_unlock(&slot->mutex);
+	}
+
+	/* Destructors run outside the depot lock */
+	amlist_init(&full_mags);
+	pthread_mutex_lock(&cache->mutex);
+	while (!amlist_empty(&cache->full_mags)) {
+		mag = amlist_first_entry(&cache->full_mags, amobjcache_mag_t, link);
+		amlist_del(&mag->link);
+		amlist_add(&full_mags, &mag->link);
+	}
+	cache->depot_count = 0;
+	pthread_mutex_unlock(&cache->mutex);
+
+	while (!amlist_empty(&full_mags)) {
+		mag = amlist_first_entry(&full_mags, amobjcache_mag_t, link);
+		amlist_del(&mag->link);
+		cache_obj_release(cache, mag->objs, AMOBJCACHE_MAG_SIZE);
+		released += AMOBJCACHE_MAG_SIZE;
+		free(mag);
+	}
+
+	return released;
+}
+
+void amobjcache_get_stats(amobjcache_t* cache, amobjcache_stats_t* stats)
+{
+	int64_t used = 0;
+	uint32_t i;
+
+	for (i = 0; i < AMOBJCACHE_SLOT_COUNT; i++)
+		used += cache->slots[i].used;
+
+	stats->constructed = cache->constructed;
+	stats->destructed = cache->destructed;
+	stats->used = _MAX(used, 0);
+	stats->cached = _MAX((int64_t)(stats->constructed - stats->destructed) - (int64_t)stats->used, 0);
+}
@@ -1,11 +1,19 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 #include "libam/libam_pool.h"
 #include "libam/libam_replace.h"
 #include "libam/libam_list.h"
+#include "libam/libam_lstack.h"
 #include "libam/libam_atomic.h"
 #include "libam/libam_hash.h"
 #include "libam/libam_time.h"
@@ -15,52 +23,223 @@ enum ampool_constants {
 	AMPOOL_ALIGN = 1 << AMPOOL_ALIGN_BITS,
 	AMPOOL_ALIGN_MASK = AMPOOL_ALIGN - 1,
 
+	/* Size classes: AMPOOL_STEP_COUNT steps of AMPOOL_ALIGN up to AMPOOL_MAX_STEPPED,
+	 * then AMPOOL_CLASS_SUBS geometric classes per power of two, up to the pool's ceiling */
 	AMPOOL_STEP_COUNT = 32,
+	AMPOOL_MAX_STEPPED_BITS = 9,
 	AMPOOL_MAX_STEPPED = AMPOOL_ALIGN * AMPOOL_STEP_COUNT,
+	AMPOOL_CLASS_SUB_BITS = 2,
+	AMPOOL_CLASS_SUBS = 1 << AMPOOL_CLASS_SUB_BITS,
 
 	AMPOOL_MAX_VALIDATE = 64, /* Maximum amount of data to validate for free objects */
 	AMPOOL_MAX_VALIDATE_HALF = AMPOOL_MAX_VALIDATE / 2,
 	AMPOOL_MAX_MEMSET = 1024,
+
+	AMPOOL_MAGAZINE_SIZE = 32, /* Chunks a thread may hold per size class */
+	AMPOOL_MAGAZINE_BYTES = AMPOOL_MAGAZINE_SIZE * AMPOOL_MAX_STEPPED, /* Larger classes get smaller magazines */
+
+	AMPOOL_SLAB_BITS = 16,
+	AMPOOL_SLAB_SIZE = 1 << AMPOOL_SLAB_BITS, /* Slabs are aligned to their size */
+	AMPOOL_SLAB_MASK = AMPOOL_SLAB_SIZE - 1,
+	AMPOOL_SLAB_MAX_SLOTS = AMPOOL_SLAB_SIZE / AMPOOL_ALIGN,
+
+	AMPOOL_HUGE_BITS = 21,
+	AMPOOL_HUGE_SIZE = 1 << AMPOOL_HUGE_BITS, /* AMPOOL_HUGEPAGE regions, one 2MB hugepage each */
+	AMPOOL_HUGE_MASK = AMPOOL_HUGE_SIZE - 1,
+
+	AMPOOL_GUARD_CANARY = 64, /* Bytes past a guarded chunk's data checked for overflows, as far as its slot allows */
+	AMPOOL_GUARD_XOR = 0x0F0F0F0F, /* Header magic of guarded chunks is globals.magic with these bits flipped */
+
+	AMPOOL_SHARD_COUNT = 16, /* Counter shards of AMPOOL_FAST buckets, threads are spread across them */
+	AMPOOL_CACHE_LINE = 64,
 };
 
 #define UNUSED_SYM(x) (void)(x)
 
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define AMPOOL_MAP_HUGE (AMPOOL_HUGE_BITS << MAP_HUGE_SHIFT) /* Explicit hugepages of the region size, whatever the system default */
+
 _Static_assert(is_power_of_two(AMPOOL_ALIGN), "AMPOOL_ALIGN Must be a power of two\n");
+_Static_assert(AMPOOL_MAX_STEPPED == 1 << AMPOOL_MAX_STEPPED_BITS, "AMPOOL_MAX_STEPPED_BITS mismatch\n");
+_Static_assert(AMPOOL_MAX_STEPPED * 64 <= AMPOOL_SLAB_SIZE, "Slabs must fit a reasonable number of the largest stepped chunks\n");
+_Static_assert(AMPOOL_MAX_SLAB_POOLED * 4 <= AMPOOL_SLAB_SIZE, "Slabs must fit a few of the largest pooled chunks\n");
+_Static_assert(AMPOOL_MAX_POOLED <= UINT32_MAX / 2, "Class sizes must fit chunk sizes\n");
+_Static_assert(AMPOOL_HUGE_SIZE % AMPOOL_SLAB_SIZE == 0, "Hugepage regions must hold whole slabs\n");
+_Static_assert(sizeof(amlink_t) <= AMPOOL_ALIGN, "Free compact slots must be able to hold a link\n");
+_Static_assert(sizeof(amlstack_node_t) <= sizeof(amlink_t), "Free slots of fast buckets must be able to hold a stack node\n");
 
 typedef struct ampool_chunk {
-	amlink_t link;
+	amlink_t link; /* Must be first, free lists link slots */
 	const char* name;
 	uint32_t size;
 	uint32_t magic;
 	uint8_t data[0];
 } ampool_chunk_t;
 
+typedef struct ampool_shard {
+	volatile int64_t used; /* Slots handed out of the bucket, a single shard may go negative */
+} __attribute__((aligned(AMPOOL_CACHE_LINE))) ampool_shard_t;
+
+/* Pool wide counters of a bucketed pool, spread across shards so threads do not all bounce one cache line.
+ * Summed when read, a single shard may go negative */
+typedef struct ampool_counters {
+	volatile int64_t size;
+	volatile int64_t element_count;
+	volatile int64_t node_size[AMPOOL_MAX_NODES]; /* AMPOOL_NUMA only: Bytes of stepped elements per node */
+} __attribute__((aligned(AMPOOL_CACHE_LINE))) ampool_counters_t;
+
+/* AMPOOL_HUGEPAGE: Hugepage aligned regions of a single node, the slabs of all its classes are carved out of them.
+ * Releasing a slab to the system would break its hugepage up, so released slabs are kept here for any class
+ * to reuse, and regions are only unmapped along with the pool */
+typedef struct ampool_huge {
+	pthread_mutex_t mutex; /* Taken within bucket locks */
+	amlist_t regions; /* ampool_region_t */
+	amlist_t free_slabs; /* Linked through ampool_slab_t.link */
+	uint8_t* next; /* Next slab to carve out of the newest region */
+	uint8_t* end;
+	uint64_t backed; /* Bytes of regions backed by hugepages, explicit or transparent */
+} ampool_huge_t;
+
+typedef struct ampool_region {
+	amlink_t link;
+	void* map;
+} ampool_region_t;
+
 typedef struct ampool_bucket {
 	pthread_mutex_t mutex;
 	amlist_t used_list;
 	amlist_t free_list;
+	amlist_t slab_list; /* Only with AMPOOL_SLAB, first slab is the one being carved */
+	ambool_t use_slabs;
+	ambool_t compact; /* AMPOOL_COMPACT: No chunk headers, slots are the user's objects and used_list is not kept */
+	ambool_t numa; /* AMPOOL_NUMA: Slabs prefer the bucket's node */
+	ampool_huge_t* huge; /* AMPOOL_HUGEPAGE: Regions of the bucket's node its slabs come from, NULL otherwise */
+	uint32_t node;
+	uint32_t index; /* Position in ampool_internal_t.steps, also indexes thread magazines */
+	uint32_t floor_size; /* Sizes above this, up to element_size, belong to the bucket */
+	uint32_t mag_limit; /* Slots a thread magazine may hold for this bucket */
+	uint64_t retain_bytes; /* Cap on free bytes kept for reuse, 0 for none. Only for malloc'd chunks */
+	uint64_t idle_count; /* Fewest free elements since the last trim, these were not needed all along */
+
+	/* AMPOOL_FAST: Free slots are kept on a lock-free stack rather than free_list, and used_list is not kept.
+	 * The mutex only guards carving new slots, used stats are kept in shards rather than in stats. */
+	ambool_t fast;
+	amlstack_tagged_t free_stack;
+	ampool_shard_t* shards;
 
 	ampool_bucket_stats_t stats;
 } ampool_bucket_t;
 
-typedef struct ampool_internal {
-	/* Buckets */
-	ampool_bucket_t steps[AMPOOL_STEP_COUNT];
-	ampool_bucket_t oversized;
-
-	volatile uint64_t size;
+/* A slab is a single mapping, carved into equally sized slots of one bucket.
+ * A slot holds a chunk, or with AMPOOL_COMPACT, the user's object itself.
+ * Slots are never returned to the slab individually, the whole slab is released with its bucket,
+ * or by ampool_trim() once all of its slots are free.
+ *
+ * Slabs are aligned to AMPOOL_SLAB_SIZE, so the slab of any slot is found from its address.
+ * Compact oversized objects get a slab of their own, holding a single slot. */
+typedef struct ampool_slab {
+	amlink_t link; /* ampool_bucket_t.slab_list */
+	ampool_bucket_t* bucket;
+	uint64_t map_size;
+	uint32_t stride; /* Distance between consecutive slots */
+	uint32_t capacity; /* Number of slots that fit in the slab */
+	uint32_t carved; /* Number of slots handed out of the slab so far */
+	uint32_t idle; /* Scratch of bucket_trim_slabs(), free slots of the slab */
+	volatile uint64_t used[AMPOOL_SLAB_MAX_SLOTS / 64]; /* Compact only: bitmap of slots allocated to the user */
+	uint8_t data[0] __attribute__((aligned(AMPOOL_ALIGN)));
+} ampool_slab_t;
+
+typedef struct ampool_magazine {
+	uint32_t count;
+	void* slots[AMPOOL_MAGAZINE_SIZE];
+} ampool_magazine_t;
+
+/* Per-thread cache of free stepped slots for a single pool.
+ * Parked chunks remain on their bucket's used_list, with a free magic. */
+typedef struct ampool_tcache {
+	amlink_t pool_link; /* Locked behind globals.tcache_mutex */
+	amlink_t thread_link; /* Only ever touched by the owning thread */
+	struct ampool_internal* volatile pool; /* Set to NULL once the pool is freed, the owning thread then releases the cache */
+	ampool_magazine_t mags[]; /* One per stepped bucket of the pool */
+} ampool_tcache_t;
+
+/* AMPOOL_PROFILE: Call site entry of a pool's profile table.
+ * Sampled chunks carry a pointer to their site's entry in place of their name, see chunk_site() */
+typedef struct ampool_site {
+	const char* volatile name; /* Set once, NULL while the entry is unused and for the shared last entry */
+	volatile uint64_t allocs;
+	volatile uint64_t frees;
+	volatile int64_t live_count;
+	volatile int64_t live_bytes;
+} ampool_site_t;
+
+/* AMPOOL_GUARD: Sampled chunks freed by the user are held back from reuse for a while, so writes through stale pointers show.
+ * Guarded chunks carry globals.guard_magic while allocated, and its complement while quarantined */
+typedef struct ampool_guard {
+	pthread_mutex_t mutex;
+	uint32_t rate;
+	uint32_t head; /* Next entry to fill, the oldest one once the ring is full */
+	uint32_t count;
+	ampool_chunk_t* ring[AMPOOL_GUARD_QUARANTINE];
+} ampool_guard_t;
+
+typedef struct ampool_thread {
+	amlist_t caches; /* ampool_tcache_t */
+} ampool_thread_t;
+
+/* Common part of all pool implementations, ties them into the hierarchy */
+typedef struct ampool_base {
+	volatile uint64_t size; /* Bucketed pools keep these in ampool_internal_t.counters instead */
 	volatile uint64_t element_count;
+	volatile uint64_t realloc_inplace;
+	volatile uint64_t realloc_moved;
+	volatile uint64_t trimmed;
 
-	/* Hierarchy tree - Locked behind a central hierarchy_mutex */
-	/* Potential improvements: (1) rw_lock and (2) individual mutexes rather than one for the full hierarchy */
-	struct ampool_internal* parent;
+	/* Hierarchy tree - children_list is guarded by children_lock, sibling_link by the parent's (globals.roots_lock for roots).
+	 * Walks hold read locks from the root down, so once a pool is unlinked, walks still inside it are waited out on its lock */
+	struct ampool_base* parent;
 	amlink_t sibling_link;
 	amlist_t children_list;
+	pthread_rwlock_t children_lock;
 
 	/* Pool characteristics - Fixed for the life of the pool */
 	ampool_flags_t flags;
 	const char* name;
 	ampool_t ops;
+
+	/* Implementation hooks */
+	void (*term)(struct ampool_base* base); /* Releases the pool itself, its children are already gone */
+	void (*diag)(struct ampool_base* base, ampool_diag_t* pd); /* Fills implementation specific fields, may be NULL */
+	void (*elem_diag)(struct ampool_base* base, ampool_elem_diag_cb_t callback, ampool_elem_diag_t* ed, void* user_data); /* May be NULL */
+	void (*profile)(struct ampool_base* base, ampool_profile_cb_t callback, ampool_profile_t* pp, void* user_data); /* May be NULL */
+	uint64_t (*trim)(struct ampool_base* base, ambool_t all); /* Returns bytes released, may be NULL */
+} ampool_base_t;
+
+/* Bucketed pool */
+typedef struct ampool_internal {
+	ampool_base_t base;
+
+	ampool_bucket_t oversized;
+	ampool_counters_t* counters; /* AMPOOL_SHARD_COUNT of them */
+	ampool_huge_t* huge; /* AMPOOL_HUGEPAGE only, one per node */
+
+	/* Thread caches - Locked behind globals.tcache_mutex */
+	amlist_t tcache_list;
+
+	/* AMPOOL_PROFILE only, AMPOOL_PROFILE_SITES entries */
+	ampool_site_t* sites;
+	uint32_t profile_rate;
+
+	ampool_guard_t* guard; /* AMPOOL_GUARD only, not with AMPOOL_COMPACT */
+
+	/* Class buckets, class_count per node. Without AMPOOL_NUMA, there is a single node */
+	uint32_t max_pooled; /* Size of the largest class, anything above goes to oversized */
+	uint32_t class_count;
+	uint32_t node_count;
+	uint32_t bucket_count;
+	ampool_bucket_t steps[];
 } ampool_internal_t;
 
 #ifndef container_of
@@ -71,17 +250,64 @@ typedef struct ampool_internal {
 
 typedef struct ampool_globals {
 	uint32_t magic;
+	uint32_t guard_magic; /* See ampool_guard_t */
 	amlist_t root_pools;
-	pthread_mutex_t hierarchy_mutex;
+	pthread_rwlock_t roots_lock;
+
+	pthread_mutex_t tcache_mutex;
+	pthread_key_t tcache_key; /* Releases the magazines of exiting threads */
+
+	volatile uint32_t shard_seq; /* Hands out counter shards to threads */
+
+	ampool_guard_cb_t guard_callback; /* NULL to report to stderr and abort */
+	void* guard_user_data;
+
+	uint32_t node_count; /* Online NUMA nodes, 1 when unknown */
+
+	ambool_t thp; /* Transparent hugepages are not disabled */
+	volatile ambool_t no_hugetlb; /* Explicit hugepages failed before, not reserved or exhausted */
 } ampool_globals_t;
 
 static ampool_globals_t globals;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+static __thread ampool_thread_t* tcache_thread;
+static __thread ampool_tcache_t* tcache_last;
+static __thread uint32_t shard_slot; /* 0 until assigned, shard index + 1 otherwise */
+static __thread uint32_t profile_countdown; /* Allocations of profiled pools until the next sample */
+static __thread uint32_t guard_countdown; /* Allocations of guarded pools until the next sample */
 
 static inline uint32_t align_size(uint32_t size)
 {
 	return (size + AMPOOL_ALIGN - 1) & ~AMPOOL_ALIGN_MASK;
 }
 
+/* Size class of a (non-zero) size, see AMPOOL_CLASS_SUBS */
+static inline uint32_t class_index(uint32_t size)
+{
+	uint32_t bits;
+
+	if (size <= AMPOOL_MAX_STEPPED)
+		return ((size + AMPOOL_ALIGN_MASK) >> AMPOOL_ALIGN_BITS) - 1;
+
+	bits = 31 - __builtin_clz(size - 1);
+	return AMPOOL_STEP_COUNT + (bits - AMPOOL_MAX_STEPPED_BITS) * AMPOOL_CLASS_SUBS +
+			(((size - 1) >> (bits - AMPOOL_CLASS_SUB_BITS)) & (AMPOOL_CLASS_SUBS - 1));
+}
+
+/* Largest size of a class */
+static inline uint32_t class_size(uint32_t index)
+{
+	uint32_t bits;
+
+	if (index < AMPOOL_STEP_COUNT)
+		return (index + 1) * AMPOOL_ALIGN;
+
+	index -= AMPOOL_STEP_COUNT;
+	bits = AMPOOL_MAX_STEPPED_BITS + index / AMPOOL_CLASS_SUBS;
+	return (1U << bits) + ((index % AMPOOL_CLASS_SUBS) + 1) * (1U << (bits - AMPOOL_CLASS_SUB_BITS));
+}
+
 static inline uint8_t chunk_magic_ptr(uint8_t* ptr, ambool_t data_magic)
 {
 	uint8_t ret = ((uint8_t*)(&globals.magic))[(uint64_t)ptr % sizeof(globals.magic)];
@@ -185,7 +411,249 @@ static void chunk_magic_set(ampool_chunk_t* chunk, uint32_t allocation_size, amb
 	}
 }
 
-static amrc_t bucket_init(ampool_bucket_t* bucket, uint32_t size)
+/* Allocated to the user, guarded or not (see ampool_guard_t). Chunks that are free, parked or quarantined are not */
+static inline ambool_t chunk_live(const ampool_chunk_t* chunk)
+{
+	return (chunk->magic == globals.magic || chunk->magic == globals.guard_magic);
+}
+
+/* Maps <size> bytes, aligned to <align> (a power of two, AMPOOL_SLAB_SIZE or above)
+ * @Returns pointer to mapping / NULL on error */
+static void* slab_map(uint64_t size, uint64_t align)
+{
+	uint8_t* ptr;
+	uint64_t lead;
+
+	assert((size & AMPOOL_SLAB_MASK) == 0);
+
+	/* Over-map, then trim to alignment */
+	ptr = mmap(NULL, size + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	lead = (-(uintptr_t)ptr) & (align - 1);
+	if (lead > 0)
+		munmap(ptr, lead);
+	munmap(ptr + lead + size, align - lead);
+
+	return ptr + lead;
+}
+
+/* Prefers <node> for the pages of a fresh mapping, must be called before they are touched.
+ * Failure is harmless, the kernel's first-touch placement then applies */
+static void slab_bind(void* ptr, uint64_t size, uint32_t node)
+{
+	unsigned long mask = 1UL << node;
+
+	(void)syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &mask, AMPOOL_MAX_NODES + 1, 0);
+}
+
+/* Maps a hugepage region, from the explicit hugepage pool when the system has one set up,
+ * otherwise asking for transparent hugepages. <backed> is set if hugepages are expected to back it
+ * @Returns pointer to region / NULL on error */
+static void* huge_map(ampool_bucket_t* bucket, ambool_t* backed)
+{
+	void* ptr;
+
+	if (!globals.no_hugetlb) {
+		ptr = mmap(NULL, AMPOOL_HUGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | AMPOOL_MAP_HUGE, -1, 0);
+		if (ptr != MAP_FAILED) {
+			if (bucket->numa)
+				slab_bind(ptr, AMPOOL_HUGE_SIZE, bucket->node);
+			*backed = am_true;
+			return ptr;
+		}
+		globals.no_hugetlb = am_true; /* Do not pay for a failing call per region */
+	}
+
+	ptr = slab_map(AMPOOL_HUGE_SIZE, AMPOOL_HUGE_SIZE);
+	if (ptr == NULL)
+		return NULL;
+	if (bucket->numa)
+		slab_bind(ptr, AMPOOL_HUGE_SIZE, bucket->node);
+	*backed = (globals.thp && madvise(ptr, AMPOOL_HUGE_SIZE, MADV_HUGEPAGE) == 0);
+	return ptr;
+}
+
+/* Takes a slab from the bucket's hugepage regions, a released one if any, or the next one of the newest region.
+ * @Returns slab / NULL on error */
+static ampool_slab_t* huge_slab_get(ampool_bucket_t* bucket)
+{
+	ampool_huge_t* huge = bucket->huge;
+	ampool_region_t* region;
+	ampool_slab_t* slab = NULL;
+	ambool_t backed = am_false;
+
+	pthread_mutex_lock(&huge->mutex);
+
+	if (!amlist_empty(&huge->free_slabs)) {
+		slab = amlist_first_entry(&huge->free_slabs, ampool_slab_t, link);
+		amlist_del(&slab->link);
+		memset((void*)slab->used, 0, sizeof(slab->used)); /* Live slots of a pool being freed are not cleared */
+		goto out;
+	}
+
+	if (huge->next == huge->end) {
+		region = malloc(sizeof(*region));
+		if (region == NULL)
+			goto out;
+		region->map = huge_map(bucket, &backed);
+		if (region->map == NULL) {
+			free(region);
+			goto out;
+		}
+		amlist_add(&huge->regions, &region->link);
+		huge->next = region->map;
+		huge->end = huge->next + AMPOOL_HUGE_SIZE;
+		if (backed)
+			huge->backed += AMPOOL_HUGE_SIZE;
+	}
+
+	slab = (ampool_slab_t*)huge->next;
+	huge->next += AMPOOL_SLAB_SIZE;
+
+out:
+	pthread_mutex_unlock(&huge->mutex);
+	return slab;
+}
+
+static amrc_t huge_init(ampool_huge_t* huge)
+{
+	if (pthread_mutex_init(&huge->mutex, NULL) != 0)
+		return AMRC_ERROR;
+
+	amlist_init(&huge->regions);
+	amlist_init(&huge->free_slabs);
+	huge->next = NULL;
+	huge->end = NULL;
+	huge->backed = 0;
+	return AMRC_SUCCESS;
+}
+
+/* Unmaps all regions, their slabs are all released by now */
+static void huge_term(ampool_huge_t* huge)
+{
+	ampool_region_t* region;
+
+	while (!amlist_empty(&huge->regions)) {
+		region = amlist_first_entry(&huge->regions, ampool_region_t, link);
+		amlist_del(&region->link);
+		munmap(region->map, AMPOOL_HUGE_SIZE);
+		free(region);
+	}
+	pthread_mutex_destroy(&huge->mutex);
+}
+
+static ampool_slab_t* slab_alloc(ampool_bucket_t* bucket)
+{
+	ampool_slab_t* slab;
+
+	if (bucket->huge != NULL) {
+		slab = huge_slab_get(bucket);
+		if (slab == NULL)
+			return NULL;
+	}
+	else {
+		slab = slab_map(AMPOOL_SLAB_SIZE, AMPOOL_SLAB_SIZE);
+		if (slab == NULL)
+			return NULL;
+		if (bucket->numa)
+			slab_bind(slab, AMPOOL_SLAB_SIZE, bucket->node);
+	}
+
+	slab->bucket = bucket;
+	slab->map_size = AMPOOL_SLAB_SIZE;
+	slab->stride = (bucket->compact ? 0 : sizeof(ampool_chunk_t)) + bucket->stats.element_size;
+	slab->capacity = (AMPOOL_SLAB_SIZE - sizeof(*slab)) / slab->stride;
+	slab->carved = 0;
+	return slab;
+}
+
+/* Slab holding a single compact oversized object */
+static ampool_slab_t* slab_alloc_large(ampool_bucket_t* bucket, uint32_t size)
+{
+	ampool_slab_t* slab;
+	uint64_t map_size;
+
+	map_size = (sizeof(*slab) + size + AMPOOL_SLAB_MASK) & ~((uint64_t)AMPOOL_SLAB_MASK);
+	slab = slab_map(map_size, AMPOOL_SLAB_SIZE);
+	if (slab == NULL)
+		return NULL;
+
+	slab->bucket = bucket;
+	slab->map_size = map_size;
+	slab->stride = size;
+	slab->capacity = 1;
+	slab->carved = 1;
+	return slab;
+}
+
+/* Slabs of hugepage regions go back to their region's free slabs, others are unmapped
+ * @Returns number of bytes released to the system */
+static inline uint64_t slab_free(ampool_slab_t* slab)
+{
+	ampool_huge_t* huge = slab->bucket->huge;
+	uint64_t map_size = slab->map_size;
+
+	if (huge != NULL) {
+		pthread_mutex_lock(&huge->mutex);
+		amlist_add(&huge->free_slabs, &slab->link);
+		pthread_mutex_unlock(&huge->mutex);
+		return 0;
+	}
+
+	munmap(slab, map_size);
+	return map_size;
+}
+
+static inline ampool_slab_t* chunk_slab(const void* slot)
+{
+	return (ampool_slab_t*)((uintptr_t)slot & ~((uintptr_t)AMPOOL_SLAB_MASK));
+}
+
+/* Flips the allocated bit of a compact slot.
+ * Catches double allocations and double frees, regardless of AMPOOL_VALIDATE_ON_FREE */
+static inline void slab_mark(ampool_slab_t* slab, void* slot, ambool_t used)
+{
+	uint64_t index;
+	uint64_t bit;
+	uint64_t old;
+
+	index = ((uint8_t*)slot - slab->data) / slab->stride;
+	assert(index < slab->carved && &slab->data[index * slab->stride] == slot);
+
+	bit = 1UL << (index & 63);
+	if (used)
+		old = amsync_or(&slab->used[index >> 6], bit);
+	else
+		old = amsync_and(&slab->used[index >> 6], ~bit);
+	assert(!!(old & bit) != used);
+	UNUSED_SYM(old);
+}
+
+/* Creates a new slot of the bucket's element size. Bucket must be locked.
+ * @Returns new slot / NULL on error */
+static void* bucket_slot_new(ampool_bucket_t* bucket, uint32_t size_malloc)
+{
+	ampool_slab_t* slab = NULL;
+
+	if (!bucket->use_slabs)
+		return malloc(sizeof(ampool_chunk_t) + size_malloc);
+
+	if (!amlist_empty(&bucket->slab_list))
+		slab = amlist_first_entry(&bucket->slab_list, ampool_slab_t, link);
+
+	if (slab == NULL || slab->carved == slab->capacity) {
+		slab = slab_alloc(bucket);
+		if (slab == NULL)
+			return NULL;
+		amlist_add(&bucket->slab_list, &slab->link);
+	}
+
+	return &slab->data[slab->stride * slab->carved++];
+}
+
+static amrc_t bucket_init(ampool_bucket_t* bucket, uint32_t size, uint32_t floor_size, ampool_flags_t flags, uint32_t index, uint32_t node, uint64_t retain_bytes)
 {
 	int rc;
 	rc = pthread_mutex_init(&bucket->mutex, NULL);
@@ -194,6 +662,27 @@ static amrc_t bucket_init(ampool_bucket_t* bucket, uint32_t size)
 
 	amlist_init(&bucket->used_list);
 	amlist_init(&bucket->free_list);
+	amlist_init(&bucket->slab_list);
+	amlstack_tagged_init(&bucket->free_stack);
+	bucket->compact = !!(flags & AMPOOL_COMPACT);
+	bucket->fast = (size > 0 && (flags & AMPOOL_FAST));
+	bucket->use_slabs = (size > 0 && (flags & (AMPOOL_SLAB | AMPOOL_COMPACT | AMPOOL_FAST | AMPOOL_NUMA | AMPOOL_HUGEPAGE)));
+	bucket->numa = (size > 0 && (flags & AMPOOL_NUMA));
+	bucket->node = node;
+	bucket->index = index;
+	bucket->floor_size = floor_size;
+	bucket->mag_limit = (size > 0 ? _MIN(AMPOOL_MAGAZINE_SIZE, _MAX(2, AMPOOL_MAGAZINE_BYTES / size)) : 0);
+	bucket->retain_bytes = (bucket->use_slabs ? 0 : retain_bytes);
+	bucket->idle_count = 0;
+	bucket->shards = NULL;
+	if (bucket->fast) {
+		bucket->shards = aligned_alloc(AMPOOL_CACHE_LINE, sizeof(*bucket->shards) * AMPOOL_SHARD_COUNT);
+		if (bucket->shards == NULL) {
+			pthread_mutex_destroy(&bucket->mutex);
+			return AMRC_ERROR;
+		}
+		memset(bucket->shards, 0, sizeof(*bucket->shards) * AMPOOL_SHARD_COUNT);
+	}
 	bucket->stats.element_size = size;
 	amstat_init(&bucket->stats.used_size_range);
 	amstat_init(&bucket->stats.total_size_range);
@@ -203,10 +692,19 @@ static amrc_t bucket_init(ampool_bucket_t* bucket, uint32_t size)
 	return AMRC_SUCCESS;
 }
 
-static void bucket_term_list(ampool_bucket_t* bucket, amlist_t* list, ambool_t validate, ambool_t is_used)
+/* Undoes bucket_init() of a bucket that was never used */
+static void bucket_destroy(ampool_bucket_t* bucket)
+{
+	free(bucket->shards);
+	bucket->shards = NULL;
+	pthread_mutex_destroy(&bucket->mutex);
+}
+
+static void bucket_term_list(ampool_bucket_t* bucket, amlist_t* list, ambool_t validate, ambool_t is_used, uint64_t* live_size, uint64_t* live_count)
 {
 	ampool_chunk_t* chunk;
 	uint32_t size_malloc;
+	ambool_t is_parked;
 
 	while (!amlist_empty(list)) {
 		chunk = amlist_first_entry(list, ampool_chunk_t, link);
@@ -215,7 +713,16 @@ static void bucket_term_list(ampool_bucket_t* bucket, amlist_t* list, ambool_t v
 		size_malloc = bucket->stats.element_size;
 		if (size_malloc == 0)
 			size_malloc = align_size(chunk->size);
-		chunk_magic_test(chunk, size_malloc, !is_used, validate, validate);
+
+		/* Chunks parked in thread magazines are on the used list, but carry a free magic */
+		is_parked = (is_used && !chunk_live(chunk));
+		if (chunk->magic == globals.guard_magic)
+			chunk->magic = globals.magic;
+		chunk_magic_test(chunk, size_malloc, !is_used || is_parked, validate, validate);
+		if (is_used && !is_parked) {
+			*live_size += chunk->size;
+			(*live_count)++;
+		}
 
 		bucket->stats.total_size -= chunk->size;
 		bucket->stats.total_element_count--;
@@ -225,11 +732,57 @@ static void bucket_term_list(ampool_bucket_t* bucket, amlist_t* list, ambool_t v
 			bucket->stats.used_element_count--;
 		}
 
-		free(chunk);
+		if (!bucket->use_slabs)
+			free(chunk);
+	}
+}
+
+/* Compact buckets only keep track of allocated slots in their slabs */
+static void bucket_term_slabs(ampool_bucket_t* bucket, uint64_t* live_size, uint64_t* live_count)
+{
+	ampool_slab_t* slab;
+	uint64_t used;
+	uint64_t i;
+
+	amlist_for_each_entry(slab, &bucket->slab_list, link) {
+		used = 0;
+		for (i = 0; i < ARRAY_SIZE(slab->used); i++)
+			used += __builtin_popcountl(slab->used[i]);
+		*live_size += used * slab->stride;
+		*live_count += used;
+	}
+}
+
+/* Fast buckets keep no used list, live chunks are the slots carrying an allocated magic */
+static void bucket_term_chunks(ampool_bucket_t* bucket, uint64_t* live_size, uint64_t* live_count)
+{
+	ampool_chunk_t* chunk;
+	ampool_slab_t* slab;
+	uint32_t i;
+
+	amlist_for_each_entry(slab, &bucket->slab_list, link) {
+		for (i = 0; i < slab->carved; i++) {
+			chunk = (ampool_chunk_t*)&slab->data[i * slab->stride];
+			if (!chunk_live(chunk))
+				continue;
+			*live_size += chunk->size;
+			(*live_count)++;
+		}
 	}
 }
 
-static void bucket_term(ampool_bucket_t* bucket, ambool_t validate)
+/* Slots handed out of a fast bucket, including those parked in thread magazines */
+static int64_t bucket_shards_used(ampool_bucket_t* bucket)
+{
+	int64_t used = 0;
+	uint32_t i;
+
+	for (i = 0; i < AMPOOL_SHARD_COUNT; i++)
+		used += bucket->shards[i].used;
+	return used;
+}
+
+static void bucket_term(ampool_bucket_t* bucket, ambool_t validate, uint64_t* live_size, uint64_t* live_count)
 {
 	pthread_mutex_lock(&bucket->mutex);
 
@@ -239,13 +792,54 @@ static void bucket_term(ampool_bucket_t* bucket, ambool_t validate)
 	 *
 	 * Going with killing memory, user can always check size of pool before freeing to validate */
 
-	bucket_term_list(bucket, &bucket->used_list, validate, am_true);
-	bucket_term_list(bucket, &bucket->free_list, validate, am_false);
+	if (bucket->fast) {
+		assert(bucket->stats.total_element_count == bucket_shards_used(bucket) + bucket->free_stack.size);
+		UNUSED_SYM(bucket_shards_used); /* In release build, asserts are gone */
+		free(bucket->shards);
+		bucket->shards = NULL;
+	}
+
+	if (bucket->compact) {
+		bucket_term_slabs(bucket, live_size, live_count);
+	}
+	else if (bucket->fast) {
+		bucket_term_chunks(bucket, live_size, live_count);
+	}
+	else {
+		bucket_term_list(bucket, &bucket->used_list, validate, am_true, live_size, live_count);
+		bucket_term_list(bucket, &bucket->free_list, validate, am_false, live_size, live_count);
+	}
+
+	while (!amlist_empty(&bucket->slab_list)) {
+		ampool_slab_t* slab = amlist_first_entry(&bucket->slab_list, ampool_slab_t, link);
+		amlist_del(&slab->link);
+		slab_free(slab);
+	}
 
 	pthread_mutex_unlock(&bucket->mutex);
 	pthread_mutex_destroy(&bucket->mutex);
 }
 
+/* Called whenever free elements are taken, see ampool_trim(). Bucket must be locked */
+static inline void bucket_idle_upd(ampool_bucket_t* bucket)
+{
+	uint64_t free_count;
+
+	free_count = bucket->stats.total_element_count - bucket->stats.used_element_count;
+	if (free_count < bucket->idle_count)
+		bucket->idle_count = free_count;
+}
+
+/* Readies a chunk that was just taken off a free list to be handed to the user */
+static inline void chunk_prepare(ampool_chunk_t* chunk, uint32_t size_malloc, uint32_t sub_size, const char* name, ambool_t validate)
+{
+	chunk->name = name;
+	chunk->size = sub_size;
+	chunk_magic_set(chunk, size_malloc, am_true, validate, validate);
+
+	memset(chunk->data, 0, _MIN(sub_size, AMPOOL_MAX_MEMSET));
+}
+
 static ampool_chunk_t* bucket_alloc(ampool_bucket_t* bucket, uint32_t sub_size, const char* name, ambool_t validate)
 {
 	ampool_chunk_t* chunk;
@@ -255,14 +849,12 @@ static ampool_chunk_t* bucket_alloc(ampool_bucket_t* bucket, uint32_t sub_size,
 	if (size_malloc == 0)
 		size_malloc = align_size(sub_size);
 
-	assert((size_malloc >= sub_size) && ((size_malloc - AMPOOL_ALIGN) < sub_size));
-	assert(bucket->stats.element_size == 0 || sub_size <= AMPOOL_MAX_STEPPED);
-	assert(bucket->stats.element_size > 0 || sub_size > AMPOOL_MAX_STEPPED);
+	assert(sub_size > bucket->floor_size && sub_size <= size_malloc);
 
 	pthread_mutex_lock(&bucket->mutex);
 
 	if (amlist_empty(&bucket->free_list)) {
-		chunk = malloc(sizeof(*chunk) + size_malloc);
+		chunk = bucket_slot_new(bucket, size_malloc);
 		if (chunk == NULL) {
 			pthread_mutex_unlock(&bucket->mutex);
 			return NULL;
@@ -286,22 +878,31 @@ static ampool_chunk_t* bucket_alloc(ampool_bucket_t* bucket, uint32_t sub_size,
 	amstat_upd(&bucket->stats.used_element_count_range, bucket->stats.used_element_count);
 	bucket->stats.used_size += sub_size;
 	amstat_upd(&bucket->stats.used_size_range, bucket->stats.used_size);
+	bucket_idle_upd(bucket);
 
 	pthread_mutex_unlock(&bucket->mutex);
 
-	chunk->name = name;
-	chunk->size = sub_size;
-	chunk_magic_set(chunk, size_malloc, am_true, validate, validate);
+	chunk_prepare(chunk, size_malloc, sub_size, name, validate);
+	return chunk;
+}
 
-	memset(chunk->data, 0, _MIN(sub_size, AMPOOL_MAX_MEMSET));
+/* Whether one more free chunk would exceed the bucket's retention cap. Bucket must be locked */
+static inline ambool_t bucket_over_retention(ampool_bucket_t* bucket)
+{
+	uint64_t free_count;
 
-	return chunk;
+	if (bucket->retain_bytes == 0)
+		return am_false;
+
+	free_count = bucket->stats.total_element_count - bucket->stats.used_element_count;
+	return ((free_count + 1) * bucket->stats.element_size > bucket->retain_bytes);
 }
 
 static void bucket_free(ampool_bucket_t* bucket, void* ptr, ambool_t validate)
 {
 	ampool_chunk_t* chunk;
 	uint32_t size_malloc;
+	ambool_t release;
 
 	chunk = container_of(ptr, ampool_chunk_t, data[0]);
 
@@ -309,12 +910,15 @@ static void bucket_free(ampool_bucket_t* bucket, void* ptr, ambool_t validate)
 	if (size_malloc == 0)
 		size_malloc = align_size(chunk->size);
 
-	assert((size_malloc >= chunk->size) && ((size_malloc - AMPOOL_ALIGN) < chunk->size));
-	assert(bucket->stats.element_size == 0 || chunk->size <= AMPOOL_MAX_STEPPED);
-	assert(bucket->stats.element_size > 0 || chunk->size > AMPOOL_MAX_STEPPED);
+	assert(chunk->size > bucket->floor_size && chunk->size <= size_malloc);
+	assert(!bucket->use_slabs || chunk_slab(chunk)->bucket == bucket);
 
 	chunk_magic_test(chunk, size_malloc, am_false, validate, validate);
 
+	/* Must be marked before it is published on the free list, other threads may pick it up right away */
+	if (bucket->stats.element_size > 0)
+		chunk_magic_set(chunk, size_malloc, am_false, validate, validate);
+
 	pthread_mutex_lock(&bucket->mutex);
 
 	bucket->stats.used_element_count--;
@@ -324,271 +928,2188 @@ static void bucket_free(ampool_bucket_t* bucket, void* ptr, ambool_t validate)
 
 	amlist_del(&chunk->link);
 
-	if (bucket->stats.element_size > 0)
+	release = (bucket->stats.element_size == 0 || bucket_over_retention(bucket));
+	if (!release) {
 		amlist_add(&bucket->free_list, &chunk->link);
+	}
+	else if (bucket->stats.element_size > 0) {
+		bucket->stats.total_element_count--;
+		amstat_upd(&bucket->stats.total_element_count_range, bucket->stats.total_element_count);
+		bucket->stats.total_size -= chunk->size;
+		amstat_upd(&bucket->stats.total_size_range, bucket->stats.total_size);
+	}
 
 	pthread_mutex_unlock(&bucket->mutex);
 
-	if (bucket->stats.element_size > 0)
-		chunk_magic_set(chunk, size_malloc, am_false, validate, validate);
-	else
+	if (release)
 		free(chunk);
 }
 
-static ampool_bucket_t* ampool_get_bucket(ampool_internal_t* pool, uint32_t size)
-{
-	assert((size & AMPOOL_ALIGN_MASK) == 0);
-
-	if (size <= AMPOOL_MAX_STEPPED) {
-		/* Search fixed buckets */
-		return &pool->steps[(size >> AMPOOL_ALIGN_BITS) - 1];
-	}
-	return &pool->oversized;
-}
-
-static void* ampool_op_alloc(ampool_t* ops, uint32_t size, const char* name)
+/* Bulk counterpart of bucket_alloc(), taking the bucket lock once.
+ * @Returns number of chunks allocated, their data is set in <ptrs> */
+static uint32_t bucket_alloc_bulk(ampool_bucket_t* bucket, uint32_t sub_size, uint32_t count, void** ptrs, const char* name, ambool_t validate)
 {
-	ampool_internal_t* pool = container_of(ops, ampool_internal_t, ops);
-	uint32_t aligned_size;
-	ampool_bucket_t* bucket;
 	ampool_chunk_t* chunk;
+	uint32_t size_malloc;
+	uint32_t carved = 0;
+	uint32_t i;
 
-	if (size == 0)
-		return NULL;
+	size_malloc = bucket->stats.element_size;
+	assert(size_malloc > 0 && sub_size > bucket->floor_size && sub_size <= size_malloc);
 
-	aligned_size = align_size(size);
+	pthread_mutex_lock(&bucket->mutex);
 
-	bucket = ampool_get_bucket(pool, aligned_size);
-	assert(bucket);
+	for (i = 0; i < count; i++) {
+		if (amlist_empty(&bucket->free_list)) {
+			chunk = bucket_slot_new(bucket, size_malloc);
+			if (chunk == NULL)
+				break;
+			carved++;
+		}
+		else {
+			chunk = amlist_first_entry(&bucket->free_list, ampool_chunk_t, link);
+			amlist_del(&chunk->link);
 
-	chunk = bucket_alloc(bucket, size, name, !!(pool->flags & AMPOOL_VALIDATE_ON_FREE));
-	if (chunk == NULL)
-		return NULL;
+			chunk_magic_test(chunk, size_malloc, am_true, validate, validate);
+		}
 
-	amsync_add(&pool->size, size);
-	amsync_inc(&pool->element_count);
-	return chunk->data;
-}
+		amlist_add(&bucket->used_list, &chunk->link);
+		ptrs[i] = chunk;
+	}
+	count = i;
 
-static void	ampool_op_free(ampool_t* ops, void * ptr, uint32_t size)
-{
-	ampool_internal_t* pool = container_of(ops, ampool_internal_t, ops);
-	uint32_t aligned_size;
-	ampool_bucket_t* bucket;
+	if (carved > 0) {
+		bucket->stats.total_element_count += carved;
+		amstat_upd(&bucket->stats.total_element_count_range, bucket->stats.total_element_count);
+		bucket->stats.total_size += (uint64_t)carved * sub_size;
+		amstat_upd(&bucket->stats.total_size_range, bucket->stats.total_size);
+	}
 
-	aligned_size = align_size(size);
+	bucket->stats.used_element_count += count;
+	amstat_upd(&bucket->stats.used_element_count_range, bucket->stats.used_element_count);
+	bucket->stats.used_size += (uint64_t)count * sub_size;
+	amstat_upd(&bucket->stats.used_size_range, bucket->stats.used_size);
+	bucket_idle_upd(bucket);
 
-	bucket = ampool_get_bucket(pool, aligned_size);
-	assert(bucket);
-	bucket_free(bucket, ptr, !!(pool->flags & AMPOOL_VALIDATE_ON_FREE));
+	pthread_mutex_unlock(&bucket->mutex);
 
-	amsync_sub(&pool->size, size);
-	amsync_dec(&pool->element_count);
+	for (i = 0; i < count; i++) {
+		chunk = ptrs[i];
+		chunk_prepare(chunk, size_malloc, sub_size, name, validate);
+		ptrs[i] = chunk->data;
+	}
+	return count;
 }
 
-static void* ampool_op_realloc(ampool_t* ops, void * ptr, uint32_t old_size, uint32_t new_size, const char* name)
+/* Bulk counterpart of bucket_free(), taking the bucket lock once.
+ * @Returns total size of the chunks */
+static uint64_t bucket_free_bulk(ampool_bucket_t* bucket, void** ptrs, uint32_t count, ambool_t validate)
 {
-	void* newptr;
-	uint32_t min;
+	ampool_chunk_t* chunk;
+	amlist_t released;
+	uint32_t size_malloc;
+	uint64_t size = 0;
+	uint32_t i;
 
-	min = _MIN(old_size, new_size);
-	newptr = ops->alloc(ops, new_size, name);
-	if (newptr != NULL) {
-		memcpy(newptr, ptr, min);
-		memset(((uint8_t*)newptr) + min, 0, new_size - min);
-	}
+	size_malloc = bucket->stats.element_size;
+	assert(size_malloc > 0);
 
-	ops->free(ops, ptr, old_size);
-	return newptr;
-}
+	for (i = 0; i < count; i++) {
+		chunk = container_of(ptrs[i], ampool_chunk_t, data[0]);
+		assert(chunk->size > bucket->floor_size && chunk->size <= size_malloc);
+		assert(!bucket->use_slabs || chunk_slab(chunk)->bucket == bucket);
 
-static uint64_t ampool_op_get_size(ampool_t* ops)
-{
-	ampool_internal_t* pool = container_of(ops, ampool_internal_t, ops);
-	return pool->size;
-}
+		chunk_magic_test(chunk, size_malloc, am_false, validate, validate);
+		chunk_magic_set(chunk, size_malloc, am_false, validate, validate);
+		size += chunk->size;
+	}
 
-/* Frees a pool without locking the hierarchy mutex. */
-static void _ampool_pool_free(ampool_internal_t* pool)
+	amlist_init(&released);
+
+	pthread_mutex_lock(&bucket->mutex);
+
+	for (i = 0; i < count; i++) {
+		chunk = container_of(ptrs[i], ampool_chunk_t, data[0]);
+		amlist_del(&chunk->link);
+
+		bucket->stats.used_element_count--;
+		if (bucket_over_retention(bucket)) {
+			bucket->stats.total_element_count--;
+			bucket->stats.total_size -= chunk->size;
+			amlist_add(&released, &chunk->link);
+		}
+		else {
+			amlist_add(&bucket->free_list, &chunk->link);
+		}
+	}
+
+	amstat_upd(&bucket->stats.used_element_count_range, bucket->stats.used_element_count);
+	bucket->stats.used_size -= size;
+	amstat_upd(&bucket->stats.used_size_range, bucket->stats.used_size);
+	amstat_upd(&bucket->stats.total_element_count_range, bucket->stats.total_element_count);
+	amstat_upd(&bucket->stats.total_size_range, bucket->stats.total_size);
+
+	pthread_mutex_unlock(&bucket->mutex);
+
+	while (!amlist_empty(&released)) {
+		chunk = amlist_first_entry(&released, ampool_chunk_t, link);
+		amlist_del(&chunk->link);
+		free(chunk);
+	}
+
+	return size;
+}
+
+/* Creates a free slot, ready to be handed out through a magazine. Bucket must be locked.
+ * @Returns new slot / NULL on error */
+static amlink_t* bucket_slot_carve(ampool_bucket_t* bucket, ambool_t validate)
+{
+	ampool_chunk_t* chunk;
+	amlink_t* slot;
+	uint32_t size_malloc;
+
+	size_malloc = bucket->stats.element_size;
+	slot = bucket_slot_new(bucket, size_malloc);
+	if (slot == NULL)
+		return NULL;
+
+	if (!bucket->compact) {
+		chunk = (ampool_chunk_t*)slot;
+		chunk->size = size_malloc;
+		chunk_magic_set(chunk, size_malloc, am_false, validate, validate);
+	}
+
+	bucket->stats.total_element_count++;
+	amstat_upd(&bucket->stats.total_element_count_range, bucket->stats.total_element_count);
+	bucket->stats.total_size += size_malloc;
+	amstat_upd(&bucket->stats.total_size_range, bucket->stats.total_size);
+
+	return slot;
+}
+
+/* Shard of the calling thread, threads are handed shards round robin */
+static inline uint32_t shard_index()
+{
+	if (UNLIKELY(shard_slot == 0))
+		shard_slot = (amsync_inc(&globals.shard_seq) % AMPOOL_SHARD_COUNT) + 1;
+	return shard_slot - 1;
+}
+
+static inline void bucket_shard_add(ampool_bucket_t* bucket, int64_t delta)
+{
+	amsync_add(&bucket->shards[shard_index()].used, delta);
+}
+
+/* AMPOOL_FAST counterpart of bucket_refill(), the bucket lock is only taken to carve new slots */
+static uint32_t bucket_fast_refill(ampool_bucket_t* bucket, void** slots, uint32_t count, ambool_t validate)
+{
+	amlink_t* slot;
+	uint32_t moved;
+
+	for (moved = 0; moved < count; moved++) {
+		slot = (amlink_t*)amlstack_tagged_pop(&bucket->free_stack);
+		if (slot == NULL) {
+			pthread_mutex_lock(&bucket->mutex);
+			slot = bucket_slot_carve(bucket, validate);
+			pthread_mutex_unlock(&bucket->mutex);
+			if (slot == NULL)
+				break;
+		}
+		slots[moved] = slot;
+	}
+
+	if (moved > 0)
+		bucket_shard_add(bucket, moved);
+	return moved;
+}
+
+/* Moves up to <count> slots from the bucket into <slots> (a magazine, or a bulk allocation), taking the bucket lock once.
+ * Accounting is done in units of element_size, as the requested sizes are not yet known.
+ * @Returns number of slots moved */
+static uint32_t bucket_refill(ampool_bucket_t* bucket, void** slots, uint32_t count, ambool_t validate)
+{
+	amlink_t* slot;
+	uint32_t size_malloc;
+	uint32_t moved;
+
+	size_malloc = bucket->stats.element_size;
+	assert(size_malloc > 0);
+
+	if (bucket->fast)
+		return bucket_fast_refill(bucket, slots, count, validate);
+
+	pthread_mutex_lock(&bucket->mutex);
+
+	for (moved = 0; moved < count; moved++) {
+		if (amlist_empty(&bucket->free_list)) {
+			slot = bucket_slot_carve(bucket, validate);
+			if (slot == NULL)
+				break;
+		}
+		else {
+			slot = bucket->free_list.next;
+			amlist_del(slot);
+		}
+
+		if (!bucket->compact)
+			amlist_add(&bucket->used_list, slot);
+		slots[moved] = slot;
+	}
+
+	if (moved > 0) {
+		bucket->stats.used_element_count += moved;
+		amstat_upd(&bucket->stats.used_element_count_range, bucket->stats.used_element_count);
+		bucket->stats.used_size += moved * size_malloc;
+		amstat_upd(&bucket->stats.used_size_range, bucket->stats.used_size);
+		bucket_idle_upd(bucket);
+	}
+
+	pthread_mutex_unlock(&bucket->mutex);
+
+	return moved;
+}
+
+/* Returns <count> slots to the bucket, taking the bucket lock once. Counterpart of bucket_refill().
+ * Chunks are expected to already carry a free magic. */
+static void bucket_release(ampool_bucket_t* bucket, void** slots, uint32_t count)
+{
+	amlink_t* slot;
+	uint32_t i;
+
+	if (bucket->fast) {
+		for (i = 0; i < count; i++)
+			amlstack_tagged_push(&bucket->free_stack, slots[i]);
+		bucket_shard_add(bucket, -(int64_t)count);
+		return;
+	}
+
+	pthread_mutex_lock(&bucket->mutex);
+
+	for (i = 0; i < count; i++) {
+		slot = slots[i];
+		if (!bucket->compact)
+			amlist_del(slot); /* From used_list */
+
+		if (bucket_over_retention(bucket)) {
+			bucket->stats.total_element_count--;
+			bucket->stats.total_size -= bucket->stats.element_size;
+			free(slot); /* Retention only applies to malloc'd chunks */
+		}
+		else {
+			amlist_add(&bucket->free_list, slot);
+		}
+		bucket->stats.used_element_count--;
+	}
+
+	amstat_upd(&bucket->stats.total_element_count_range, bucket->stats.total_element_count);
+	amstat_upd(&bucket->stats.total_size_range, bucket->stats.total_size);
+	amstat_upd(&bucket->stats.used_element_count_range, bucket->stats.used_element_count);
+	bucket->stats.used_size -= count * bucket->stats.element_size;
+	amstat_upd(&bucket->stats.used_size_range, bucket->stats.used_size);
+
+	pthread_mutex_unlock(&bucket->mutex);
+}
+
+/* Returns the <count> oldest slots of a magazine to the bucket */
+static void bucket_flush(ampool_bucket_t* bucket, ampool_magazine_t* mag, uint32_t count)
+{
+	count = _MIN(count, mag->count);
+	if (count == 0)
+		return;
+
+	bucket_release(bucket, mag->slots, count);
+	mag->count -= count;
+	memmove(&mag->slots[0], &mag->slots[count], mag->count * sizeof(mag->slots[0]));
+}
+
+/* Thread exit destructor, returns all parked chunks of the thread to their pools */
+static void tcache_thread_term(void* arg)
+{
+	ampool_thread_t* thread = arg;
+	ampool_tcache_t* cache;
+	ampool_internal_t* pool;
+	uint64_t i;
+
+	pthread_mutex_lock(&globals.tcache_mutex);
+	while (!amlist_empty(&thread->caches)) {
+		cache = amlist_first_entry(&thread->caches, ampool_tcache_t, thread_link);
+		amlist_del(&cache->thread_link);
+
+		pool = cache->pool;
+		if (pool != NULL) {
+			for (i = 0; i < pool->bucket_count; i++)
+				bucket_flush(&pool->steps[i], &cache->mags[i], AMPOOL_MAGAZINE_SIZE);
+			amlist_del(&cache->pool_link);
+		}
+		free(cache);
+	}
+	pthread_mutex_unlock(&globals.tcache_mutex);
+
+	tcache_thread = NULL;
+	tcache_last = NULL;
+	free(thread);
+}
+
+static void tcache_key_init()
+{
+	int rc;
+	rc = pthread_key_create(&globals.tcache_key, tcache_thread_term);
+	assert(rc == 0);
+	UNUSED_SYM(rc); /* In release build, asserts are gone, pleaving rc unused */
+}
+
+/* Slow path of tcache_get(), finds or creates the calling thread's cache for <pool>.
+ * @Returns cache / NULL on error */
+static ampool_tcache_t* tcache_lookup(ampool_internal_t* pool)
+{
+	ampool_thread_t* thread = tcache_thread;
+	ampool_tcache_t* cache;
+	ampool_tcache_t* next;
+
+	if (thread == NULL) {
+		thread = malloc(sizeof(*thread));
+		if (thread == NULL)
+			return NULL;
+		amlist_init(&thread->caches);
+		if (pthread_setspecific(globals.tcache_key, thread) != 0) {
+			free(thread);
+			return NULL;
+		}
+		tcache_thread = thread;
+	}
+
+	/* Search, releasing caches of pools freed in the meantime */
+	cache = amlist_first_entry(&thread->caches, ampool_tcache_t, thread_link);
+	while (&cache->thread_link != &thread->caches) {
+		next = amlist_entry(cache->thread_link.next, ampool_tcache_t, thread_link);
+		if (cache->pool == pool) {
+			tcache_last = cache;
+			return cache;
+		}
+		if (cache->pool == NULL) {
+			amlist_del(&cache->thread_link);
+			if (tcache_last == cache)
+				tcache_last = NULL;
+			free(cache);
+		}
+		cache = next;
+	}
+
+	cache = malloc(sizeof(*cache) + pool->bucket_count * sizeof(cache->mags[0]));
+	if (cache == NULL)
+		return NULL;
+	memset(cache, 0, sizeof(*cache) + pool->bucket_count * sizeof(cache->mags[0]));
+	cache->pool = pool;
+
+	pthread_mutex_lock(&globals.tcache_mutex);
+	amlist_add(&pool->tcache_list, &cache->pool_link);
+	pthread_mutex_unlock(&globals.tcache_mutex);
+
+	amlist_add(&thread->caches, &cache->thread_link);
+	tcache_last = cache;
+	return cache;
+}
+
+static inline ampool_tcache_t* tcache_get(ampool_internal_t* pool)
+{
+	ampool_tcache_t* cache = tcache_last;
+
+	if (LIKELY(cache != NULL && cache->pool == pool))
+		return cache;
+	return tcache_lookup(pool);
+}
+
+/* Detaches all thread caches from a pool that is being freed.
+ * Parked chunks are still on the buckets' used lists, and are released along with them. */
+static void tcache_pool_term(ampool_internal_t* pool)
+{
+	ampool_tcache_t* cache;
+
+	pthread_mutex_lock(&globals.tcache_mutex);
+	while (!amlist_empty(&pool->tcache_list)) {
+		cache = amlist_first_entry(&pool->tcache_list, ampool_tcache_t, pool_link);
+		amlist_del(&cache->pool_link);
+		amsync();
+		cache->pool = NULL; /* Last access, owning thread may release the cache from here on */
+	}
+	pthread_mutex_unlock(&globals.tcache_mutex);
+}
+
+/* Takes a free slot through the calling thread's magazine when the pool has AMPOOL_THREAD_CACHE,
+ * or straight from the bucket otherwise.
+ * @Returns slot / NULL on error */
+static void* bucket_take(ampool_internal_t* pool, ampool_bucket_t* bucket, ambool_t validate)
+{
+	ampool_magazine_t local = { .count = 0 };
+	ampool_magazine_t* mag = &local;
+	ampool_tcache_t* cache = NULL;
+
+	if (pool->base.flags & AMPOOL_THREAD_CACHE)
+		cache = tcache_get(pool);
+	if (LIKELY(cache != NULL))
+		mag = &cache->mags[bucket->index];
+
+	if (mag->count == 0)
+		mag->count = bucket_refill(bucket, mag->slots, (cache != NULL ? bucket->mag_limit / 2 : 1), validate);
+	if (mag->count == 0)
+		return NULL;
+
+	return mag->slots[--mag->count];
+}
+
+/* Counterpart of bucket_take() */
+static void bucket_put(ampool_internal_t* pool, ampool_bucket_t* bucket, void* slot)
+{
+	ampool_magazine_t local = { .count = 0 };
+	ampool_magazine_t* mag = &local;
+	ampool_tcache_t* cache = NULL;
+
+	if (pool->base.flags & AMPOOL_THREAD_CACHE)
+		cache = tcache_get(pool);
+	if (LIKELY(cache != NULL))
+		mag = &cache->mags[bucket->index];
+
+	if (mag->count == bucket->mag_limit)
+		bucket_flush(bucket, mag, bucket->mag_limit / 2);
+	mag->slots[mag->count++] = slot;
+
+	if (UNLIKELY(cache == NULL))
+		bucket_flush(bucket, mag, 1);
+}
+
+/* Bulk counterpart of bucket_take(), the thread's magazine is drained first and the rest is taken from the bucket at once.
+ * @Returns number of slots taken */
+static uint32_t bucket_take_bulk(ampool_internal_t* pool, ampool_bucket_t* bucket, void** slots, uint32_t count, ambool_t validate)
+{
+	ampool_magazine_t* mag;
+	ampool_tcache_t* cache = NULL;
+	uint32_t taken = 0;
+
+	if (pool->base.flags & AMPOOL_THREAD_CACHE)
+		cache = tcache_get(pool);
+	if (cache != NULL) {
+		mag = &cache->mags[bucket->index];
+		while (taken < count && mag->count > 0)
+			slots[taken++] = mag->slots[--mag->count];
+	}
+
+	if (taken < count)
+		taken += bucket_refill(bucket, &slots[taken], count - taken, validate);
+	return taken;
+}
+
+/* Bulk counterpart of bucket_put(), whatever does not fit in the thread's magazine is returned to the bucket at once */
+static void bucket_put_bulk(ampool_internal_t* pool, ampool_bucket_t* bucket, void** slots, uint32_t count)
+{
+	ampool_magazine_t* mag;
+	ampool_tcache_t* cache = NULL;
+
+	if (pool->base.flags & AMPOOL_THREAD_CACHE)
+		cache = tcache_get(pool);
+	if (cache != NULL) {
+		mag = &cache->mags[bucket->index];
+		while (count > 0 && mag->count < bucket->mag_limit)
+			mag->slots[mag->count++] = slots[--count];
+	}
+
+	if (count > 0)
+		bucket_release(bucket, slots, count);
+}
+
+/* Chunk allocation through bucket_take(), for pools with AMPOOL_THREAD_CACHE or AMPOOL_FAST */
+static ampool_chunk_t* bucket_take_chunk(ampool_internal_t* pool, ampool_bucket_t* bucket, uint32_t sub_size, const char* name, ambool_t validate)
+{
+	ampool_chunk_t* chunk;
+	uint32_t size_malloc;
+
+	size_malloc = bucket->stats.element_size;
+	assert(sub_size > bucket->floor_size && sub_size <= size_malloc);
+
+	chunk = bucket_take(pool, bucket, validate);
+	if (chunk == NULL)
+		return NULL;
+
+	chunk_magic_test(chunk, size_malloc, am_true, validate, validate);
+	chunk_prepare(chunk, size_malloc, sub_size, name, validate);
+	return chunk;
+}
+
+static void bucket_put_chunk(ampool_internal_t* pool, ampool_bucket_t* bucket, void* ptr, ambool_t validate)
+{
+	ampool_chunk_t* chunk;
+	uint32_t size_malloc;
+
+	chunk = container_of(ptr, ampool_chunk_t, data[0]);
+	size_malloc = bucket->stats.element_size;
+	assert(chunk->size > bucket->floor_size && chunk->size <= size_malloc);
+	assert(!bucket->use_slabs || chunk_slab(chunk)->bucket == bucket);
+
+	chunk_magic_test(chunk, size_malloc, am_false, validate, validate);
+	chunk_magic_set(chunk, size_malloc, am_false, validate, validate);
+
+	bucket_put(pool, bucket, chunk);
+}
+
+/* Header-free allocation, see AMPOOL_COMPACT.
+ * @Returns object / NULL on error. <accounted> is set to the size accounted for the object */
+static void* compact_alloc(ampool_internal_t* pool, ampool_bucket_t* bucket, uint32_t size, uint32_t* accounted)
+{
+	ampool_slab_t* slab;
+	void* obj;
+
+	if (bucket == &pool->oversized) {
+		slab = slab_alloc_large(bucket, size);
+		if (slab == NULL)
+			return NULL;
+
+		pthread_mutex_lock(&bucket->mutex);
+		amlist_add(&bucket->slab_list, &slab->link);
+
+		bucket->stats.total_element_count++;
+		amstat_upd(&bucket->stats.total_element_count_range, bucket->stats.total_element_count);
+		bucket->stats.total_size += size;
+		amstat_upd(&bucket->stats.total_size_range, bucket->stats.total_size);
+		bucket->stats.used_element_count++;
+		amstat_upd(&bucket->stats.used_element_count_range, bucket->stats.used_element_count);
+		bucket->stats.used_size += size;
+		amstat_upd(&bucket->stats.used_size_range, bucket->stats.used_size);
+
+		pthread_mutex_unlock(&bucket->mutex);
+
+		obj = slab->data;
+		*accounted = size;
+	}
+	else {
+		obj = bucket_take(pool, bucket, am_false);
+		if (obj == NULL)
+			return NULL;
+
+		slab = chunk_slab(obj);
+		*accounted = bucket->stats.element_size;
+	}
+
+	slab_mark(slab, obj, am_true);
+	memset(obj, 0, _MIN(size, AMPOOL_MAX_MEMSET));
+	return obj;
+}
+
+/* Header-free release, the owning bucket is found through the slab of the object.
+ * @Returns size accounted for the object */
+static uint32_t compact_free(ampool_internal_t* pool, void* obj)
+{
+	ampool_slab_t* slab;
+	ampool_bucket_t* bucket;
+	uint32_t size;
+
+	slab = chunk_slab(obj);
+	bucket = slab->bucket;
+	assert(bucket == &pool->oversized || (bucket >= &pool->steps[0] && bucket < &pool->steps[pool->bucket_count]));
+
+	slab_mark(slab, obj, am_false);
+
+	if (bucket != &pool->oversized) {
+		bucket_put(pool, bucket, obj);
+		return bucket->stats.element_size;
+	}
+
+	size = slab->stride;
+
+	pthread_mutex_lock(&bucket->mutex);
+	amlist_del(&slab->link);
+
+	bucket->stats.total_element_count--;
+	amstat_upd(&bucket->stats.total_element_count_range, bucket->stats.total_element_count);
+	bucket->stats.total_size -= size;
+	amstat_upd(&bucket->stats.total_size_range, bucket->stats.total_size);
+	bucket->stats.used_element_count--;
+	amstat_upd(&bucket->stats.used_element_count_range, bucket->stats.used_element_count);
+	bucket->stats.used_size -= size;
+	amstat_upd(&bucket->stats.used_size_range, bucket->stats.used_size);
+
+	pthread_mutex_unlock(&bucket->mutex);
+
+	slab_free(slab);
+	return size;
+}
+
+/* Size accounted by the pool for an allocation */
+static uint32_t ampool_ptr_size(ampool_internal_t* pool, void* ptr)
+{
+	if (pool->base.flags & AMPOOL_COMPACT)
+		return chunk_slab(ptr)->stride;
+	return container_of(ptr, ampool_chunk_t, data[0])->size;
+}
+
+/* NUMA node of the calling thread, within the pool's nodes */
+static inline uint32_t ampool_node(ampool_internal_t* pool)
+{
+	unsigned int cpu;
+	unsigned int node;
+
+	if (pool->node_count <= 1)
+		return 0;
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 29)
+	if (getcpu(&cpu, &node) != 0)
+		return 0;
+#else
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+		return 0;
+#endif
+	return node % pool->node_count;
+}
+
+/* Bucket to allocate <size> from, class buckets are taken from the caller's node */
+static ampool_bucket_t* ampool_get_bucket(ampool_internal_t* pool, uint32_t size)
+{
+	assert((size & AMPOOL_ALIGN_MASK) == 0);
+
+	if (size <= pool->max_pooled) {
+		/* Search class buckets */
+		return &pool->steps[ampool_node(pool) * pool->class_count + class_index(size)];
+	}
+	return &pool->oversized;
+}
+
+/* Bucket a chunk is to be returned to. With AMPOOL_NUMA, it is the bucket it came from, rather than the caller's */
+static inline ampool_bucket_t* ampool_chunk_bucket(ampool_internal_t* pool, void* ptr, uint32_t size)
+{
+	ampool_bucket_t* bucket;
+
+	bucket = ampool_get_bucket(pool, align_size(size));
+	if ((pool->base.flags & AMPOOL_NUMA) && bucket != &pool->oversized)
+		bucket = chunk_slab(container_of(ptr, ampool_chunk_t, data[0]))->bucket;
+	return bucket;
+}
+
+/* Accounts <count> elements of <size> bytes in total to the calling thread's shard of the pool counters.
+ * With AMPOOL_NUMA, stepped elements are also accounted to their bucket's node */
+static inline void ampool_account(ampool_internal_t* pool, ampool_bucket_t* bucket, int64_t size, int64_t count)
+{
+	ampool_counters_t* counters = &pool->counters[shard_index()];
+
+	amsync_add(&counters->size, size);
+	if (count != 0)
+		amsync_add(&counters->element_count, count);
+	if ((pool->base.flags & AMPOOL_NUMA) && bucket != &pool->oversized)
+		amsync_add(&counters->node_size[bucket->node], size);
+}
+
+/* Sums the shards of the pool counters, <node_size> may be NULL */
+static void ampool_counters_sum(ampool_internal_t* pool, uint64_t* size, uint64_t* element_count, uint64_t* node_size)
+{
+	int64_t sizes = 0;
+	int64_t count = 0;
+	uint32_t i;
+	uint32_t j;
+
+	if (node_size != NULL)
+		memset(node_size, 0, sizeof(*node_size) * AMPOOL_MAX_NODES);
+
+	for (i = 0; i < AMPOOL_SHARD_COUNT; i++) {
+		sizes += pool->counters[i].size;
+		count += pool->counters[i].element_count;
+		for (j = 0; node_size != NULL && j < pool->node_count; j++)
+			node_size[j] += pool->counters[i].node_size[j];
+	}
+
+	/* Shards are read one by one while they change, the total may transiently dip below 0 */
+	*size = _MAX(sizes, 0);
+	if (element_count != NULL)
+		*element_count = _MAX(count, 0);
+}
+
+/* AMPOOL_PROFILE: Entry of <name> in the pool's table, claimed on first use. Sites that do not fit share the last entry */
+static ampool_site_t* profile_site(ampool_internal_t* pool, const char* name)
+{
+	ampool_site_t* site;
+	uint64_t hash;
+	uint32_t i;
+
+	if (name == NULL)
+		return &pool->sites[AMPOOL_PROFILE_SITES - 1];
+
+	hash = ((uintptr_t)name * 0x9E3779B97F4A7C15ULL) >> 32;
+	for (i = 0; i < AMPOOL_PROFILE_SITES - 1; i++) {
+		site = &pool->sites[(hash + i) % (AMPOOL_PROFILE_SITES - 1)];
+		if (site->name == NULL)
+			amsync_swap(&site->name, NULL, name);
+		if (site->name == name)
+			return site;
+	}
+	return &pool->sites[AMPOOL_PROFILE_SITES - 1];
+}
+
+/* AMPOOL_PROFILE: Accounts 1 in profile_rate allocations of the calling thread to their site.
+ * Unless <live>, only the allocation is counted, as its free will not be known.
+ * @Returns the site of a sampled allocation / NULL if not sampled */
+static inline ampool_site_t* profile_alloc(ampool_internal_t* pool, const char* name, uint32_t size, ambool_t live)
+{
+	ampool_site_t* site;
+	uint32_t countdown;
+
+	/* The countdown is shared by the thread's profiled pools, a pool never waits longer than its own rate */
+	countdown = _MIN(profile_countdown, pool->profile_rate);
+	if (LIKELY(countdown > 1)) {
+		profile_countdown = countdown - 1;
+		return NULL;
+	}
+	profile_countdown = pool->profile_rate;
+
+	site = profile_site(pool, name);
+	amsync_inc(&site->allocs);
+	if (live) {
+		amsync_inc(&site->live_count);
+		amsync_add(&site->live_bytes, size);
+	}
+	return site;
+}
+
+/* Site entry of a sampled chunk / NULL if the chunk was not sampled */
+static inline ampool_site_t* chunk_site(ampool_internal_t* pool, const ampool_chunk_t* chunk)
+{
+	if (LIKELY(pool->sites == NULL))
+		return NULL;
+	if ((uintptr_t)chunk->name - (uintptr_t)pool->sites >= AMPOOL_PROFILE_SITES * sizeof(ampool_site_t))
+		return NULL;
+	return (ampool_site_t*)chunk->name;
+}
+
+static inline const char* chunk_name(ampool_internal_t* pool, const ampool_chunk_t* chunk)
+{
+	ampool_site_t* site = chunk_site(pool, chunk);
+	return (site != NULL ? site->name : chunk->name);
+}
+
+/* Samples a chunk that was just allocated */
+static inline void profile_chunk_alloc(ampool_internal_t* pool, ampool_chunk_t* chunk)
+{
+	ampool_site_t* site;
+
+	site = profile_alloc(pool, chunk->name, chunk->size, am_true);
+	if (site != NULL)
+		chunk->name = (const char*)site;
+}
+
+/* Counterpart of profile_chunk_alloc(), the chunk must not be released yet */
+static inline void profile_chunk_free(ampool_internal_t* pool, ampool_chunk_t* chunk)
+{
+	ampool_site_t* site;
+
+	site = chunk_site(pool, chunk);
+	if (site == NULL)
+		return;
+	amsync_inc(&site->frees);
+	amsync_dec(&site->live_count);
+	amsync_sub(&site->live_bytes, chunk->size);
+}
+
+/* AMPOOL_GUARD: Reports a corrupted chunk, through the user's callback or to stderr, then aborting */
+static void guard_report(ampool_internal_t* pool, ampool_chunk_t* chunk, ampool_guard_error_t error, uint32_t offset)
+{
+	static const char* const errors[] = {
+		[AMPOOL_GUARD_OVERFLOW] = "Overflow",
+		[AMPOOL_GUARD_USE_AFTER_FREE] = "Use after free",
+		[AMPOOL_GUARD_DOUBLE_FREE] = "Double free",
+	};
+	ampool_guard_report_t report = {
+		.pool = &pool->base.ops,
+		.pool_name = pool->base.name,
+		.elem = chunk->data,
+		.elem_name = chunk_name(pool, chunk),
+		.elem_size = chunk->size,
+		.error = error,
+		.offset = offset,
+	};
+
+	if (globals.guard_callback != NULL) {
+		globals.guard_callback(&report, globals.guard_user_data);
+		return;
+	}
+
+	fprintf(stderr, "ampool: %s at offset %u of %u byte element %p allocated at %s, pool %s\n",
+			errors[error], offset, report.elem_size, report.elem, report.elem_name, report.pool_name);
+	fflush(stderr);
+	abort();
+}
+
+/* Slot bytes available to a chunk's data, canaries go past its size */
+static inline uint32_t guard_slot_size(ampool_bucket_t* bucket, ampool_chunk_t* chunk)
+{
+	return (bucket->stats.element_size > 0 ? bucket->stats.element_size : align_size(chunk->size));
+}
+
+/* Checks <len> bytes at <offset> of the chunk's data against their magic, in the allocated or free state.
+ * @Returns am_true if they are intact, otherwise reports them */
+static ambool_t guard_test(ampool_internal_t* pool, ampool_chunk_t* chunk, uint32_t offset, uint32_t len, ambool_t allocated, ampool_guard_error_t error)
+{
+	uint8_t expected;
+	uint32_t i;
+
+	for (i = offset; i < offset + len; i++) {
+		chunk_magic_get_values(&chunk->data[i], am_false, !allocated, &expected, NULL);
+		if (UNLIKELY(chunk->data[i] != expected)) {
+			guard_report(pool, chunk, error, i);
+			return am_false;
+		}
+	}
+	return am_true;
+}
+
+/* Guards an allocated chunk, placing a canary past its data.
+ * The canary matches the overflow magic of AMPOOL_VALIDATE_ON_FREE, so the two do not get in each other's way */
+static inline void guard_place(ampool_bucket_t* bucket, ampool_chunk_t* chunk)
+{
+	uint32_t slot;
+
+	slot = guard_slot_size(bucket, chunk);
+	chunk_magic_set_len(&chunk->data[chunk->size], _MIN(slot - chunk->size, AMPOOL_GUARD_CANARY), am_false, am_true);
+	chunk->magic = globals.guard_magic;
+}
+
+/* Checks the canary of a guarded chunk, and turns it back into a plain allocated chunk */
+static inline void guard_strip(ampool_internal_t* pool, ampool_bucket_t* bucket, ampool_chunk_t* chunk)
+{
+	uint32_t slot;
+
+	slot = guard_slot_size(bucket, chunk);
+	guard_test(pool, chunk, chunk->size, _MIN(slot - chunk->size, AMPOOL_GUARD_CANARY), am_true, AMPOOL_GUARD_OVERFLOW);
+	chunk->magic = globals.magic;
+}
+
+/* Guards 1 in guard rate allocations of the calling thread */
+static inline void guard_alloc(ampool_internal_t* pool, ampool_bucket_t* bucket, ampool_chunk_t* chunk)
+{
+	uint32_t countdown;
+
+	/* Shared by the thread's guarded pools, like profile_countdown */
+	countdown = _MIN(guard_countdown, pool->guard->rate);
+	if (LIKELY(countdown > 1)) {
+		guard_countdown = countdown - 1;
+		return;
+	}
+	guard_countdown = pool->guard->rate;
+
+	guard_place(bucket, chunk);
+}
+
+static inline ambool_t chunk_guarded(const ampool_chunk_t* chunk)
+{
+	return (chunk->magic == globals.guard_magic || chunk->magic == ~globals.guard_magic);
+}
+
+/* Releases a chunk leaving the quarantine, after checking nothing wrote to it meanwhile */
+static void guard_release(ampool_internal_t* pool, ampool_chunk_t* chunk)
+{
+	ambool_t validate = !!(pool->base.flags & AMPOOL_VALIDATE_ON_FREE);
+	ampool_bucket_t* bucket;
+	uint32_t slot;
+
+	bucket = ampool_chunk_bucket(pool, chunk->data, chunk->size);
+	slot = guard_slot_size(bucket, chunk);
+
+	if (guard_test(pool, chunk, 0, _MIN(chunk->size, AMPOOL_MAX_MEMSET), am_false, AMPOOL_GUARD_USE_AFTER_FREE))
+		guard_test(pool, chunk, chunk->size, _MIN(slot - chunk->size, AMPOOL_GUARD_CANARY), am_false, AMPOOL_GUARD_USE_AFTER_FREE);
+
+	/* Back to a plain allocated chunk, as the usual free path expects */
+	chunk_magic_set_len(&chunk->data[chunk->size], _MIN(slot - chunk->size, AMPOOL_GUARD_CANARY), am_false, am_true);
+	chunk->magic = globals.magic;
+
+	if ((pool->base.flags & (AMPOOL_THREAD_CACHE | AMPOOL_FAST)) && bucket != &pool->oversized)
+		bucket_put_chunk(pool, bucket, chunk->data, validate);
+	else
+		bucket_free(bucket, chunk->data, validate);
+}
+
+/* Frees a guarded chunk: checks its canary, poisons it and quarantines it, releasing the oldest quarantined chunk instead.
+ * @Returns am_false if the chunk was already quarantined, and the free is to be ignored */
+static ambool_t guard_free(ampool_internal_t* pool, ampool_bucket_t* bucket, ampool_chunk_t* chunk)
+{
+	ampool_guard_t* guard = pool->guard;
+	ampool_chunk_t* evicted = NULL;
+	uint32_t slot;
+
+	if (chunk->magic != globals.guard_magic) {
+		guard_report(pool, chunk, AMPOOL_GUARD_DOUBLE_FREE, 0);
+		return am_false;
+	}
+
+	guard_strip(pool, bucket, chunk);
+	profile_chunk_free(pool, chunk);
+
+	slot = guard_slot_size(bucket, chunk);
+	chunk_magic_set_len(chunk->data, _MIN(chunk->size, AMPOOL_MAX_MEMSET), am_false, am_false);
+	chunk_magic_set_len(&chunk->data[chunk->size], _MIN(slot - chunk->size, AMPOOL_GUARD_CANARY), am_false, am_false);
+	chunk->magic = ~globals.guard_magic;
+
+	pthread_mutex_lock(&guard->mutex);
+	if (guard->count == AMPOOL_GUARD_QUARANTINE)
+		evicted = guard->ring[guard->head];
+	else
+		guard->count++;
+	guard->ring[guard->head] = chunk;
+	guard->head = (guard->head + 1) % AMPOOL_GUARD_QUARANTINE;
+	pthread_mutex_unlock(&guard->mutex);
+
+	if (evicted != NULL)
+		guard_release(pool, evicted);
+	return am_true;
+}
+
+/* Releases all quarantined chunks, the pool is being freed */
+static void guard_drain(ampool_internal_t* pool)
+{
+	ampool_guard_t* guard = pool->guard;
+
+	for (; guard->count > 0; guard->count--)
+		guard_release(pool, guard->ring[(guard->head + AMPOOL_GUARD_QUARANTINE - guard->count) % AMPOOL_GUARD_QUARANTINE]);
+}
+
+void ampool_guard_handler(ampool_guard_cb_t callback, void* user_data)
+{
+	globals.guard_user_data = user_data;
+	globals.guard_callback = callback;
+}
+
+static void* ampool_op_alloc(ampool_t* ops, uint32_t size, const char* name)
+{
+	ampool_internal_t* pool = container_of(ops, ampool_internal_t, base.ops);
+	uint32_t aligned_size;
+	ampool_bucket_t* bucket;
+	ampool_chunk_t* chunk;
+	void* ptr;
+
+	if (size == 0)
+		return NULL;
+
+	aligned_size = align_size(size);
+
+	bucket = ampool_get_bucket(pool, aligned_size);
+	assert(bucket);
+
+	if (pool->base.flags & AMPOOL_COMPACT) {
+		ptr = compact_alloc(pool, bucket, size, &size);
+		if (ptr == NULL)
+			return NULL;
+		if (UNLIKELY(pool->sites != NULL))
+			profile_alloc(pool, name, size, am_false);
+	}
+	else {
+		if ((pool->base.flags & (AMPOOL_THREAD_CACHE | AMPOOL_FAST)) && bucket != &pool->oversized)
+			chunk = bucket_take_chunk(pool, bucket, size, name, !!(pool->base.flags & AMPOOL_VALIDATE_ON_FREE));
+		else
+			chunk = bucket_alloc(bucket, size, name, !!(pool->base.flags & AMPOOL_VALIDATE_ON_FREE));
+		if (chunk == NULL)
+			return NULL;
+		if (UNLIKELY(pool->sites != NULL))
+			profile_chunk_alloc(pool, chunk);
+		if (UNLIKELY(pool->guard != NULL))
+			guard_alloc(pool, bucket, chunk);
+		ptr = chunk->data;
+	}
+
+	ampool_account(pool, bucket, size, 1);
+	return ptr;
+}
+
+static void	ampool_op_free(ampool_t* ops, void * ptr, uint32_t size)
+{
+	ampool_internal_t* pool = container_of(ops, ampool_internal_t, base.ops);
+	ampool_bucket_t* bucket;
+	ampool_chunk_t* chunk;
+
+	if (pool->base.flags & AMPOOL_COMPACT) {
+		bucket = chunk_slab(ptr)->bucket;
+		size = compact_free(pool, ptr);
+	}
+	else {
+		chunk = container_of(ptr, ampool_chunk_t, data[0]);
+		if (size == 0)
+			size = chunk->size;
+
+		bucket = ampool_chunk_bucket(pool, ptr, size);
+		assert(bucket);
+		if (UNLIKELY(pool->guard != NULL) && chunk_guarded(chunk)) {
+			if (!guard_free(pool, bucket, chunk))
+				return;
+		}
+		else {
+			if (UNLIKELY(pool->sites != NULL))
+				profile_chunk_free(pool, chunk);
+			if ((pool->base.flags & (AMPOOL_THREAD_CACHE | AMPOOL_FAST)) && bucket != &pool->oversized)
+				bucket_put_chunk(pool, bucket, ptr, !!(pool->base.flags & AMPOOL_VALIDATE_ON_FREE));
+			else
+				bucket_free(bucket, ptr, !!(pool->base.flags & AMPOOL_VALIDATE_ON_FREE));
+		}
+	}
+
+	ampool_account(pool, bucket, -(int64_t)size, -1);
+}
+
+/* Bucket an allocation is to be returned to, <size> may be 0 */
+static inline ampool_bucket_t* ampool_ptr_bucket(ampool_internal_t* pool, void* ptr, uint32_t size)
+{
+	if (pool->base.flags & AMPOOL_COMPACT)
+		return chunk_slab(ptr)->bucket;
+	if (size == 0)
+		size = ampool_ptr_size(pool, ptr);
+	return ampool_chunk_bucket(pool, ptr, size);
+}
+
+/* AMPOOL_GUARD: Guarded elements are freed one by one */
+static inline ambool_t ampool_ptr_guarded(ampool_internal_t* pool, void* ptr)
+{
+	return (UNLIKELY(pool->guard != NULL) && chunk_guarded(container_of(ptr, ampool_chunk_t, data[0])));
+}
+
+static void ampool_op_free_bulk(ampool_t* ops, void** ptrs, uint32_t count, uint32_t size)
+{
+	ampool_internal_t* pool = container_of(ops, ampool_internal_t, base.ops);
+	ambool_t validate = !!(pool->base.flags & AMPOOL_VALIDATE_ON_FREE);
+	void* slots[AMPOOL_MAGAZINE_SIZE];
+	ampool_bucket_t* bucket;
+	ampool_chunk_t* chunk;
+	uint64_t accounted;
+	uint32_t start;
+	uint32_t end;
+	uint32_t batch;
+	uint32_t i;
+
+	/* Runs of elements of the same bucket are freed together */
+	for (start = 0; start < count; start = end) {
+		bucket = ampool_ptr_bucket(pool, ptrs[start], size);
+		end = start + 1;
+		while (end < count && ampool_ptr_bucket(pool, ptrs[end], size) == bucket && !ampool_ptr_guarded(pool, ptrs[end]))
+			end++;
+
+		if (bucket == &pool->oversized || ampool_ptr_guarded(pool, ptrs[start])) {
+			for (i = start; i < end; i++)
+				ampool_op_free(ops, ptrs[i], size);
+			continue;
+		}
+
+		if (UNLIKELY(pool->sites != NULL) && !(pool->base.flags & AMPOOL_COMPACT)) {
+			for (i = start; i < end; i++)
+				profile_chunk_free(pool, container_of(ptrs[i], ampool_chunk_t, data[0]));
+		}
+
+		if (pool->base.flags & AMPOOL_COMPACT) {
+			for (i = start; i < end; i++)
+				slab_mark(chunk_slab(ptrs[i]), ptrs[i], am_false);
+			bucket_put_bulk(pool, bucket, &ptrs[start], end - start);
+			accounted = (uint64_t)(end - start) * bucket->stats.element_size;
+		}
+		else if (pool->base.flags & (AMPOOL_THREAD_CACHE | AMPOOL_FAST)) {
+			/* Magazines hold chunks rather than data pointers */
+			accounted = 0;
+			for (i = start; i < end; i += batch) {
+				for (batch = 0; batch < AMPOOL_MAGAZINE_SIZE && i + batch < end; batch++) {
+					chunk = container_of(ptrs[i + batch], ampool_chunk_t, data[0]);
+					assert(chunk->size > bucket->floor_size && chunk->size <= bucket->stats.element_size);
+					chunk_magic_test(chunk, bucket->stats.element_size, am_false, validate, validate);
+					chunk_magic_set(chunk, bucket->stats.element_size, am_false, validate, validate);
+					accounted += chunk->size;
+					slots[batch] = chunk;
+				}
+				bucket_put_bulk(pool, bucket, slots, batch);
+			}
+		}
+		else {
+			accounted = bucket_free_bulk(bucket, &ptrs[start], end - start, validate);
+		}
+
+		ampool_account(pool, bucket, -(int64_t)accounted, -(int64_t)(end - start));
+	}
+}
+
+static amrc_t ampool_op_alloc_bulk(ampool_t* ops, uint32_t size, uint32_t count, void** ptrs, const char* name)
+{
+	ampool_internal_t* pool = container_of(ops, ampool_internal_t, base.ops);
+	ambool_t validate = !!(pool->base.flags & AMPOOL_VALIDATE_ON_FREE);
+	ampool_bucket_t* bucket;
+	ampool_chunk_t* chunk;
+	uint32_t accounted = size;
+	uint32_t done;
+	uint32_t i;
+
+	if (count == 0)
+		return AMRC_SUCCESS;
+	if (size == 0)
+		return AMRC_ERROR;
+
+	bucket = ampool_get_bucket(pool, align_size(size));
+	assert(bucket);
+
+	if (bucket == &pool->oversized) {
+		/* Allocated one by one regardless */
+		for (done = 0; done < count; done++) {
+			ptrs[done] = ampool_op_alloc(ops, size, name);
+			if (ptrs[done] == NULL)
+				break;
+		}
+	}
+	else if (pool->base.flags & AMPOOL_COMPACT) {
+		done = bucket_take_bulk(pool, bucket, ptrs, count, am_false);
+		for (i = 0; i < done; i++) {
+			slab_mark(chunk_slab(ptrs[i]), ptrs[i], am_true);
+			memset(ptrs[i], 0, _MIN(size, AMPOOL_MAX_MEMSET));
+			if (UNLIKELY(pool->sites != NULL))
+				profile_alloc(pool, name, size, am_false);
+		}
+		accounted = bucket->stats.element_size;
+	}
+	else if (pool->base.flags & (AMPOOL_THREAD_CACHE | AMPOOL_FAST)) {
+		done = bucket_take_bulk(pool, bucket, ptrs, count, validate);
+		for (i = 0; i < done; i++) {
+			chunk = ptrs[i];
+			chunk_magic_test(chunk, bucket->stats.element_size, am_true, validate, validate);
+			chunk_prepare(chunk, bucket->stats.element_size, size, name, validate);
+			ptrs[i] = chunk->data;
+		}
+	}
+	else {
+		done = bucket_alloc_bulk(bucket, size, count, ptrs, name, validate);
+	}
+
+	if (UNLIKELY(pool->sites != NULL) && bucket != &pool->oversized && !(pool->base.flags & AMPOOL_COMPACT)) {
+		for (i = 0; i < done; i++)
+			profile_chunk_alloc(pool, container_of(ptrs[i], ampool_chunk_t, data[0]));
+	}
+	if (UNLIKELY(pool->guard != NULL) && bucket != &pool->oversized) {
+		for (i = 0; i < done; i++)
+			guard_alloc(pool, bucket, container_of(ptrs[i], ampool_chunk_t, data[0]));
+	}
+
+	if (bucket != &pool->oversized) {
+		ampool_account(pool, bucket, (int64_t)done * accounted, done);
+	}
+
+	if (done < count) {
+		ampool_op_free_bulk(ops, ptrs, done, size);
+		return AMRC_ERROR;
+	}
+	return AMRC_SUCCESS;
+}
+
+/* Resizes a chunk within its size class, only the header and overflow magic change */
+static void* chunk_resize(ampool_internal_t* pool, ampool_bucket_t* bucket, ampool_chunk_t* chunk, uint32_t new_size, const char* name, ambool_t validate)
+{
+	uint32_t old_size = chunk->size;
+
+	if (validate)
+		chunk_magic_test(chunk, bucket->stats.element_size, am_false, am_false, am_true);
+
+	/* Magazine buckets account in units of element_size, which does not change */
+	if (!(pool->base.flags & (AMPOOL_THREAD_CACHE | AMPOOL_FAST))) {
+		pthread_mutex_lock(&bucket->mutex);
+		bucket->stats.used_size += (int64_t)new_size - old_size;
+		amstat_upd(&bucket->stats.used_size_range, bucket->stats.used_size);
+		pthread_mutex_unlock(&bucket->mutex);
+	}
+
+	chunk->size = new_size;
+	chunk->name = name;
+	if (new_size > old_size)
+		memset(&chunk->data[old_size], 0, new_size - old_size);
+	if (validate)
+		chunk_magic_set(chunk, bucket->stats.element_size, am_true, am_false, am_true);
+
+	return chunk->data;
+}
+
+/* Oversized chunks are malloc'd, libc realloc may then resize them without copying (mremap for large ones).
+ * The chunk is off the used list while it is being resized.
+ * @Returns new data pointer / NULL on error, in which case the chunk is left as it was */
+static void* chunk_realloc_oversized(ampool_bucket_t* bucket, ampool_chunk_t* chunk, uint32_t new_size, const char* name, ambool_t validate)
+{
+	ampool_chunk_t* newchunk;
+	uint32_t old_size = chunk->size;
+
+	if (validate)
+		chunk_magic_test(chunk, align_size(old_size), am_false, am_false, am_true);
+
+	pthread_mutex_lock(&bucket->mutex);
+	amlist_del(&chunk->link);
+	pthread_mutex_unlock(&bucket->mutex);
+
+	newchunk = realloc(chunk, sizeof(*chunk) + align_size(new_size));
+	if (newchunk == NULL) {
+		pthread_mutex_lock(&bucket->mutex);
+		amlist_add(&bucket->used_list, &chunk->link);
+		pthread_mutex_unlock(&bucket->mutex);
+		return NULL;
+	}
+
+	newchunk->size = new_size;
+	newchunk->name = name;
+	if (new_size > old_size)
+		memset(&newchunk->data[old_size], 0, new_size - old_size);
+	if (validate)
+		chunk_magic_set(newchunk, align_size(new_size), am_true, am_false, am_true);
+
+	pthread_mutex_lock(&bucket->mutex);
+	amlist_add(&bucket->used_list, &newchunk->link);
+	bucket->stats.used_size += (int64_t)new_size - old_size;
+	amstat_upd(&bucket->stats.used_size_range, bucket->stats.used_size);
+	pthread_mutex_unlock(&bucket->mutex);
+
+	return newchunk->data;
+}
+
+/* Compact oversized objects own their slab, which grows within its mapping or through mremap without moving.
+ * @Returns am_true if resized */
+static ambool_t compact_resize_large(ampool_bucket_t* bucket, ampool_slab_t* slab, uint32_t new_size)
+{
+	uint64_t map_size;
+	void* map;
+	uint32_t old_size = slab->stride;
+
+	map_size = (sizeof(*slab) + new_size + AMPOOL_SLAB_MASK) & ~((uint64_t)AMPOOL_SLAB_MASK);
+	if (map_size > slab->map_size) {
+		map = mremap(slab, slab->map_size, map_size, 0);
+		if (map == MAP_FAILED)
+			return am_false;
+		assert(map == slab);
+		slab->map_size = map_size;
+	}
+
+	pthread_mutex_lock(&bucket->mutex);
+	slab->stride = new_size;
+	bucket->stats.total_size += (int64_t)new_size - old_size;
+	amstat_upd(&bucket->stats.total_size_range, bucket->stats.total_size);
+	bucket->stats.used_size += (int64_t)new_size - old_size;
+	amstat_upd(&bucket->stats.used_size_range, bucket->stats.used_size);
+	pthread_mutex_unlock(&bucket->mutex);
+
+	if (new_size > old_size)
+		memset(&slab->data[old_size], 0, new_size - old_size);
+	return am_true;
+}
+
+/* Resizes an allocation without copying it, when its size class allows.
+ * @Returns the (possibly moved) pointer / NULL if the allocation is to be copied */
+static void* ampool_realloc_inplace(ampool_internal_t* pool, void* ptr, uint32_t old_size, uint32_t new_size, const char* name)
+{
+	ambool_t validate = !!(pool->base.flags & AMPOOL_VALIDATE_ON_FREE);
+	ampool_bucket_t* bucket;
+	ampool_chunk_t* chunk;
+	ampool_slab_t* slab;
+	ampool_site_t* site;
+	ambool_t guarded;
+	int64_t delta;
+
+	if (pool->base.flags & AMPOOL_COMPACT) {
+		slab = chunk_slab(ptr);
+		bucket = slab->bucket;
+		if (bucket == &pool->oversized) {
+			if (new_size <= pool->max_pooled)
+				return NULL;
+			delta = (int64_t)new_size - slab->stride;
+			if (!compact_resize_large(bucket, slab, new_size))
+				return NULL;
+			ampool_account(pool, bucket, delta, 0);
+			return ptr;
+		}
+
+		/* Accounted per class, nothing changes */
+		if (new_size <= bucket->floor_size || new_size > bucket->stats.element_size)
+			return NULL;
+		if (new_size > old_size)
+			memset((uint8_t*)ptr + old_size, 0, new_size - old_size);
+		return ptr;
+	}
+
+	chunk = container_of(ptr, ampool_chunk_t, data[0]);
+
+	/* Guarded chunks keep their guard, with the canary checked and moved past the new size */
+	guarded = (UNLIKELY(pool->guard != NULL) && chunk_guarded(chunk));
+	if (guarded && chunk->magic != globals.guard_magic)
+		return NULL; /* Quarantined, the free that follows reports it */
+
+	/* A sampled chunk stays with its site */
+	site = chunk_site(pool, chunk);
+	if (site != NULL)
+		name = (const char*)site;
+
+	bucket = ampool_chunk_bucket(pool, ptr, old_size);
+	if (bucket == &pool->oversized) {
+		if (new_size <= pool->max_pooled)
+			return NULL;
+		if (guarded)
+			guard_strip(pool, bucket, chunk);
+		ptr = chunk_realloc_oversized(bucket, chunk, new_size, name, validate);
+		if (ptr == NULL) {
+			if (guarded)
+				guard_place(bucket, chunk);
+			return NULL;
+		}
+	}
+	else {
+		if (new_size <= bucket->floor_size || new_size > bucket->stats.element_size)
+			return NULL;
+		if (guarded)
+			guard_strip(pool, bucket, chunk);
+		ptr = chunk_resize(pool, bucket, chunk, new_size, name, validate);
+	}
+
+	if (guarded)
+		guard_place(bucket, container_of(ptr, ampool_chunk_t, data[0]));
+
+	if (site != NULL)
+		amsync_add(&site->live_bytes, (int64_t)new_size - old_size);
+	ampool_account(pool, bucket, (int64_t)new_size - old_size, 0);
+	return ptr;
+}
+
+static void* ampool_op_realloc(ampool_t* ops, void * ptr, uint32_t old_size, uint32_t new_size, const char* name)
+{
+	ampool_internal_t* pool = container_of(ops, ampool_internal_t, base.ops);
+	void* newptr;
+	uint32_t min;
+
+	if (old_size == 0)
+		old_size = ampool_ptr_size(pool, ptr);
+
+	if (new_size > 0) {
+		newptr = ampool_realloc_inplace(pool, ptr, old_size, new_size, name);
+		if (newptr != NULL) {
+			amsync_inc(newptr == ptr ? &pool->base.realloc_inplace : &pool->base.realloc_moved);
+			return newptr;
+		}
+	}
+
+	min = _MIN(old_size, new_size);
+	newptr = ops->alloc(ops, new_size, name);
+	if (newptr != NULL) {
+		memcpy(newptr, ptr, min);
+		memset(((uint8_t*)newptr) + min, 0, new_size - min);
+		amsync_inc(&pool->base.realloc_moved);
+	}
+
+	ops->free(ops, ptr, old_size);
+	return newptr;
+}
+
+static uint64_t ampool_op_get_size(ampool_t* ops)
+{
+	ampool_internal_t* pool = container_of(ops, ampool_internal_t, base.ops);
+	uint64_t size;
+
+	ampool_counters_sum(pool, &size, NULL, NULL);
+	return size;
+}
+
+static uint32_t ampool_op_elem_size(ampool_t* ops, const void* ptr)
+{
+	ampool_internal_t* pool = container_of(ops, ampool_internal_t, base.ops);
+	return ampool_ptr_size(pool, discard_const(ptr));
+}
+
+/* Releases a bucketed pool, see ampool_base_t.term */
+static void ampool_buckets_term(ampool_base_t* base)
+{
+	ampool_internal_t* pool = container_of(base, ampool_internal_t, base);
+	uint64_t deleted_size = 0;
+	uint64_t deleted_count = 0;
+	uint64_t size;
+	uint64_t count;
+	uint64_t i;
+
+	if (pool->guard != NULL)
+		guard_drain(pool);
+	tcache_pool_term(pool);
+
+	/* Free all fixed buckets */
+	for (i = 0; i < pool->bucket_count; i++)
+		bucket_term(&pool->steps[i], !!(pool->base.flags & AMPOOL_VALIDATE_ON_FREE), &deleted_size, &deleted_count);
+	bucket_term(&pool->oversized, !!(pool->base.flags & AMPOOL_VALIDATE_ON_FREE), &deleted_size, &deleted_count);
+
+	ampool_counters_sum(pool, &size, &count, NULL);
+	assert(deleted_size == size);
+	assert(deleted_count == count);
+	UNUSED_SYM(deleted_size); /* In release build, asserts are gone */
+	UNUSED_SYM(deleted_count);
+	UNUSED_SYM(size);
+	UNUSED_SYM(count);
+
+	if (pool->huge != NULL) {
+		for (i = 0; i < pool->node_count; i++)
+			huge_term(&pool->huge[i]);
+		free(pool->huge);
+	}
+	if (pool->guard != NULL) {
+		pthread_mutex_destroy(&pool->guard->mutex);
+		free(pool->guard);
+	}
+
+	free(pool->counters);
+	free(pool->sites);
+	free(pool);
+}
+
+/* Releases the slabs all of whose slots are free, as long as their slots fit in <budget>. Bucket must be locked.
+ * @Returns number of slots released, <released> is increased by the bytes unmapped (hugepage slabs are kept by the pool) */
+static uint64_t bucket_trim_slabs(ampool_bucket_t* bucket, uint64_t budget, uint64_t* released)
+{
+	ampool_slab_t* slab;
+	amlink_t* slot;
+	amlink_t* next;
+	uint64_t count = 0;
+
+	amlist_for_each_entry(slab, &bucket->slab_list, link)
+		slab->idle = 0;
+	for (slot = bucket->free_list.next; slot != &bucket->free_list; slot = slot->next)
+		chunk_slab(slot)->idle++;
+
+	/* Slabs to release are marked by an idle count past their capacity */
+	amlist_for_each_entry(slab, &bucket->slab_list, link) {
+		if (slab->idle != slab->carved || count + slab->carved > budget)
+			continue;
+		count += slab->carved;
+		slab->idle = UINT32_MAX;
+	}
+	if (count == 0)
+		return 0;
+
+	for (slot = bucket->free_list.next; slot != &bucket->free_list; slot = next) {
+		next = slot->next;
+		if (chunk_slab(slot)->idle == UINT32_MAX)
+			amlist_del(slot);
+	}
+
+	for (slot = bucket->slab_list.next; slot != &bucket->slab_list; slot = next) {
+		next = slot->next;
+		slab = amlist_entry(slot, ampool_slab_t, link);
+		if (slab->idle != UINT32_MAX)
+			continue;
+		amlist_del(&slab->link);
+		*released += slab_free(slab);
+	}
+
+	return count;
+}
+
+/* Releases free elements of a bucket to the system, either all of them or those idle since the previous trim.
+ * @Returns number of bytes released */
+static uint64_t bucket_trim(ampool_bucket_t* bucket, ambool_t all)
 {
-	ampool_bucket_t* bucket;
-	uint64_t i;
-#ifdef DEBUG
-	uint64_t deleted_size = 0;
-	uint64_t deleted_count = 0;
-#endif
+	amlink_t* slot;
+	uint64_t budget;
+	uint64_t released = 0;
+	uint64_t count = 0;
 
-	amlist_del(&pool->sibling_link); /* Sever top-down chain, now only tracable botom-up */
+	/* Free slots of fast buckets are on a lock-free stack, other threads may be reading them at any time */
+	if (bucket->fast || bucket->stats.element_size == 0)
+		return 0;
 
-	/* Free all fixed buckets */
-	for (i = 0; i < ARRAY_SIZE(pool->steps); i++) {
-		bucket = &pool->steps[i];
-#ifdef DEBUG
-		deleted_size += bucket->stats.used_size;
-		deleted_count += bucket->stats.used_element_count;
-#endif
-		bucket_term(bucket, !!(pool->flags & AMPOOL_VALIDATE_ON_FREE));
+	pthread_mutex_lock(&bucket->mutex);
+
+	budget = (all ? UINT64_MAX : bucket->idle_count);
+	if (bucket->use_slabs) {
+		count = bucket_trim_slabs(bucket, budget, &released);
 	}
-	bucket = &pool->oversized;
-#ifdef DEBUG
-	deleted_size += bucket->stats.used_size;
-	deleted_count += bucket->stats.used_element_count;
-#endif
-	bucket_term(bucket, !!(pool->flags & AMPOOL_VALIDATE_ON_FREE));
+	else {
+		/* Oldest first, free_list is pushed at its head */
+		while (count < budget && !amlist_empty(&bucket->free_list)) {
+			slot = bucket->free_list.prev;
+			amlist_del(slot);
+			free(slot);
+			count++;
+		}
+		released = count * (sizeof(ampool_chunk_t) + bucket->stats.element_size);
+	}
+
+	if (count > 0) {
+		bucket->stats.total_element_count -= count;
+		amstat_upd(&bucket->stats.total_element_count_range, bucket->stats.total_element_count);
+		bucket->stats.total_size -= count * bucket->stats.element_size;
+		amstat_upd(&bucket->stats.total_size_range, bucket->stats.total_size);
+	}
+
+	/* Start a new period, whatever is still free is idle until taken */
+	bucket->idle_count = bucket->stats.total_element_count - bucket->stats.used_element_count;
+
+	pthread_mutex_unlock(&bucket->mutex);
+
+	return released;
+}
+
+static uint64_t ampool_buckets_trim(ampool_base_t* base, ambool_t all)
+{
+	ampool_internal_t* pool = container_of(base, ampool_internal_t, base);
+	uint64_t released = 0;
+	uint32_t i;
+
+	for (i = 0; i < pool->bucket_count; i++)
+		released += bucket_trim(&pool->steps[i], all);
+	return released;
+}
+
+/* Lock guarding the list <base> is linked on */
+static inline pthread_rwlock_t* ampool_siblings_lock(ampool_base_t* base)
+{
+	return (base->parent != NULL ? &base->parent->children_lock : &globals.roots_lock);
+}
+
+/* Frees a pool and all its sub-pools, the pool is already unlinked from its parent */
+static void _ampool_pool_free(ampool_base_t* base)
+{
+	ampool_base_t* subpool;
+
+	/* Walks hold this lock while anywhere in the subtree, and no new walk can get in */
+	pthread_rwlock_wrlock(&base->children_lock);
+	pthread_rwlock_unlock(&base->children_lock);
 
 	/* Free all sub-pools */
-	while (!amlist_empty(&pool->children_list)) {
-		ampool_internal_t* subpool;
-		subpool = amlist_first_entry(&pool->children_list, ampool_internal_t, sibling_link);
+	while (!amlist_empty(&base->children_list)) {
+		subpool = amlist_first_entry(&base->children_list, ampool_base_t, sibling_link);
+		amlist_del(&subpool->sibling_link);
 		_ampool_pool_free(subpool);
 	}
 
-#ifdef DEBUG
-	assert(deleted_size == pool->size);
-	assert(deleted_count == pool->element_count);
-#endif
-
-	free(pool);
+	pthread_rwlock_destroy(&base->children_lock);
+	base->term(base);
 }
 
 static void	ampool_op_pool_free(ampool_t* ops)
 {
-	ampool_internal_t* pool = container_of(ops, ampool_internal_t, ops);
-	pthread_mutex_lock(&globals.hierarchy_mutex);
-	_ampool_pool_free(pool);
-	pthread_mutex_unlock(&globals.hierarchy_mutex);
+	ampool_base_t* base = container_of(ops, ampool_base_t, ops);
+	pthread_rwlock_t* lock = ampool_siblings_lock(base);
+
+	pthread_rwlock_wrlock(lock);
+	amlist_del(&base->sibling_link); /* Sever top-down chain, now only tracable botom-up */
+	pthread_rwlock_unlock(lock);
+
+	_ampool_pool_free(base);
 }
 
-ampool_t* ampool_pool_alloc_flags_named(ampool_t* parent_ops, ampool_flags_t flags, const char* name)
+/* Sets up the common part of a new pool, the implementation sets its ops and hooks
+ * @Returns AMRC_SUCCESS / AMRC_ERROR */
+static amrc_t ampool_base_init(ampool_base_t* base, ampool_t* parent_ops, ampool_flags_t flags, const char* name)
+{
+	if (pthread_rwlock_init(&base->children_lock, NULL) != 0)
+		return AMRC_ERROR;
+
+	base->size = 0;
+	base->element_count = 0;
+	base->realloc_inplace = 0;
+	base->realloc_moved = 0;
+	base->trimmed = 0;
+	base->parent = (parent_ops != NULL ? container_of(parent_ops, ampool_base_t, ops) : NULL);
+	amlist_init(&base->children_list);
+	base->flags = flags;
+	base->name = name;
+	base->ops.pool_free = ampool_op_pool_free;
+	base->diag = NULL;
+	base->elem_diag = NULL;
+	base->trim = NULL;
+	base->profile = NULL;
+	return AMRC_SUCCESS;
+}
+
+/* Adds a fully initialized pool to the hierarchy, it is visible to diag from here on */
+static void ampool_base_link(ampool_base_t* base)
+{
+	pthread_rwlock_t* lock = ampool_siblings_lock(base);
+
+	pthread_rwlock_wrlock(lock);
+	if (base->parent == NULL) {
+		amlist_add(&globals.root_pools, &base->sibling_link);
+	}
+	else {
+		amlist_add(&base->parent->children_list, &base->sibling_link);
+	}
+	pthread_rwlock_unlock(lock);
+}
+
+static void ampool_buckets_diag(ampool_base_t* base, ampool_diag_t* pd);
+static void ampool_buckets_elem_diag(ampool_base_t* base, ampool_elem_diag_cb_t callback, ampool_elem_diag_t* ed, void* user_data);
+static void ampool_buckets_profile(ampool_base_t* base, ampool_profile_cb_t callback, ampool_profile_t* pp, void* user_data);
+
+ampool_t* ampool_pool_alloc_config_named(ampool_t* parent_ops, const ampool_config_t* config, const char* name)
 {
-	ampool_internal_t* parent = NULL;
 	ampool_internal_t* pool = NULL;
+	ampool_flags_t flags = config->flags;
+	uint32_t max_pooled;
+	uint32_t class_count;
+	uint32_t node_count;
+	uint32_t class;
 	uint64_t i;
-	amrc_t rc;
 
-	if (parent_ops != NULL)
-		parent = container_of(parent_ops, ampool_internal_t, ops);
+	max_pooled = _MAX(config->max_pooled, AMPOOL_MAX_STEPPED);
+	if (flags & (AMPOOL_SLAB | AMPOOL_COMPACT | AMPOOL_FAST | AMPOOL_NUMA | AMPOOL_HUGEPAGE))
+		max_pooled = _MIN(max_pooled, AMPOOL_MAX_SLAB_POOLED);
+	max_pooled = _MIN(max_pooled, AMPOOL_MAX_POOLED);
+	class_count = class_index(max_pooled) + 1;
+	max_pooled = class_size(class_count - 1);
 
-	pool = malloc(sizeof(*pool));
+	node_count = ((flags & AMPOOL_NUMA) ? globals.node_count : 1);
+
+	pool = malloc(sizeof(*pool) + node_count * class_count * sizeof(pool->steps[0]));
 	if (pool == NULL) {
 		goto error;
 	}
-	memset(pool, 0, sizeof(*pool));
-	amlist_init(&pool->children_list);
-	pool->flags = flags;
-	pool->name = name;
-	pool->parent = parent;
-	pool->ops.alloc = ampool_op_alloc;
-	pool->ops.realloc = ampool_op_realloc;
-	pool->ops.free = ampool_op_free;
-	pool->ops.get_size = ampool_op_get_size;
-	pool->ops.pool_free = ampool_op_pool_free;
-
-	for (i = 0; i < ARRAY_SIZE(pool->steps); i++) {
-		rc = bucket_init(&pool->steps[i], (i + 1) * AMPOOL_ALIGN);
-		assert(rc == AMRC_SUCCESS);
-	}
-	rc = bucket_init(&pool->oversized, 0);
-	assert(rc == AMRC_SUCCESS);
-	UNUSED_SYM(rc); /* In release build, asserts are gone, pleaving rc unused */
+	memset(pool, 0, sizeof(*pool) + node_count * class_count * sizeof(pool->steps[0]));
+	if (ampool_base_init(&pool->base, parent_ops, flags, name) != AMRC_SUCCESS) {
+		free(pool);
+		return NULL;
+	}
+	amlist_init(&pool->tcache_list);
+	pool->base.ops.alloc = ampool_op_alloc;
+	pool->base.ops.realloc = ampool_op_realloc;
+	pool->base.ops.free = ampool_op_free;
+	pool->base.ops.get_size = ampool_op_get_size;
+	pool->base.ops.elem_size = ampool_op_elem_size;
+	pool->base.ops.alloc_bulk = ampool_op_alloc_bulk;
+	pool->base.ops.free_bulk = ampool_op_free_bulk;
+	pool->base.term = ampool_buckets_term;
+	pool->base.diag = ampool_buckets_diag;
+	pool->base.elem_diag = ampool_buckets_elem_diag;
+	pool->base.trim = ampool_buckets_trim;
+	pool->max_pooled = max_pooled;
+	pool->class_count = class_count;
+	pool->node_count = node_count;
+	pool->bucket_count = node_count * class_count;
+
+	pool->counters = aligned_alloc(AMPOOL_CACHE_LINE, sizeof(*pool->counters) * AMPOOL_SHARD_COUNT);
+	if (pool->counters == NULL)
+		goto error;
+	memset(pool->counters, 0, sizeof(*pool->counters) * AMPOOL_SHARD_COUNT);
+
+	if (flags & AMPOOL_PROFILE) {
+		pool->sites = calloc(AMPOOL_PROFILE_SITES, sizeof(*pool->sites));
+		if (pool->sites == NULL)
+			goto error;
+		pool->profile_rate = (config->profile_rate > 0 ? config->profile_rate : AMPOOL_PROFILE_RATE);
+		pool->base.profile = ampool_buckets_profile;
+	}
 
-	/* Add to hierarchy */
-	pthread_mutex_lock(&globals.hierarchy_mutex);
-	if (parent == NULL) {
-		amlist_add(&globals.root_pools, &pool->sibling_link);
+	if ((flags & AMPOOL_GUARD) && !(flags & AMPOOL_COMPACT)) {
+		pool->guard = calloc(1, sizeof(*pool->guard));
+		if (pool->guard == NULL)
+			goto error;
+		if (pthread_mutex_init(&pool->guard->mutex, NULL) != 0) {
+			free(pool->guard);
+			pool->guard = NULL;
+			goto error;
+		}
+		pool->guard->rate = (config->guard_rate > 0 ? config->guard_rate : AMPOOL_GUARD_RATE);
 	}
-	else {
-		amlist_add(&parent->children_list, &pool->sibling_link);
+
+	if (flags & AMPOOL_HUGEPAGE) {
+		pool->huge = malloc(node_count * sizeof(*pool->huge));
+		if (pool->huge == NULL)
+			goto error;
+		for (i = 0; i < node_count; i++) {
+			if (huge_init(&pool->huge[i]) != AMRC_SUCCESS) {
+				while (i-- > 0)
+					pthread_mutex_destroy(&pool->huge[i].mutex);
+				goto error;
+			}
+		}
+	}
+
+	for (i = 0; i < pool->bucket_count; i++) {
+		class = i % class_count;
+		if (bucket_init(&pool->steps[i], class_size(class), (class > 0 ? class_size(class - 1) : 0),
+				flags, i, i / class_count, config->retain_bytes) != AMRC_SUCCESS)
+			goto error_buckets;
+		if (pool->huge != NULL)
+			pool->steps[i].huge = &pool->huge[i / class_count];
 	}
-	pthread_mutex_unlock(&globals.hierarchy_mutex);
+	if (bucket_init(&pool->oversized, 0, max_pooled, flags, UINT32_MAX, 0, 0) != AMRC_SUCCESS)
+		goto error_buckets;
 
-	return &pool->ops;
+	ampool_base_link(&pool->base);
+	return &pool->base.ops;
 
+error_buckets:
+	while (i-- > 0)
+		bucket_destroy(&pool->steps[i]);
+	for (i = 0; pool->huge != NULL && i < node_count; i++)
+		huge_term(&pool->huge[i]);
 error:
-	if (pool != NULL)
+	if (pool != NULL) {
+		pthread_rwlock_destroy(&pool->base.children_lock);
+		if (pool->guard != NULL)
+			pthread_mutex_destroy(&pool->guard->mutex);
+		free(pool->guard);
+		free(pool->counters);
+		free(pool->huge);
+		free(pool->sites);
 		free(pool);
+	}
 	return NULL;
 }
 
+ampool_t* ampool_pool_alloc_flags_named(ampool_t* parent_ops, ampool_flags_t flags, const char* name)
+{
+	ampool_config_t config = {
+		.flags = flags,
+		.max_pooled = 0,
+		.retain_bytes = 0,
+	};
+
+	return ampool_pool_alloc_config_named(parent_ops, &config, name);
+}
+
+/**
+ * Arena pools
+ * -----------------------------------------------
+ */
+
+/* Blocks are never reused, allocation bumps <used> until the block is exhausted */
+typedef struct ampool_arena_block {
+	struct ampool_arena_block* next;
+	uint64_t map_size;
+	uint64_t capacity;
+	volatile uint64_t used;
+	uint8_t data[0] __attribute__((aligned(AMPOOL_ALIGN)));
+} ampool_arena_block_t;
+
+typedef struct ampool_arena {
+	ampool_base_t base;
+
+	pthread_mutex_t mutex; /* Taken only to add blocks */
+	ampool_arena_block_t* volatile current; /* Block being bumped, head of the block list */
+	uint64_t block_size;
+	volatile uint64_t reserved; /* Bytes mapped for blocks */
+} ampool_arena_t;
+
+/* Maps a block with room for at least <size> bytes, memory comes zeroed from the system.
+ * @Returns block / NULL on error */
+static ampool_arena_block_t* arena_block_new(ampool_arena_t* arena, uint64_t size)
+{
+	ampool_arena_block_t* block;
+	uint64_t map_size;
+	long page = sysconf(_SC_PAGESIZE);
+
+	map_size = (sizeof(*block) + size + page - 1) & ~(page - 1);
+
+	block = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (block == MAP_FAILED)
+		return NULL;
+
+	block->map_size = map_size;
+	block->capacity = map_size - sizeof(*block);
+	block->used = 0;
+	amsync_add(&arena->reserved, map_size);
+	return block;
+}
+
+/* Objects above a quarter of a block get a block of their own, placed behind the current one which keeps being bumped.
+ * @Returns object / NULL on error */
+static void* arena_alloc_dedicated(ampool_arena_t* arena, uint64_t size)
+{
+	ampool_arena_block_t* block;
+
+	block = arena_block_new(arena, size);
+	if (block == NULL)
+		return NULL;
+	block->used = size;
+
+	pthread_mutex_lock(&arena->mutex);
+	if (arena->current != NULL) {
+		block->next = arena->current->next;
+		arena->current->next = block;
+	}
+	else {
+		block->next = NULL;
+		arena->current = block;
+	}
+	pthread_mutex_unlock(&arena->mutex);
+
+	return block->data;
+}
+
+/* Replaces the exhausted block <seen> with a new current block, unless another thread already did.
+ * @Returns AMRC_SUCCESS / AMRC_ERROR on error */
+static amrc_t arena_grow(ampool_arena_t* arena, ampool_arena_block_t* seen)
+{
+	ampool_arena_block_t* block;
+	amrc_t rc = AMRC_SUCCESS;
+
+	pthread_mutex_lock(&arena->mutex);
+	if (arena->current == seen) {
+		block = arena_block_new(arena, arena->block_size - sizeof(*block));
+		if (block == NULL) {
+			rc = AMRC_ERROR;
+		}
+		else {
+			block->next = arena->current;
+			amsync();
+			arena->current = block;
+		}
+	}
+	pthread_mutex_unlock(&arena->mutex);
+
+	return rc;
+}
+
+static void* ampool_arena_op_alloc(ampool_t* ops, uint32_t size, UNUSED const char* name)
+{
+	ampool_arena_t* arena = container_of(ops, ampool_arena_t, base.ops);
+	ampool_arena_block_t* block;
+	uint64_t aligned_size;
+	uint64_t offset;
+	void* ptr;
+
+	if (size == 0)
+		return NULL;
+
+	aligned_size = align_size(size);
+
+	if (UNLIKELY(aligned_size > arena->block_size / 4)) {
+		ptr = arena_alloc_dedicated(arena, aligned_size);
+		if (ptr == NULL)
+			return NULL;
+	}
+	else {
+		while (1) {
+			block = arena->current;
+			if (LIKELY(block != NULL)) {
+				offset = amsync_add(&block->used, aligned_size);
+				if (LIKELY(offset + aligned_size <= block->capacity)) {
+					ptr = &block->data[offset];
+					break;
+				}
+			}
+			if (arena_grow(arena, block) != AMRC_SUCCESS)
+				return NULL;
+		}
+	}
+
+	amsync_add(&arena->base.size, aligned_size);
+	amsync_inc(&arena->base.element_count);
+	return ptr;
+}
+
+/* Memory is only released along with the arena */
+static void ampool_arena_op_free(UNUSED ampool_t* ops, UNUSED void * ptr, UNUSED uint32_t size)
+{
+}
+
+/* Bump allocation takes no lock, there is nothing to batch. Nothing is released, even on error */
+static amrc_t ampool_arena_op_alloc_bulk(ampool_t* ops, uint32_t size, uint32_t count, void** ptrs, const char* name)
+{
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		ptrs[i] = ampool_arena_op_alloc(ops, size, name);
+		if (ptrs[i] == NULL)
+			return AMRC_ERROR;
+	}
+	return AMRC_SUCCESS;
+}
+
+static void ampool_arena_op_free_bulk(UNUSED ampool_t* ops, UNUSED void** ptrs, UNUSED uint32_t count, UNUSED uint32_t size)
+{
+}
+
+/* The last object of the current block grows and shrinks in place, others are copied. Arenas keep no sizes, so <old_size> is required */
+static void* ampool_arena_op_realloc(ampool_t* ops, void * ptr, uint32_t old_size, uint32_t new_size, const char* name)
+{
+	ampool_arena_t* arena = container_of(ops, ampool_arena_t, base.ops);
+	ampool_arena_block_t* block;
+	uint64_t old_aligned;
+	uint64_t new_aligned;
+	uint64_t end;
+	void* newptr;
+
+	assert(ptr == NULL || old_size > 0);
+	if (ptr == NULL)
+		return ampool_arena_op_alloc(ops, new_size, name);
+
+	old_aligned = align_size(old_size);
+	new_aligned = align_size(new_size);
+
+	block = arena->current;
+	if (block != NULL && (uint8_t*)ptr + old_aligned == &block->data[block->used]) {
+		end = (uint8_t*)ptr - block->data + new_aligned;
+		if (end <= block->capacity && amsync_swap(&block->used, end - new_aligned + old_aligned, end)) {
+			amsync_add(&arena->base.size, new_aligned - old_aligned);
+			if (new_size > old_size)
+				memset((uint8_t*)ptr + old_size, 0, new_size - old_size);
+			amsync_inc(&arena->base.realloc_inplace);
+			return ptr;
+		}
+	}
+
+	if (new_size <= old_size) {
+		amsync_inc(&arena->base.realloc_inplace);
+		return ptr;
+	}
+
+	newptr = ampool_arena_op_alloc(ops, new_size, name);
+	if (newptr == NULL)
+		return NULL;
+	memcpy(newptr, ptr, old_size);
+	amsync_inc(&arena->base.realloc_moved);
+	return newptr;
+}
+
+static uint64_t ampool_arena_op_get_size(ampool_t* ops)
+{
+	ampool_arena_t* arena = container_of(ops, ampool_arena_t, base.ops);
+	return arena->base.size;
+}
+
+/* Arenas keep no per-object sizes */
+static uint32_t ampool_arena_op_elem_size(UNUSED ampool_t* ops, UNUSED const void* ptr)
+{
+	return 0;
+}
+
+static void ampool_arena_term(ampool_base_t* base)
+{
+	ampool_arena_t* arena = container_of(base, ampool_arena_t, base);
+	ampool_arena_block_t* block;
+
+	while (arena->current != NULL) {
+		block = arena->current;
+		arena->current = block->next;
+		munmap(block, block->map_size);
+	}
+
+	pthread_mutex_destroy(&arena->mutex);
+	free(arena);
+}
+
+static void ampool_arena_diag(ampool_base_t* base, ampool_diag_t* pd)
+{
+	ampool_arena_t* arena = container_of(base, ampool_arena_t, base);
+	pd->reserved = arena->reserved;
+}
+
+ampool_t* ampool_arena_alloc_named(ampool_t* parent_ops, uint64_t block_size, const char* name)
+{
+	ampool_arena_t* arena;
+
+	arena = malloc(sizeof(*arena));
+	if (arena == NULL)
+		return NULL;
+	memset(arena, 0, sizeof(*arena));
+
+	if (pthread_mutex_init(&arena->mutex, NULL) != 0) {
+		free(arena);
+		return NULL;
+	}
+
+	if (ampool_base_init(&arena->base, parent_ops, 0, name) != AMRC_SUCCESS) {
+		pthread_mutex_destroy(&arena->mutex);
+		free(arena);
+		return NULL;
+	}
+	arena->base.ops.alloc = ampool_arena_op_alloc;
+	arena->base.ops.realloc = ampool_arena_op_realloc;
+	arena->base.ops.free = ampool_arena_op_free;
+	arena->base.ops.get_size = ampool_arena_op_get_size;
+	arena->base.ops.elem_size = ampool_arena_op_elem_size;
+	arena->base.ops.alloc_bulk = ampool_arena_op_alloc_bulk;
+	arena->base.ops.free_bulk = ampool_arena_op_free_bulk;
+	arena->base.term = ampool_arena_term;
+	arena->base.diag = ampool_arena_diag;
+	arena->current = NULL;
+	arena->block_size = _MAX((block_size > 0 ? block_size : AMPOOL_ARENA_BLOCK_SIZE), 4 * AMPOOL_MAX_STEPPED);
+
+	ampool_base_link(&arena->base);
+	return &arena->base.ops;
+}
+
+/* Highest online NUMA node + 1, as reported by sysfs. Without it, everything is node 0 */
+static uint32_t ampool_node_count()
+{
+	char buf[256];
+	char* ptr;
+	char* end;
+	unsigned long node;
+	unsigned long max = 0;
+	FILE* file;
+
+	file = fopen("/sys/devices/system/node/online", "r");
+	if (file == NULL)
+		return 1;
+	ptr = fgets(buf, sizeof(buf), file);
+	fclose(file);
+	if (ptr == NULL)
+		return 1;
+
+	/* A list of ranges, such as "0-1,3" */
+	while (*ptr != '\0' && *ptr != '\n') {
+		node = strtoul(ptr, &end, 10);
+		if (end == ptr)
+			break;
+		max = _MAX(max, node);
+		ptr = end;
+		if (*ptr == ',' || *ptr == '-')
+			ptr++;
+	}
+
+	return _MIN(max + 1, AMPOOL_MAX_NODES);
+}
+
+/* Transparent hugepages honour MADV_HUGEPAGE unless the system has them disabled, or built out */
+static ambool_t ampool_thp_enabled()
+{
+	char buf[256];
+	char* ptr;
+	FILE* file;
+
+	file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+	if (file == NULL)
+		return am_false;
+	ptr = fgets(buf, sizeof(buf), file);
+	fclose(file);
+
+	/* Choices with the current one in brackets, such as "always [madvise] never" */
+	return (ptr != NULL && strstr(ptr, "[never]") == NULL);
+}
+
 void ampool_init()
 {
 	int rc;
 	uint64_t fold_me = amshash(__DATE__, NULL);
 
 	amlist_init(&globals.root_pools);
-	rc = pthread_mutex_init(&globals.hierarchy_mutex, NULL);
+	globals.node_count = ampool_node_count();
+	globals.thp = ampool_thp_enabled();
+	globals.no_hugetlb = am_false;
+	rc = pthread_rwlock_init(&globals.roots_lock, NULL);
+	assert(rc == 0);
+	rc = pthread_mutex_init(&globals.tcache_mutex, NULL);
+	assert(rc == 0);
+	rc = pthread_once(&tcache_key_once, tcache_key_init);
 	assert(rc == 0);
 	UNUSED_SYM(rc); /* In release build, asserts are gone, pleaving rc unused */
 
 	fold_me ^= (fold_me >> 32);
 	fold_me ^= (fold_me >> 16);
 	globals.magic = ((fold_me & 0xFFFF) << 16) | (amtime_now() & 0xFFFF);
+	globals.guard_magic = globals.magic ^ AMPOOL_GUARD_XOR;
 	//globals.magic = 0xFFFFFFFFU;
 }
 
-void ampool_internal_term()
+void ampool_term()
 {
-	ampool_internal_t* pool;
+	ampool_base_t* pool;
 
-	pthread_mutex_lock(&globals.hierarchy_mutex);
+	pthread_rwlock_wrlock(&globals.roots_lock);
 	while (!amlist_empty(&globals.root_pools)) {
-		pool = amlist_first_entry(&globals.root_pools, ampool_internal_t, sibling_link);
+		pool = amlist_first_entry(&globals.root_pools, ampool_base_t, sibling_link);
+		amlist_del(&pool->sibling_link);
 		_ampool_pool_free(pool);
 	}
 
-	pthread_mutex_unlock(&globals.hierarchy_mutex);
+	pthread_rwlock_unlock(&globals.roots_lock);
+}
+
+static uint64_t _ampool_trim(ampool_base_t* pool, ambool_t all)
+{
+	ampool_base_t* child;
+	uint64_t released = 0;
+
+	if (pool->trim != NULL) {
+		released = pool->trim(pool, all);
+		amsync_add(&pool->trimmed, released);
+	}
+
+	pthread_rwlock_rdlock(&pool->children_lock);
+	amlist_for_each_entry(child, &pool->children_list, sibling_link)
+		released += _ampool_trim(child, all);
+	pthread_rwlock_unlock(&pool->children_lock);
+	return released;
+}
+
+uint64_t ampool_trim(ampool_t* ops, ambool_t all)
+{
+	ampool_base_t* pool;
+	uint64_t released = 0;
+
+	if (ops != NULL)
+		return _ampool_trim(container_of(ops, ampool_base_t, ops), all);
+
+	pthread_rwlock_rdlock(&globals.roots_lock);
+	amlist_for_each_entry(pool, &globals.root_pools, sibling_link)
+		released += _ampool_trim(pool, all);
+	pthread_rwlock_unlock(&globals.roots_lock);
+
+	return released;
 }
 
 
 
-static amrc_t _ampool_diag(ampool_internal_t* pool, ampool_internal_t* parent, ampool_diag_t* pd, ampool_diag_cb_t callback, void* user_data)
+static void ampool_buckets_diag(ampool_base_t* base, ampool_diag_t* pd)
+{
+	ampool_internal_t* pool = container_of(base, ampool_internal_t, base);
+
+	uint32_t i;
+
+	ampool_counters_sum(pool, &pd->size, &pd->elements, pd->node_size);
+	pd->nodes = pool->node_count;
+
+	for (i = 0; pool->huge != NULL && i < pool->node_count; i++) {
+		pthread_mutex_lock(&pool->huge[i].mutex);
+		pd->hugepage_bytes += pool->huge[i].backed;
+		pthread_mutex_unlock(&pool->huge[i].mutex);
+	}
+}
+
+static amrc_t _ampool_diag(ampool_base_t* pool, ampool_base_t* parent, ampool_diag_t* pd, ampool_diag_cb_t callback, void* user_data)
 {
 	amrc_t rc;
-	ampool_internal_t* child;
+	ampool_base_t* child;
 
+	memset(pd, 0, sizeof(*pd));
 	pd->pool = &pool->ops;
 	pd->pool_name = pool->name;
 	pd->parent = (parent ? &parent->ops : NULL);
 	pd->parent_name = (parent ? parent->name : NULL);
 	pd->size = pool->size;
 	pd->elements = pool->element_count;
+	pd->realloc_inplace = pool->realloc_inplace;
+	pd->realloc_moved = pool->realloc_moved;
+	pd->trimmed = pool->trimmed;
+	pd->nodes = 1;
+	if (pool->diag != NULL)
+		pool->diag(pool, pd);
 
 	rc = callback(pd, user_data);
 	if (rc != AMRC_SUCCESS)
 		return AMRC_ERROR;
 
+	pthread_rwlock_rdlock(&pool->children_lock);
 	amlist_for_each_entry(child, &pool->children_list, sibling_link) {
 		rc = _ampool_diag(child, pool, pd, callback, user_data);
 		if (rc != AMRC_SUCCESS)
-			return AMRC_ERROR;
+			break;
 	}
+	pthread_rwlock_unlock(&pool->children_lock);
 
-	return AMRC_SUCCESS;
+	return rc;
 }
 
 /* This will iterate over all allocated pools and call the provided callback with the proper stats for each
- * WARNING: While this is running, no other task may add or delete pools
- * USE WITH CAUTION */
+ * Pools may be added and freed meanwhile, those linked under a pool that is being walked wait for the walk to leave it */
 void ampool_diag(ampool_diag_cb_t callback, void* user_data)
 {
 	ampool_diag_t pd;
-	ampool_internal_t* pool;
+	ampool_base_t* pool;
 	amrc_t rc;
 
 	if (callback == NULL)
 		return;
 
-	pthread_mutex_lock(&globals.hierarchy_mutex);
+	pthread_rwlock_rdlock(&globals.roots_lock);
 	amlist_for_each_entry(pool, &globals.root_pools, sibling_link) {
 		rc = _ampool_diag(pool, NULL, &pd, callback, user_data);
 		if (rc != AMRC_SUCCESS)
 			break;
 	}
-	pthread_mutex_unlock(&globals.hierarchy_mutex);
+	pthread_rwlock_unlock(&globals.roots_lock);
 }
 
 
-static amrc_t _ampool_elem_diag(ampool_bucket_t* bucket, ampool_elem_diag_cb_t callback, ampool_elem_diag_t* ed, void* user_data)
+static amrc_t _ampool_elem_diag(ampool_internal_t* pool, ampool_bucket_t* bucket, ampool_elem_diag_cb_t callback, ampool_elem_diag_t* ed, void* user_data)
 {
 	ampool_chunk_t* chunk;
 	amrc_t rc = AMRC_SUCCESS;
@@ -596,8 +3117,11 @@ static amrc_t _ampool_elem_diag(ampool_bucket_t* bucket, ampool_elem_diag_cb_t c
 	pthread_mutex_lock(&bucket->mutex);
 
 	amlist_for_each_entry(chunk, &bucket->used_list, link) {
+		if (!chunk_live(chunk))
+			continue; /* Parked in a thread magazine */
+
 		ed->elem = chunk->data;
-		ed->elem_name = chunk->name;
+		ed->elem_name = chunk_name(pool, chunk);
 		ed->elem_size = chunk->size;
 
 		rc = callback(ed, user_data);
@@ -611,32 +3135,135 @@ static amrc_t _ampool_elem_diag(ampool_bucket_t* bucket, ampool_elem_diag_cb_t c
 	return rc;
 }
 
+/* Compact and fast buckets have no used list, allocated objects are found by walking their slabs.
+ * Compact slots are tracked in the slab bitmaps, fast chunks by their magic.
+ * NOTE: Fast buckets do not take the lock on alloc/free, elements changing hands during the walk may or may not be reported */
+static amrc_t _ampool_elem_diag_slabs(ampool_internal_t* pool, ampool_bucket_t* bucket, ampool_elem_diag_cb_t callback, ampool_elem_diag_t* ed, void* user_data)
+{
+	ampool_chunk_t* chunk;
+	ampool_slab_t* slab;
+	uint32_t i;
+	amrc_t rc = AMRC_SUCCESS;
+
+	pthread_mutex_lock(&bucket->mutex);
+
+	amlist_for_each_entry(slab, &bucket->slab_list, link) {
+		for (i = 0; i < slab->carved && rc == AMRC_SUCCESS; i++) {
+			if (bucket->compact) {
+				if (!(slab->used[i >> 6] & (1UL << (i & 63))))
+					continue;
+
+				ed->elem = &slab->data[i * slab->stride];
+				ed->elem_name = NULL;
+				ed->elem_size = slab->stride;
+			}
+			else {
+				chunk = (ampool_chunk_t*)&slab->data[i * slab->stride];
+				if (!chunk_live(chunk))
+					continue;
+
+				ed->elem = chunk->data;
+				ed->elem_name = chunk_name(pool, chunk);
+				ed->elem_size = chunk->size;
+			}
+
+			rc = callback(ed, user_data);
+		}
+		if (rc != AMRC_SUCCESS)
+			break;
+	}
+
+	pthread_mutex_unlock(&bucket->mutex);
+
+	return rc;
+}
+
+static inline amrc_t _ampool_elem_diag_bucket(ampool_internal_t* pool, ampool_bucket_t* bucket, ampool_elem_diag_cb_t callback, ampool_elem_diag_t* ed, void* user_data)
+{
+	if (bucket->compact || bucket->fast)
+		return _ampool_elem_diag_slabs(pool, bucket, callback, ed, user_data);
+	return _ampool_elem_diag(pool, bucket, callback, ed, user_data);
+}
+
+/* See ampool_base_t.elem_diag */
+static void ampool_buckets_elem_diag(ampool_base_t* base, ampool_elem_diag_cb_t callback, ampool_elem_diag_t* ed, void* user_data)
+{
+	ampool_internal_t* pool = container_of(base, ampool_internal_t, base);
+	uint32_t i;
+	amrc_t rc;
+
+	for (i = 0; i < pool->bucket_count; i++) {
+		rc = _ampool_elem_diag_bucket(pool, &pool->steps[i], callback, ed, user_data);
+		if (rc != AMRC_SUCCESS)
+			return;
+	}
+	_ampool_elem_diag_bucket(pool, &pool->oversized, callback, ed, user_data);
+}
+
+/* See ampool_base_t.profile */
+static void ampool_buckets_profile(ampool_base_t* base, ampool_profile_cb_t callback, ampool_profile_t* pp, void* user_data)
+{
+	ampool_internal_t* pool = container_of(base, ampool_internal_t, base);
+	ampool_site_t* site;
+	uint32_t i;
+
+	pp->sample_rate = pool->profile_rate;
+	for (i = 0; i < AMPOOL_PROFILE_SITES; i++) {
+		site = &pool->sites[i];
+		if (site->allocs == 0)
+			continue;
+
+		pp->site = site->name;
+		pp->allocs = site->allocs;
+		pp->frees = site->frees;
+		pp->live_count = site->live_count;
+		pp->live_bytes = site->live_bytes;
+		if (callback(pp, user_data) != AMRC_SUCCESS)
+			return;
+	}
+}
+
 /* This will iterate over all allocated elements in the pool and call the provided callback with the proper stats for each
  * pool_stats will be populated at the end of the run.
  * Note that if there were concurrent allocations/deletions while this was run, the coherent stats will be  pool_stats and not ampool_get_size().
+ * Arenas do not keep track of their elements, and report none.
  *
  * WARNING: While this is running, some allocation sizes may block. Others may go through.
  * USE WITH CAUTION */
 void ampool_elem_diag(ampool_t* ops, ampool_elem_diag_cb_t callback, ampool_diag_stats_t* pool_stats, void* user_data)
 {
-	ampool_internal_t* pool = container_of(ops, ampool_internal_t, ops);
-	uint32_t i;
+	ampool_base_t* base;
 	ampool_elem_diag_t ed;
-	amrc_t rc;
 
 	if (pool_stats)
 		memset(pool_stats, 0, sizeof(*pool_stats));
 
-	if (pool == NULL || callback == NULL)
+	if (ops == NULL || callback == NULL)
 		return;
 
-	ed.pool = &pool->ops;
-	ed.pool_name = pool->name;
+	base = container_of(ops, ampool_base_t, ops);
+	if (base->elem_diag == NULL)
+		return;
 
-	for (i = 0; i < AMPOOL_STEP_COUNT; i++) {
-		rc = _ampool_elem_diag(&pool->steps[i], callback, &ed, user_data);
-		if (rc != AMRC_SUCCESS)
-			return;
-	}
-	_ampool_elem_diag(&pool->oversized, callback, &ed, user_data);
+	ed.pool = &base->ops;
+	ed.pool_name = base->name;
+	base->elem_diag(base, callback, &ed, user_data);
+}
+
+void ampool_profile(ampool_t* ops, ampool_profile_cb_t callback, void* user_data)
+{
+	ampool_base_t* base;
+	ampool_profile_t pp;
+
+	if (ops == NULL || callback == NULL)
+		return;
+
+	base = container_of(ops, ampool_base_t, ops);
+	if (base->profile == NULL)
+		return;
+
+	memset(&pp, 0, sizeof(pp));
+	pp.pool = &base->ops;
+	pp.pool_name = base->name;
+	base->profile(base, callback, &pp, user_data);
 }
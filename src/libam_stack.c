@@ -99,6 +99,76 @@ amrc_t amstack_pop(amstack_t* stk, void** data)
 	return AMRC_SUCCESS;
 }
 
+/**
+ * Pushes up to <count> pointers, in order, reserving their slots at once
+ * Does not support NULL pointers
+ * Returns   Number of pointers pushed, short of <count> when the stack fills up
+ */
+uint64_t amstack_push_bulk(amstack_t* stk, void* const* data, uint64_t count)
+{
+	uint64_t size;
+	uint64_t room;
+	uint64_t i;
+
+	if (data == NULL || count == 0)
+		return 0;
+
+	/* Obtain the slots exclusively */
+	do {
+		size = stk->size;
+		if (size >= stk->capacity)
+			return 0;
+		room = stk->capacity - size;
+		if (count > room)
+			count = room;
+	} while (!amsync_swap(&stk->size, size, size + count));
+
+	/* Make sure the threads that had those spots exclusively before are done */
+	for (i = 0; i < count; i++)
+		while (!amsync_swap(&stk->data[size + i], NULL, data[i]));
+
+	return count;
+}
+
+/**
+ * Pops up to <count> pointers, top of the stack first, reserving their slots at once
+ * Returns   Number of pointers popped, short of <count> when the stack empties
+ */
+uint64_t amstack_pop_bulk(amstack_t* stk, void** data, uint64_t count)
+{
+	uint64_t size;
+	uint64_t new_size;
+	uint64_t i;
+	void* ptr;
+
+	if (data == NULL || count == 0)
+		return 0;
+
+	/* Obtain the slots exclusively */
+	do {
+		size = stk->size;
+		if (size == 0)
+			return 0;
+		if (count > size)
+			count = size;
+		new_size = size - count;
+	} while (!amsync_swap(&stk->size, size, new_size));
+
+	/* Make sure the threads that had those spots exclusively before are done */
+	for (i = 0; i < count; i++) {
+		while (1) {
+			ptr = stk->data[size - 1 - i];
+			if (ptr == NULL)
+				continue;
+			if (amsync_swap(&stk->data[size - 1 - i], ptr, NULL))
+				break;
+		}
+		data[i] = ptr;
+	}
+
+	return count;
+}
+
 /**
  * Returns current stack size
  */
@@ -13,3 +13,47 @@ void amstat_2str(const amstat_range_t* stat, char* buff, uint64_t buf_len)
 			stat->max, stat->num);
 	buff[buf_len - 1] = '\0';
 }
+
+/* Highest value falling in <bucket> */
+static uint64_t amstat_hist_bucket_max(uint64_t bucket)
+{
+	uint64_t shift;
+	uint64_t sub;
+
+	if (bucket < AMSTAT_HIST_SUB_COUNT)
+		return bucket;
+	shift = (bucket >> AMSTAT_HIST_SUB_BITS) - 1;
+	sub = bucket & (AMSTAT_HIST_SUB_COUNT - 1);
+	return ((((uint64_t)AMSTAT_HIST_SUB_COUNT + sub + 1) << shift) - 1);
+}
+
+/**
+ * Returns the value at or under which <percentile> (0 to 100) percent of the values fall, rounded up to its bucket's
+ * upper bound. 0 when empty
+ */
+uint64_t amstat_hist_percentile(const amstat_hist_t* hist, double percentile)
+{
+	uint64_t rank;
+	uint64_t seen = 0;
+	uint64_t i;
+
+	if (hist->num == 0)
+		return 0;
+
+	if (percentile >= 100.0)
+		rank = hist->num;
+	else if (percentile <= 0.0)
+		rank = 1;
+	else {
+		rank = (uint64_t)((double)hist->num * percentile / 100.0);
+		if ((double)rank < (double)hist->num * percentile / 100.0 || rank == 0)
+			rank++;
+	}
+
+	for (i = 0; i < AMSTAT_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			return amstat_hist_bucket_max(i);
+	}
+	return UINT64_MAX;
+}
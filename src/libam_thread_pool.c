@@ -1,12 +1,20 @@
+#define _GNU_SOURCE
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
 #include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 
 #include "libam/libam_thread_pool.h"
 
 #include "libam/libam_stack.h"
 #include "libam/libam_atomic.h"
+#include "libam/libam_replace.h"
 
 #ifdef DEBUG
 #include "libam/libam_log.h"
@@ -18,11 +26,68 @@
 #define error_log(fmt, args...)
 #endif
 
+enum lam_thread_pool_constants {
+	LAM_THREAD_POOL_DEQUE_COUNT = 64, /* Workers past this many run without a deque of their own */
+	LAM_THREAD_POOL_DEQUE_SIZE = 256, /* Must be a power of 2. Local tasks past it go to the shared queue */
+	LAM_THREAD_POOL_CACHE_LINE = 64,
+	LAM_THREAD_POOL_FREE_TASKS = LAM_THREAD_POOL_DEQUE_SIZE, /* Descriptors kept for reuse, on top of the backlog */
+	LAM_THREAD_POOL_BATCH = 256, /* Tasks of a batch reserved, timestamped and woken for at once */
+	LAM_THREAD_POOL_PARALLEL_SPLITS = 32, /* Halves of its range a parallel loop piece hands out, at most */
+	LAM_THREAD_POOL_PARALLEL_DEPTH = 16, /* Pieces nested on a thread's stack, waiting on their halves, at most */
+	LAM_THREAD_POOL_PARALLEL_CHUNKS = 8, /* Chunks per CPU of a parallel loop, when its grain is left to the pool */
+	LAM_THREAD_POOL_MAX_NODES = 64,
+};
+
+/* Chase-Lev deque of a worker. Only its owner pushes and pops, at the bottom, other workers steal from the top.
+ * top and bottom only ever grow, so a deque handed over to a new worker needs no reset */
+typedef struct lam_thread_pool_deque {
+	volatile int64_t top;
+	volatile uint64_t owned; /* Claimed by a running worker */
+	volatile int64_t bottom __attribute__((aligned(LAM_THREAD_POOL_CACHE_LINE)));
+	void* volatile tasks[LAM_THREAD_POOL_DEQUE_SIZE];
+} __attribute__((aligned(LAM_THREAD_POOL_CACHE_LINE))) lam_thread_pool_deque_t;
+
+/* Bounded MPMC ring, each cell's sequence number tells whose turn it is to use it */
+typedef struct lam_thread_pool_cell {
+	volatile uint64_t seq;
+	void *task;
+} lam_thread_pool_cell_t;
+
+typedef struct lam_thread_pool_ring {
+	uint64_t mask; /* Capacity - 1, capacity is a power of 2 */
+	volatile uint64_t head __attribute__((aligned(LAM_THREAD_POOL_CACHE_LINE)));
+	volatile uint64_t tail __attribute__((aligned(LAM_THREAD_POOL_CACHE_LINE)));
+	lam_thread_pool_cell_t cells[] __attribute__((aligned(LAM_THREAD_POOL_CACHE_LINE)));
+} lam_thread_pool_ring_t;
+
+/* NUMA node, with the queue of tasks tagged with it */
+typedef struct lam_thread_pool_node {
+	lam_thread_pool_ring_t *ring;
+	cpu_set_t cpus; /* CPUs of the pool on this node */
+	volatile uint64_t workers; /* Bound to this node. Other workers run its tasks only while there are none */
+
+	/* LIBAM_THREAD_POOL_BLOCKING. Workers bound to the node park on its own wake_seq */
+	volatile uint32_t wake_seq;
+	volatile uint64_t sleepers;
+} __attribute__((aligned(LAM_THREAD_POOL_CACHE_LINE))) lam_thread_pool_node_t;
+
 struct lam_thread_pool {
 	uint64_t id;
 	lam_thread_pool_config_t config;
 
-	amstack_t *tasks_queue;
+	amstack_t *tasks_queue; /* Tasks submitted from outside of the pool workers, LIFO */
+	lam_thread_pool_ring_t *tasks_ring; /* Replaces tasks_queue with LIBAM_THREAD_POOL_FIFO */
+	lam_thread_pool_deque_t *deques;
+	uint64_t deque_count;
+	uint64_t cpu_count; /* Caps the threads a batch starts */
+	amstack_t *free_tasks; /* Descriptors of lam_thread_pool_run(), kept for reuse */
+
+	/* Placement. Nodes are numbered as the system does, up to the highest online one */
+	uint32_t *cpus; /* CPUs workers may run on */
+	uint64_t cpus_len;
+	lam_thread_pool_node_t *nodes;
+	uint64_t node_count;
+	pthread_attr_t thread_attr; /* With config.stack_size */
 
 	volatile uint64_t threads_created;
 	volatile uint64_t threads_destroyed;
@@ -32,25 +97,515 @@ struct lam_thread_pool {
 	volatile uint64_t running_id;
 	volatile uint64_t drain_signal;
 
+	/* LIBAM_THREAD_POOL_BLOCKING. Workers park on wake_seq, which submitters bump when sleepers are parked or about to.
+	 * Those bound to a node park on the node's instead, node_sleepers counts them all */
+	volatile uint32_t wake_seq;
+	volatile uint64_t sleepers;
+	volatile uint64_t node_sleepers;
+	uint64_t wake_node; /* Next node to wake a worker of, round robin. Racy */
+
+	/* Submitters waiting for room in the shared queue park on space_seq, which workers bump as they take tasks */
+	volatile uint32_t space_seq;
+	volatile uint64_t space_waiters;
+
+	/* LIBAM_THREAD_POOL_OVERFLOW_GROW. Tasks past the backlog, FIFO. While any are here, new tasks queue behind them */
+	pthread_mutex_t overflow_mutex;
+	lam_thread_pool_task_t *overflow_head;
+	lam_thread_pool_task_t *overflow_tail;
+	volatile uint64_t overflow_count;
+
+	volatile uint64_t tasks_caller_run;
+	volatile uint64_t tasks_overflowed;
+
+	volatile uint32_t complete_seq; /* Bumped as waited on tasks complete, for lam_thread_pool_future_wait_any() */
+
 	lam_thread_pool_stats_t stats;
 	pthread_mutex_t stats_mutex;
 };
 
-typedef struct lam_thread_pool_task {
-	uint64_t id;
-	lam_thread_func_t func;
-	void *arg;
-	void **ret_ptr;
 
-	/* Stat-related numbers */
-	amtime_t queue_time;
-	uint64_t active_thread_count;
-	uint64_t idle_thread_count;
-	uint64_t queue_depth;
-} lam_thread_pool_task_t;
+static volatile uint64_t thread_pool_index = 1;
 
+static lam_thread_pool_ring_t* lam_thread_pool_ring_alloc(uint64_t capacity)
+{
+	lam_thread_pool_ring_t *ring;
+	uint64_t size;
+	uint64_t i;
 
-static volatile uint64_t thread_pool_index = 1;
+	capacity = 1UL << (64 - __builtin_clzl(_MAX(capacity, 2) - 1));
+	size = sizeof(*ring) + sizeof(ring->cells[0]) * capacity;
+	ring = aligned_alloc(LAM_THREAD_POOL_CACHE_LINE, (size + LAM_THREAD_POOL_CACHE_LINE - 1) & ~(LAM_THREAD_POOL_CACHE_LINE - 1));
+	if (ring == NULL)
+		return NULL;
+	memset(ring, 0, size);
+
+	ring->mask = capacity - 1;
+	for (i = 0; i < capacity; i++)
+		ring->cells[i].seq = i;
+	return ring;
+}
+
+/* @Returns AMRC_SUCCESS / AMRC_ERROR when full */
+static amrc_t lam_thread_pool_ring_push(lam_thread_pool_ring_t *ring, void *task)
+{
+	lam_thread_pool_cell_t *cell;
+	uint64_t pos = ring->tail;
+	int64_t diff;
+
+	while (1) {
+		cell = &ring->cells[pos & ring->mask];
+		diff = (int64_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (amsync_swap(&ring->tail, pos, pos + 1))
+				break;
+		}
+		else if (diff < 0) {
+			/* Cell still holds the task from a lap ago */
+			return AMRC_ERROR;
+		}
+		pos = ring->tail;
+	}
+
+	cell->task = task;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return AMRC_SUCCESS;
+}
+
+/* Reserves as many cells as are free, up to <count>, with a single swap
+ * @Returns number of tasks pushed */
+static uint64_t lam_thread_pool_ring_push_bulk(lam_thread_pool_ring_t *ring, void **tasks, uint64_t count)
+{
+	lam_thread_pool_cell_t *cell;
+	uint64_t pos;
+	uint64_t room;
+	uint64_t i;
+
+	do {
+		pos = ring->tail;
+		/* Cells free up out of order, the reservation stops at the first busy one */
+		for (room = 0; room < count; room++) {
+			cell = &ring->cells[(pos + room) & ring->mask];
+			if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + room)
+				break;
+		}
+		if (room == 0)
+			return 0;
+	} while (!amsync_swap(&ring->tail, pos, pos + room));
+
+	for (i = 0; i < room; i++) {
+		cell = &ring->cells[(pos + i) & ring->mask];
+		cell->task = tasks[i];
+		__atomic_store_n(&cell->seq, pos + i + 1, __ATOMIC_RELEASE);
+	}
+	return room;
+}
+
+/* @Returns AMRC_SUCCESS / AMRC_ERROR when empty */
+static amrc_t lam_thread_pool_ring_pop(lam_thread_pool_ring_t *ring, void **task)
+{
+	lam_thread_pool_cell_t *cell;
+	uint64_t pos = ring->head;
+	int64_t diff;
+
+	while (1) {
+		cell = &ring->cells[pos & ring->mask];
+		diff = (int64_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+		if (diff == 0) {
+			if (amsync_swap(&ring->head, pos, pos + 1))
+				break;
+		}
+		else if (diff < 0) {
+			return AMRC_ERROR;
+		}
+		pos = ring->head;
+	}
+
+	*task = cell->task;
+	/* Cell is free for the push a lap from now */
+	__atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+	return AMRC_SUCCESS;
+}
+
+static inline uint64_t lam_thread_pool_ring_size(lam_thread_pool_ring_t *ring)
+{
+	int64_t size = (int64_t)(ring->tail - ring->head);
+	return (size > 0 ? (uint64_t)size : 0);
+}
+
+static inline amrc_t lam_thread_pool_queue_push(lam_thread_pool_t *tp, void *task)
+{
+	if (tp->tasks_ring != NULL)
+		return lam_thread_pool_ring_push(tp->tasks_ring, task);
+	return amstack_push(tp->tasks_queue, task);
+}
+
+/* @Returns number of tasks pushed */
+static inline uint64_t lam_thread_pool_queue_push_bulk(lam_thread_pool_t *tp, void **tasks, uint64_t count)
+{
+	if (tp->tasks_ring != NULL)
+		return lam_thread_pool_ring_push_bulk(tp->tasks_ring, tasks, count);
+	return amstack_push_bulk(tp->tasks_queue, tasks, count);
+}
+
+static inline amrc_t lam_thread_pool_queue_pop(lam_thread_pool_t *tp, void **task)
+{
+	if (tp->tasks_ring != NULL)
+		return lam_thread_pool_ring_pop(tp->tasks_ring, task);
+	return amstack_pop(tp->tasks_queue, task);
+}
+
+static inline uint64_t lam_thread_pool_queue_size(lam_thread_pool_t *tp)
+{
+	if (tp->tasks_ring != NULL)
+		return lam_thread_pool_ring_size(tp->tasks_ring);
+	return amstack_get_size(tp->tasks_queue);
+}
+
+static void lam_thread_pool_queue_free(lam_thread_pool_t *tp)
+{
+	if (tp->tasks_ring != NULL)
+		free(tp->tasks_ring);
+	else
+		amstack_free(tp->tasks_queue);
+}
+
+/* @Returns recycled or new descriptor / NULL on error */
+static inline lam_thread_pool_task_t* lam_thread_pool_task_alloc(lam_thread_pool_t *tp)
+{
+	lam_thread_pool_task_t *task;
+
+	if (amstack_pop(tp->free_tasks, (void**) &task) == AMRC_SUCCESS)
+		return task;
+
+	task = malloc(sizeof(*task));
+	if (task == NULL)
+		return NULL;
+	task->pooled = 1;
+	return task;
+}
+
+static inline void lam_thread_pool_task_free(lam_thread_pool_t *tp, lam_thread_pool_task_t *task)
+{
+	if (amstack_push(tp->free_tasks, task) != AMRC_SUCCESS)
+		free(task);
+}
+
+static inline void lam_thread_pool_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#endif
+}
+
+/* Waits for *<addr> to move off <val>, for up to <timeout>, or forever when 0. May return early */
+static void lam_thread_pool_futex_wait(volatile uint32_t *addr, uint32_t val, amtime_t timeout)
+{
+	struct timespec ts;
+
+	if (timeout == 0) {
+		(void)syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+		return;
+	}
+	ts.tv_sec = timeout / AMTIME_SEC;
+	ts.tv_nsec = (timeout % AMTIME_SEC) * 1000;
+	(void)syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+/* Moves *<addr> on and wakes up to <count> of its waiters */
+static void lam_thread_pool_futex_wake(volatile uint32_t *addr, int count)
+{
+	amsync_inc(addr);
+	(void)syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/* Wakes up to <count> parked workers, those parked on the pool first, then those bound to nodes, one node after the
+ * other. All of them with INT_MAX */
+static void lam_thread_pool_wake(lam_thread_pool_t *tp, int count)
+{
+	lam_thread_pool_node_t *node;
+	ambool_t all = (count == INT_MAX ? am_true : am_false);
+	uint64_t start;
+	uint64_t i;
+
+	if (all || tp->sleepers > 0) {
+		lam_thread_pool_futex_wake(&tp->wake_seq, count);
+		if (!all)
+			count -= (int)_MIN(tp->sleepers, (uint64_t)count);
+	}
+	if (tp->nodes == NULL || (!all && tp->node_sleepers == 0))
+		return;
+
+	start = tp->wake_node++;
+	for (i = 0; i < tp->node_count && count > 0; i++) {
+		node = &tp->nodes[(start + i) % tp->node_count];
+		if (!all && node->sleepers == 0)
+			continue;
+		lam_thread_pool_futex_wake(&node->wake_seq, count);
+		if (!all)
+			count -= (int)_MIN(node->sleepers, (uint64_t)count);
+	}
+}
+
+/* Called after <count> tasks are queued. The barrier orders the queueing before the read of sleepers, workers about
+ * to park order theirs the other way around, so either the worker sees the task or this sees the worker */
+static inline void lam_thread_pool_signal(lam_thread_pool_t *tp, uint64_t count)
+{
+	if (!(tp->config.flags & LIBAM_THREAD_POOL_BLOCKING))
+		return;
+	amsync();
+	if (tp->sleepers > 0 || tp->node_sleepers > 0)
+		lam_thread_pool_wake(tp, (int)_MIN(count, (uint64_t)INT_MAX - 1));
+}
+
+/* Called after a task is queued on <node>. Its own workers are woken for it, any worker when none is bound to it */
+static inline void lam_thread_pool_node_signal(lam_thread_pool_t *tp, lam_thread_pool_node_t *node)
+{
+	if (!(tp->config.flags & LIBAM_THREAD_POOL_BLOCKING))
+		return;
+	amsync();
+	if (node->sleepers > 0)
+		lam_thread_pool_futex_wake(&node->wake_seq, 1);
+	else if (node->workers == 0)
+		lam_thread_pool_signal(tp, 1);
+}
+
+/* Hands the task back once it ran, recycled or to its owner. Owners waiting on it park on task->done, and those
+ * waiting on any of a few on tp->complete_seq */
+static inline void lam_thread_pool_task_complete(lam_thread_pool_t *tp, lam_thread_pool_task_t *task)
+{
+	uint32_t state;
+
+	if (task->pooled) {
+		lam_thread_pool_task_free(tp, task);
+		return;
+	}
+
+	/* Owner may reuse the descriptor from here on, hands off. Waking a reused address is harmless */
+	state = __atomic_exchange_n(&task->done, LIBAM_THREAD_POOL_TASK_DONE, __ATOMIC_SEQ_CST);
+	if (state == LIBAM_THREAD_POOL_TASK_WAITED) {
+		(void)syscall(SYS_futex, &task->done, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+		lam_thread_pool_futex_wake(&tp->complete_seq, INT_MAX);
+	}
+}
+
+static void lam_thread_pool_overflow_push(lam_thread_pool_t *tp, lam_thread_pool_task_t *task)
+{
+	task->next = NULL;
+	pthread_mutex_lock(&tp->overflow_mutex);
+	if (tp->overflow_tail != NULL)
+		tp->overflow_tail->next = task;
+	else
+		tp->overflow_head = task;
+	tp->overflow_tail = task;
+	amsync_inc(&tp->overflow_count);
+	pthread_mutex_unlock(&tp->overflow_mutex);
+	amsync_inc(&tp->tasks_overflowed);
+}
+
+/* @Returns oldest overflowed task / NULL when there are none */
+static lam_thread_pool_task_t* lam_thread_pool_overflow_pop(lam_thread_pool_t *tp)
+{
+	lam_thread_pool_task_t *task;
+
+	if (tp->overflow_count == 0)
+		return NULL;
+
+	pthread_mutex_lock(&tp->overflow_mutex);
+	task = tp->overflow_head;
+	if (task != NULL) {
+		tp->overflow_head = task->next;
+		if (tp->overflow_head == NULL)
+			tp->overflow_tail = NULL;
+		amsync_dec(&tp->overflow_count);
+	}
+	pthread_mutex_unlock(&tp->overflow_mutex);
+	return task;
+}
+
+/* Takes a task off the shared queue, or off the overflow once the queue is empty, letting a blocked submitter
+ * know there is room
+ * @Returns task / NULL when empty */
+static lam_thread_pool_task_t* lam_thread_pool_shared_pop(lam_thread_pool_t *tp)
+{
+	lam_thread_pool_task_t *task;
+
+	if (lam_thread_pool_queue_pop(tp, (void**) &task) != AMRC_SUCCESS)
+		return lam_thread_pool_overflow_pop(tp);
+
+	/* Same pairing as lam_thread_pool_signal(), with submitters waiting for room */
+	amsync();
+	if (tp->space_waiters > 0)
+		lam_thread_pool_futex_wake(&tp->space_seq, 1);
+	return task;
+}
+
+/* Pool, deque, node and stats of the worker running on this thread, if any */
+static __thread lam_thread_pool_t *worker_tp;
+static __thread lam_thread_pool_deque_t *worker_deque;
+static __thread lam_thread_pool_node_t *worker_node;
+static __thread lam_thread_pool_stats_t *worker_stats;
+static __thread uint64_t *worker_busy; /* Tasks of the worker's current busy period */
+static __thread uint64_t worker_id;
+
+/* Owner only
+ * @Returns AMRC_SUCCESS / AMRC_ERROR when the deque is full */
+static inline amrc_t lam_thread_pool_deque_push(lam_thread_pool_deque_t *deque, lam_thread_pool_task_t *task)
+{
+	int64_t bottom = deque->bottom;
+
+	if (bottom - deque->top >= LAM_THREAD_POOL_DEQUE_SIZE)
+		return AMRC_ERROR;
+
+	deque->tasks[bottom & (LAM_THREAD_POOL_DEQUE_SIZE - 1)] = task;
+	/* Task must be visible to thieves before the bottom that covers it */
+	__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+	return AMRC_SUCCESS;
+}
+
+/* Owner only
+ * @Returns number of tasks pushed, as many as there is room for */
+static inline uint64_t lam_thread_pool_deque_push_bulk(lam_thread_pool_deque_t *deque, lam_thread_pool_task_t **tasks, uint64_t count)
+{
+	int64_t bottom = deque->bottom;
+	uint64_t i;
+
+	count = _MIN(count, (uint64_t)(LAM_THREAD_POOL_DEQUE_SIZE - (bottom - deque->top)));
+	for (i = 0; i < count; i++)
+		deque->tasks[(bottom + i) & (LAM_THREAD_POOL_DEQUE_SIZE - 1)] = tasks[i];
+	__atomic_store_n(&deque->bottom, bottom + count, __ATOMIC_RELEASE);
+	return count;
+}
+
+/* Owner only, takes the newest task
+ * @Returns task / NULL when empty */
+static inline lam_thread_pool_task_t* lam_thread_pool_deque_pop(lam_thread_pool_deque_t *deque)
+{
+	lam_thread_pool_task_t *task;
+	int64_t bottom;
+	int64_t top;
+
+	bottom = deque->bottom - 1;
+	deque->bottom = bottom;
+	amsync();
+	top = deque->top;
+
+	if (top > bottom) {
+		deque->bottom = bottom + 1;
+		return NULL;
+	}
+
+	task = deque->tasks[bottom & (LAM_THREAD_POOL_DEQUE_SIZE - 1)];
+	if (top == bottom) {
+		/* Last task, race thieves for it */
+		if (!amsync_swap(&deque->top, top, top + 1))
+			task = NULL;
+		deque->bottom = bottom + 1;
+	}
+	return task;
+}
+
+/* Any thread, takes the oldest task
+ * @Returns task / NULL when empty or when losing a race for it */
+static inline lam_thread_pool_task_t* lam_thread_pool_deque_steal(lam_thread_pool_deque_t *deque)
+{
+	lam_thread_pool_task_t *task;
+	int64_t bottom;
+	int64_t top;
+
+	top = deque->top;
+	amsync();
+	bottom = deque->bottom;
+	if (top >= bottom)
+		return NULL;
+
+	/* The owner cannot wrap around onto this slot before top moves past it, failing the swap below */
+	task = deque->tasks[top & (LAM_THREAD_POOL_DEQUE_SIZE - 1)];
+	if (!amsync_swap(&deque->top, top, top + 1))
+		return NULL;
+	return task;
+}
+
+static inline uint64_t lam_thread_pool_deque_size(lam_thread_pool_deque_t *deque)
+{
+	int64_t size = deque->bottom - deque->top;
+	return (size > 0 ? (uint64_t)size : 0);
+}
+
+static lam_thread_pool_deque_t* lam_thread_pool_deque_claim(lam_thread_pool_t *tp)
+{
+	uint64_t i;
+
+	for (i = 0; i < tp->deque_count; i++) {
+		if (amsync_swap(&tp->deques[i].owned, 0, 1))
+			return &tp->deques[i];
+	}
+	return NULL;
+}
+
+/* Tasks of nodes no worker is bound to, which would wait forever otherwise
+ * @Returns task / NULL when there is none */
+static lam_thread_pool_task_t* lam_thread_pool_orphan_pop(lam_thread_pool_t *tp)
+{
+	lam_thread_pool_task_t *task;
+	uint64_t i;
+
+	if (tp->nodes == NULL)
+		return NULL;
+
+	for (i = 0; i < tp->node_count; i++) {
+		if (tp->nodes[i].workers > 0 || lam_thread_pool_ring_size(tp->nodes[i].ring) == 0)
+			continue;
+		if (lam_thread_pool_ring_pop(tp->nodes[i].ring, (void**) &task) == AMRC_SUCCESS)
+			return task;
+	}
+	return NULL;
+}
+
+/* Own deque first, newest task first for cache locality or oldest first with FIFO, then the queue of the worker's
+ * node, then the shared queue, then steals from other workers.
+ * @Returns task / NULL when there is nothing to run */
+static lam_thread_pool_task_t* lam_thread_pool_task_get(lam_thread_pool_t *tp, lam_thread_pool_deque_t *deque, lam_thread_pool_node_t *node,
+		uint64_t thread_id)
+{
+	lam_thread_pool_task_t *task;
+	uint64_t victim;
+	uint64_t i;
+
+	if (deque != NULL) {
+		if (tp->tasks_ring != NULL) {
+			/* A lost race does not mean empty, and the deque must be empty before this worker may stop */
+			do {
+				task = lam_thread_pool_deque_steal(deque);
+			} while (task == NULL && lam_thread_pool_deque_size(deque) > 0);
+		}
+		else {
+			task = lam_thread_pool_deque_pop(deque);
+		}
+		if (task != NULL)
+			return task;
+	}
+
+	if (node != NULL && lam_thread_pool_ring_pop(node->ring, (void**) &task) == AMRC_SUCCESS)
+		return task;
+
+	task = lam_thread_pool_shared_pop(tp);
+	if (task != NULL)
+		return task;
+
+	/* Start at a different victim for each thief, so they do not all pile on the same deque */
+	for (i = 0; i < tp->deque_count; i++) {
+		victim = (thread_id + i) % tp->deque_count;
+		if (&tp->deques[victim] == deque || !tp->deques[victim].owned)
+			continue;
+		task = lam_thread_pool_deque_steal(&tp->deques[victim]);
+		if (task != NULL)
+			return task;
+	}
+
+	return lam_thread_pool_orphan_pop(tp);
+}
 
 static void lam_thread_pool_stats_init(lam_thread_pool_stats_t* stats)
 {
@@ -63,6 +618,12 @@ static void lam_thread_pool_stats_init(lam_thread_pool_stats_t* stats)
 	amstat_init(&stats->tasks_processed);
 	amstat_init(&stats->busy_task_num);
 	amstat_init(&stats->queue_depth);
+
+	amstat_hist_init(&stats->task_delay_hist);
+	stats->task_delay_p50 = 0;
+	stats->task_delay_p90 = 0;
+	stats->task_delay_p99 = 0;
+	stats->task_delay_p999 = 0;
 }
 
 static void lam_thread_pool_stats_fold(lam_thread_pool_t *tp, lam_thread_pool_stats_t *stats)
@@ -78,6 +639,7 @@ static void lam_thread_pool_stats_fold(lam_thread_pool_t *tp, lam_thread_pool_st
 	amstat_add(&tp->stats.tasks_processed, &stats->tasks_processed);
 	amstat_add(&tp->stats.busy_task_num, &stats->busy_task_num);
 	amstat_add(&tp->stats.queue_depth, &stats->queue_depth);
+	amstat_hist_add(&tp->stats.task_delay_hist, &stats->task_delay_hist);
 
 	pthread_mutex_unlock(&tp->stats_mutex);
 }
@@ -93,6 +655,130 @@ static inline ambool_t lam_thread_pool_should_stop(lam_thread_pool_t *tp, uint64
 	return am_true;
 }
 
+/* Spins for spin_time, then parks until a task is queued, the pool drains, or idle_timeout may have expired.
+ * @Returns task found / NULL when woken without one */
+static lam_thread_pool_task_t* lam_thread_pool_park(lam_thread_pool_t *tp, lam_thread_pool_deque_t *deque, lam_thread_pool_node_t *node,
+		uint64_t thread_id, amtime_t now, amtime_t last_work)
+{
+	volatile uint32_t *wake_seq = (node != NULL ? &node->wake_seq : &tp->wake_seq);
+	volatile uint64_t *sleepers = (node != NULL ? &node->sleepers : &tp->sleepers);
+	lam_thread_pool_task_t *task;
+	amtime_t spin_end;
+	amtime_t left;
+	uint32_t seq;
+	uint64_t i;
+
+	if (tp->config.spin_time > 0) {
+		spin_end = now + tp->config.spin_time;
+		do {
+			for (i = 0; i < 64; i++)
+				lam_thread_pool_cpu_relax();
+			task = lam_thread_pool_task_get(tp, deque, node, thread_id);
+			if (task != NULL)
+				return task;
+		} while (!tp->drain_signal && amtime_now() < spin_end);
+	}
+
+	seq = *wake_seq;
+	amsync_inc(sleepers);
+	if (node != NULL)
+		amsync_inc(&tp->node_sleepers);
+
+	/* Last look, now that submitters know to wake us */
+	task = lam_thread_pool_task_get(tp, deque, node, thread_id);
+	if (task != NULL || tp->drain_signal)
+		goto unpark;
+
+	left = 0;
+	if (tp->config.idle_timeout > 0 && thread_id > tp->config.min_threads) {
+		left = tp->config.idle_timeout - _MIN(now - last_work, tp->config.idle_timeout);
+		left = _MAX(left, AMTIME_USEC);
+	}
+	lam_thread_pool_futex_wait(wake_seq, seq, left);
+
+unpark:
+	if (node != NULL)
+		amsync_dec(&tp->node_sleepers);
+	amsync_dec(sleepers);
+	return task;
+}
+
+/* Runs a dequeued task */
+static void lam_thread_pool_task_exec(lam_thread_pool_t *tp, lam_thread_pool_task_t *task, lam_thread_pool_stats_t *stats)
+{
+	amtime_t now = amtime_now();
+	void *ret;
+
+	debug_log("tp worker %lu-%lu dequeued task %lu-%lu\n", tp->id, worker_id, tp->id, task->id);
+	amstat_upd(&stats->task_delay, now - task->queue_time);
+	amstat_hist_upd(&stats->task_delay_hist, now - task->queue_time);
+	amstat_upd(&stats->active_thread_count, task->active_thread_count);
+	amstat_upd(&stats->idle_thread_count, task->idle_thread_count);
+	amstat_upd(&stats->queue_depth, task->queue_depth);
+
+	ret = task->func(task->arg);
+	if (task->ret_ptr != NULL)
+		*task->ret_ptr = ret;
+	debug_log("tp worker %lu-%lu done processing %lu-%lu\n", tp->id, worker_id, tp->id, task->id);
+	lam_thread_pool_task_complete(tp, task);
+}
+
+/* Pins the worker to its CPU, or to the CPUs of its node, round robin
+ * @Returns node the worker is bound to / NULL when it runs anywhere */
+static lam_thread_pool_node_t* lam_thread_pool_worker_bind(lam_thread_pool_t *tp, uint64_t thread_id)
+{
+	lam_thread_pool_node_t *node = NULL;
+	uint64_t populated = 0;
+	uint64_t index;
+	uint64_t i;
+	cpu_set_t cpus;
+	uint32_t cpu;
+
+	if (tp->config.affinity == LIBAM_THREAD_POOL_AFFINITY_CPUS) {
+		cpu = tp->cpus[(thread_id - 1) % tp->cpus_len];
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		for (i = 0; i < tp->node_count && node == NULL; i++) {
+			if (CPU_ISSET(cpu, &tp->nodes[i].cpus))
+				node = &tp->nodes[i];
+		}
+	}
+	else if (tp->config.affinity == LIBAM_THREAD_POOL_AFFINITY_NUMA) {
+		for (i = 0; i < tp->node_count; i++)
+			populated += (CPU_COUNT(&tp->nodes[i].cpus) > 0 ? 1 : 0);
+		index = (thread_id - 1) % populated;
+		for (i = 0; node == NULL; i++) {
+			if (CPU_COUNT(&tp->nodes[i].cpus) > 0 && index-- == 0)
+				node = &tp->nodes[i];
+		}
+		cpus = node->cpus;
+	}
+	else {
+		return NULL;
+	}
+
+	/* Left where it is if the CPUs went away, it still runs */
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+		error_log("tp worker %lu-%lu could not be pinned\n", tp->id, thread_id);
+	}
+
+	if (node != NULL)
+		amsync_inc(&node->workers);
+	return node;
+}
+
+/* Leaves the worker's node. Tasks queued on it until then were counted on the worker to run them, it stays for them.
+ * Those queued after go to other workers, as the node's orphans
+ * @Returns am_true once unbound / am_false when the worker must stay */
+static ambool_t lam_thread_pool_worker_unbind(lam_thread_pool_node_t *node)
+{
+	amsync_dec(&node->workers);
+	if (lam_thread_pool_ring_size(node->ring) == 0)
+		return am_true;
+	amsync_inc(&node->workers);
+	return am_false;
+}
+
 static void* lam_thread_pool_worker_func(void *arg)
 {
 	lam_thread_pool_t *tp = arg;
@@ -100,11 +786,11 @@ static void* lam_thread_pool_worker_func(void *arg)
 	uint64_t total_tasks_processed = 0;
 	struct timespec poll_timeout = { .tv_sec = 0, .tv_nsec = 0 };
 	uint64_t thread_id = amsync_inc(&tp->running_id);
+	lam_thread_pool_deque_t *deque;
+	lam_thread_pool_node_t *node;
 	lam_thread_pool_task_t *task;
 	amtime_t now;
 	amtime_t last_work;
-	amrc_t rc;
-	void *ret;
 	lam_thread_pool_stats_t local_stats;
 
 	amsync_inc(&tp->active_thread_count);
@@ -112,13 +798,22 @@ static void* lam_thread_pool_worker_func(void *arg)
 
 	lam_thread_pool_stats_init(&local_stats);
 
+	deque = lam_thread_pool_deque_claim(tp);
+	node = lam_thread_pool_worker_bind(tp, thread_id);
+	worker_tp = tp;
+	worker_deque = deque;
+	worker_node = node;
+	worker_stats = &local_stats;
+	worker_busy = &busy_tasks_processed;
+	worker_id = thread_id;
+
 	debug_log("tp worker %lu-%lu started\n", tp->id, thread_id);
 
 	now = amtime_now();
 	last_work = now;
 	while (1) {
-		rc = amstack_pop(tp->tasks_queue, (void**) &task);
-		if (rc != AMRC_SUCCESS) {
+		task = lam_thread_pool_task_get(tp, deque, node, thread_id);
+		if (task == NULL) {
 			/* Thread is idle */
 			if (busy_tasks_processed > 0) {
 				amstat_upd(&local_stats.busy_task_num, busy_tasks_processed);
@@ -134,35 +829,39 @@ static void* lam_thread_pool_worker_func(void *arg)
 
 			if (lam_thread_pool_should_stop(tp, thread_id, now, last_work)) {
 				/* tp->config.idle_timeout expired, and conditions are met for this thread to stop */
+				if (node != NULL) {
+					if (!lam_thread_pool_worker_unbind(node))
+						continue;
+					node = NULL;
+				}
 				amstat_upd(&local_stats.tasks_processed, total_tasks_processed);
 				debug_log("tp worker %lu-%lu inactive for %6.3lf seconds, stopping\n", tp->id, thread_id, ((double)(now - last_work)) / AMTIME_SEC);
 				break;
 			}
 
-			/* Suspend for idle duration */
-			poll_timeout.tv_nsec = tp->config.poll_freq;
-			nanosleep(&poll_timeout, NULL);
-			now = amtime_now();
-			continue;
+			if (tp->config.flags & LIBAM_THREAD_POOL_BLOCKING) {
+				task = lam_thread_pool_park(tp, deque, node, thread_id, now, last_work);
+				now = amtime_now();
+				if (task == NULL)
+					continue;
+				amsync_dec(&tp->idle_thread_count);
+			}
+			else {
+				/* Suspend for idle duration */
+				poll_timeout.tv_nsec = tp->config.poll_freq;
+				nanosleep(&poll_timeout, NULL);
+				now = amtime_now();
+				continue;
+			}
+		}
+		else if (busy_tasks_processed == 0) {
+			amsync_dec(&tp->idle_thread_count);
 		}
 
 		/* Got a task to process */
 
-		debug_log("tp worker %lu-%lu dequeued task %lu-%lu\n", tp->id, thread_id, tp->id, task->id);
-		if (busy_tasks_processed == 0)
-			amsync_dec(&tp->idle_thread_count);
-		now = amtime_now();
-		amstat_upd(&local_stats.task_delay, now - task->queue_time);
-		amstat_upd(&local_stats.active_thread_count, task->active_thread_count);
-		amstat_upd(&local_stats.idle_thread_count, task->idle_thread_count);
-		amstat_upd(&local_stats.queue_depth, task->queue_depth);
 		busy_tasks_processed++;
-
-		ret = task->func(task->arg);
-		if (task->ret_ptr != NULL)
-			*task->ret_ptr = ret;
-		debug_log("tp worker %lu-%lu done processing %lu-%lu\n", tp->id, thread_id, tp->id, task->id);
-		free(task);
+		lam_thread_pool_task_exec(tp, task, &local_stats);
 
 		now = amtime_now();
 		last_work = now;
@@ -170,6 +869,17 @@ static void* lam_thread_pool_worker_func(void *arg)
 
 	lam_thread_pool_stats_fold(tp, &local_stats);
 
+	/* Only the owner pushes to its deque, and it just found it empty */
+	worker_tp = NULL;
+	worker_deque = NULL;
+	worker_node = NULL;
+	worker_stats = NULL;
+	worker_busy = NULL;
+	if (deque != NULL)
+		deque->owned = 0;
+	if (node != NULL)
+		amsync_dec(&node->workers);
+
 	debug_log("tp worker %lu-%lu stopped\n", tp->id, thread_id);
 	amsync_dec(&tp->idle_thread_count);
 	amsync_dec(&tp->active_thread_count);
@@ -192,7 +902,7 @@ static amrc_t lam_thread_pool_start_thread(lam_thread_pool_t *tp)
 		return AMRC_SUCCESS;
 	}
 
-	rc = pthread_create(&th, NULL, lam_thread_pool_worker_func, tp);
+	rc = pthread_create(&th, &tp->thread_attr, lam_thread_pool_worker_func, tp);
 	if (rc != 0)
 		return AMRC_ERROR;
 
@@ -205,6 +915,156 @@ static amrc_t lam_thread_pool_start_thread(lam_thread_pool_t *tp)
 	return AMRC_SUCCESS;
 }
 
+/* Reads a list of ranges, such as "0-3,8-11", from sysfs
+ * @Returns AMRC_SUCCESS / AMRC_ERROR when it cannot be read */
+static amrc_t lam_thread_pool_list_read(const char *path, cpu_set_t *set)
+{
+	char buf[1024];
+	char *ptr;
+	char *end;
+	unsigned long first;
+	unsigned long last;
+	FILE *file;
+
+	CPU_ZERO(set);
+	file = fopen(path, "r");
+	if (file == NULL)
+		return AMRC_ERROR;
+	ptr = fgets(buf, sizeof(buf), file);
+	fclose(file);
+	if (ptr == NULL)
+		return AMRC_ERROR;
+
+	while (*ptr != '\0' && *ptr != '\n') {
+		first = strtoul(ptr, &end, 10);
+		if (end == ptr)
+			break;
+		last = first;
+		ptr = end;
+		if (*ptr == '-') {
+			last = strtoul(ptr + 1, &end, 10);
+			ptr = end;
+		}
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+		if (*ptr == ',')
+			ptr++;
+	}
+	return AMRC_SUCCESS;
+}
+
+/* Highest online NUMA node + 1, as reported by sysfs. Without it, everything is node 0 */
+static uint64_t lam_thread_pool_node_count_read()
+{
+	cpu_set_t nodes;
+	uint64_t count = 1;
+	uint64_t i;
+
+	if (lam_thread_pool_list_read("/sys/devices/system/node/online", &nodes) != AMRC_SUCCESS)
+		return count;
+	for (i = 0; i < LAM_THREAD_POOL_MAX_NODES; i++) {
+		if (CPU_ISSET(i, &nodes))
+			count = i + 1;
+	}
+	return count;
+}
+
+/* Pools without affinity bind no worker to a node, nor read the topology until asked for the node count */
+static inline uint64_t lam_thread_pool_node_count(lam_thread_pool_t *tp)
+{
+	if (tp->node_count == 0)
+		tp->node_count = lam_thread_pool_node_count_read();
+	return tp->node_count;
+}
+
+/* Settles the CPUs workers may run on, and splits them across NUMA nodes. Without sysfs, all are on node 0.
+ * Only with an affinity, other pools have node tasks go through the shared queue */
+static amrc_t lam_thread_pool_topology_init(lam_thread_pool_t *tp)
+{
+	char path[64];
+	cpu_set_t allowed;
+	uint64_t count;
+	uint64_t i;
+
+	CPU_ZERO(&allowed);
+	for (i = 0; tp->config.cpus != NULL && i < tp->config.cpus_len; i++) {
+		if (tp->config.cpus[i] >= CPU_SETSIZE)
+			return AMRC_ERROR;
+		CPU_SET(tp->config.cpus[i], &allowed);
+	}
+
+	if (tp->config.affinity == LIBAM_THREAD_POOL_AFFINITY_NONE)
+		return AMRC_SUCCESS;
+
+	if (CPU_COUNT(&allowed) == 0 && sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return AMRC_ERROR;
+
+	/* Listed in order, pinning goes round robin over them */
+	count = CPU_COUNT(&allowed);
+	if (count == 0)
+		return AMRC_ERROR;
+	tp->cpus = malloc(sizeof(*tp->cpus) * count);
+	if (tp->cpus == NULL)
+		return AMRC_ERROR;
+	for (i = 0; i < CPU_SETSIZE && tp->cpus_len < count; i++) {
+		if (CPU_ISSET(i, &allowed))
+			tp->cpus[tp->cpus_len++] = i;
+	}
+	tp->config.cpus = tp->cpus;
+	tp->config.cpus_len = tp->cpus_len;
+
+	tp->node_count = lam_thread_pool_node_count_read();
+
+	tp->nodes = aligned_alloc(LAM_THREAD_POOL_CACHE_LINE, sizeof(*tp->nodes) * tp->node_count);
+	if (tp->nodes == NULL)
+		goto free_cpus;
+	memset(tp->nodes, 0, sizeof(*tp->nodes) * tp->node_count);
+
+	count = 0;
+	for (i = 0; i < tp->node_count; i++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%lu/cpulist", i);
+		if (lam_thread_pool_list_read(path, &tp->nodes[i].cpus) == AMRC_SUCCESS)
+			CPU_AND(&tp->nodes[i].cpus, &tp->nodes[i].cpus, &allowed);
+		count += CPU_COUNT(&tp->nodes[i].cpus);
+	}
+	if (count == 0)
+		tp->nodes[0].cpus = allowed;
+
+	for (i = 0; i < tp->node_count; i++) {
+		tp->nodes[i].ring = lam_thread_pool_ring_alloc(tp->config.backlog);
+		if (tp->nodes[i].ring == NULL)
+			goto free_nodes;
+	}
+	return AMRC_SUCCESS;
+
+free_nodes:
+	while (i-- > 0)
+		free(tp->nodes[i].ring);
+	free(tp->nodes);
+free_cpus:
+	free(tp->cpus);
+	return AMRC_ERROR;
+}
+
+static void lam_thread_pool_topology_free(lam_thread_pool_t *tp)
+{
+	uint64_t i;
+
+	for (i = 0; tp->nodes != NULL && i < tp->node_count; i++)
+		free(tp->nodes[i].ring);
+	free(tp->nodes);
+	free(tp->cpus);
+}
+
+static void lam_thread_pool_free_tasks(lam_thread_pool_t *tp)
+{
+	lam_thread_pool_task_t *task;
+
+	while (amstack_pop(tp->free_tasks, (void**) &task) == AMRC_SUCCESS)
+		free(task);
+	amstack_free(tp->free_tasks);
+}
+
 /* Allocates a thread pool
  * NOTE: Is not thread safe with other lam_thread_pool_create/lam_thread_pool_destroy.
  *
@@ -233,14 +1093,58 @@ lam_thread_pool_t* lam_thread_pool_create(const lam_thread_pool_config_t *config
 	if (tp->config.max_threads && tp->config.max_threads < tp->config.min_threads)
 		tp->config.max_threads = tp->config.min_threads;
 
-	tp->tasks_queue = amstack_alloc(tp->config.backlog);
-	if (tp->tasks_queue == NULL)
+	if (!(tp->config.flags & (LIBAM_THREAD_POOL_FIFO | LIBAM_THREAD_POOL_LIFO)))
+		tp->config.flags |= ((tp->config.flags & LIBAM_THREAD_POOL_BLOCKING) ? LIBAM_THREAD_POOL_FIFO : LIBAM_THREAD_POOL_LIFO);
+	if ((tp->config.flags & LIBAM_THREAD_POOL_FIFO) && (tp->config.flags & LIBAM_THREAD_POOL_LIFO))
 		goto free_tp;
 
+	if (tp->config.flags & LIBAM_THREAD_POOL_FIFO) {
+		tp->tasks_ring = lam_thread_pool_ring_alloc(tp->config.backlog);
+		if (tp->tasks_ring == NULL)
+			goto free_tp;
+	}
+	else {
+		tp->tasks_queue = amstack_alloc(tp->config.backlog);
+		if (tp->tasks_queue == NULL)
+			goto free_tp;
+	}
+
+	tp->deque_count = LAM_THREAD_POOL_DEQUE_COUNT;
+	if (tp->config.max_threads && tp->config.max_threads < tp->deque_count)
+		tp->deque_count = tp->config.max_threads;
+	tp->deques = aligned_alloc(LAM_THREAD_POOL_CACHE_LINE, sizeof(*tp->deques) * tp->deque_count);
+	if (tp->deques == NULL)
+		goto free_queue;
+	memset(tp->deques, 0, sizeof(*tp->deques) * tp->deque_count);
+
+	tp->free_tasks = amstack_alloc(tp->config.backlog + LAM_THREAD_POOL_FREE_TASKS);
+	if (tp->free_tasks == NULL)
+		goto free_deques;
+
 	rc = pthread_mutex_init(&tp->stats_mutex, NULL);
 	if (rc != 0)
-		goto free_queue;
+		goto free_tasks;
+
+	rc = pthread_mutex_init(&tp->overflow_mutex, NULL);
+	if (rc != 0)
+		goto free_stats_mutex;
+
+	if (lam_thread_pool_topology_init(tp) != AMRC_SUCCESS)
+		goto free_overflow_mutex;
+
+	rc = pthread_attr_init(&tp->thread_attr);
+	if (rc != 0)
+		goto free_topology;
+	if (tp->config.stack_size > 0) {
+		tp->config.stack_size = _MAX(tp->config.stack_size, LAM_THREAD_POOL_STACK_MIN);
+		rc = pthread_attr_setstacksize(&tp->thread_attr, _MAX(tp->config.stack_size, (uint64_t)PTHREAD_STACK_MIN));
+		if (rc != 0)
+			goto free_attr;
+	}
 
+	tp->cpu_count = _MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+	if (tp->config.affinity != LIBAM_THREAD_POOL_AFFINITY_NONE)
+		tp->cpu_count = tp->cpus_len;
 	tp->id = amsync_inc(&thread_pool_index);
 	tp->running_id = 1;
 	lam_thread_pool_stats_init(&tp->stats);
@@ -258,14 +1162,26 @@ lam_thread_pool_t* lam_thread_pool_create(const lam_thread_pool_config_t *config
 
 drain:
 	tp->drain_signal = 1;
+	lam_thread_pool_wake(tp, INT_MAX);
 	while (tp->active_thread_count > 0) {
 		poll_timeout.tv_sec = 0;
 		poll_timeout.tv_nsec = tp->config.poll_freq;
 		nanosleep(&poll_timeout, NULL);
 	}
+free_attr:
+	pthread_attr_destroy(&tp->thread_attr);
+free_topology:
+	lam_thread_pool_topology_free(tp);
+free_overflow_mutex:
+	pthread_mutex_destroy(&tp->overflow_mutex);
+free_stats_mutex:
 	pthread_mutex_destroy(&tp->stats_mutex);
+free_tasks:
+	lam_thread_pool_free_tasks(tp);
+free_deques:
+	free(tp->deques);
 free_queue:
-	amstack_free(tp->tasks_queue);
+	lam_thread_pool_queue_free(tp);
 free_tp:
 	free(tp);
 ret_error:
@@ -281,18 +1197,31 @@ amrc_t lam_thread_pool_destroy(lam_thread_pool_t *tp, lam_thread_pool_stats_t *s
 
 	debug_log("tp %lu draining\n", tp->id);
 	tp->drain_signal = 1;
+	lam_thread_pool_wake(tp, INT_MAX);
+	lam_thread_pool_futex_wake(&tp->space_seq, INT_MAX);
 	while (tp->threads_destroyed < tp->threads_created) {
 		poll_timeout.tv_sec = 0;
 		poll_timeout.tv_nsec = tp->config.poll_freq;
 		nanosleep(&poll_timeout, NULL);
 	}
+	pthread_attr_destroy(&tp->thread_attr);
+	lam_thread_pool_topology_free(tp);
+	pthread_mutex_destroy(&tp->overflow_mutex);
 	pthread_mutex_destroy(&tp->stats_mutex);
-	amstack_free(tp->tasks_queue);
+	lam_thread_pool_free_tasks(tp);
+	free(tp->deques);
+	lam_thread_pool_queue_free(tp);
 
 	if (stats != NULL) {
 		*stats = tp->stats;
+		stats->task_delay_p50 = amstat_hist_percentile(&tp->stats.task_delay_hist, 50);
+		stats->task_delay_p90 = amstat_hist_percentile(&tp->stats.task_delay_hist, 90);
+		stats->task_delay_p99 = amstat_hist_percentile(&tp->stats.task_delay_hist, 99);
+		stats->task_delay_p999 = amstat_hist_percentile(&tp->stats.task_delay_hist, 99.9);
 		stats->threads_created = tp->threads_created;
 		stats->tasks_created = tp->tasks_created;
+		stats->tasks_caller_run = tp->tasks_caller_run;
+		stats->tasks_overflowed = tp->tasks_overflowed;
 	}
 
 	debug_log("tp %lu destroyed\n", tp->id);
@@ -320,6 +1249,11 @@ uint64_t lam_thread_pool_get_max_thread_count(const lam_thread_pool_t *tp)
 	return tp->config.max_threads;
 }
 
+uint64_t lam_thread_pool_get_node_count(lam_thread_pool_t *tp)
+{
+	return lam_thread_pool_node_count(tp);
+}
+
 amrc_t lam_thread_pool_set_default_func(lam_thread_pool_t *tp, lam_thread_func_t value)
 {
 	if (tp == NULL || value == NULL)
@@ -333,6 +1267,9 @@ amrc_t lam_thread_pool_set_idle_timeout(lam_thread_pool_t *tp, amtime_t value)
 	if (tp == NULL)
 		return AMRC_ERROR;
 	tp->config.idle_timeout = value;
+	/* Parked workers are waiting on the previous timeout */
+	if (tp->config.flags & LIBAM_THREAD_POOL_BLOCKING)
+		lam_thread_pool_wake(tp, INT_MAX);
 	return AMRC_SUCCESS;
 }
 
@@ -366,29 +1303,122 @@ amrc_t lam_thread_pool_set_max_thread_count(lam_thread_pool_t *tp, uint64_t valu
 	return AMRC_SUCCESS;
 }
 
-/* Queue a task to execute via the thread pool
- * @Returns AMRC_SUCCESS / AMRC_ERROR. Nothing is queued when errors happen */
-amrc_t lam_thread_pool_run(lam_thread_pool_t* tp, lam_thread_func_t func, void* arg, void** ret_ptr)
+/* Queues on the caller's deque if it is one of the pool's workers, else on the shared queue, else on the overflow
+ * with LIBAM_THREAD_POOL_OVERFLOW_GROW
+ * @Returns AMRC_SUCCESS / AMRC_ERROR when full */
+static amrc_t lam_thread_pool_enqueue(lam_thread_pool_t *tp, lam_thread_pool_task_t *task, lam_thread_pool_deque_t *deque, ambool_t grow)
 {
-	lam_thread_pool_task_t *task;
+	if (deque != NULL && lam_thread_pool_deque_push(deque, task) == AMRC_SUCCESS)
+		return AMRC_SUCCESS;
+
+	/* Tasks overflowed, new ones go behind them */
+	if (grow && tp->overflow_count > 0) {
+		lam_thread_pool_overflow_push(tp, task);
+		return AMRC_SUCCESS;
+	}
+
+	if (lam_thread_pool_queue_push(tp, task) == AMRC_SUCCESS)
+		return AMRC_SUCCESS;
+
+	if (grow) {
+		lam_thread_pool_overflow_push(tp, task);
+		return AMRC_SUCCESS;
+	}
+	return AMRC_ERROR;
+}
+
+/* Waits for room in the shared queue, for up to <timeout>, or forever when 0
+ * @Returns AMRC_SUCCESS / AMRC_ERROR when timed out or draining */
+static amrc_t lam_thread_pool_enqueue_wait(lam_thread_pool_t *tp, lam_thread_pool_task_t *task, amtime_t timeout)
+{
+	amtime_t deadline = (timeout > 0 ? amtime_now() + timeout : 0);
+	amtime_t left = 0;
+	amtime_t now;
+	uint32_t seq;
 	amrc_t rc;
 
-	if (tp == NULL || tp->drain_signal)
-		{abort(); return AMRC_ERROR;}
+	while (1) {
+		seq = tp->space_seq;
+		amsync_inc(&tp->space_waiters);
+
+		/* Workers taking tasks now know to wake us */
+		rc = lam_thread_pool_queue_push(tp, task);
+		if (rc == AMRC_SUCCESS || tp->drain_signal)
+			break;
+
+		if (timeout > 0) {
+			now = amtime_now();
+			if (now >= deadline)
+				break;
+			left = deadline - now;
+		}
+		lam_thread_pool_futex_wait(&tp->space_seq, seq, left);
+		amsync_dec(&tp->space_waiters);
+	}
+
+	amsync_dec(&tp->space_waiters);
+	return rc;
+}
 
-	if (func == NULL) {
+/* Falls back on the default function, which custom ones may only override with LIBAM_THREAD_POOL_FUNC_OVERRIDE
+ * @Returns AMRC_SUCCESS / AMRC_ERROR when there is no function to run */
+static inline amrc_t lam_thread_pool_func_resolve(lam_thread_pool_t *tp, lam_thread_func_t *func)
+{
+	if (*func == NULL) {
 		if (tp->config.default_func == NULL)
 			return AMRC_ERROR;
-		func = tp->config.default_func;
+		*func = tp->config.default_func;
 	}
 	else if (tp->config.default_func != NULL && !(tp->config.flags & LIBAM_THREAD_POOL_FUNC_OVERRIDE)){
 		/* Only allow custom <func> to override <tp->config.default_func> when LIBAM_THREAD_POOL_FUNC_OVERRIDE set */
 		return AMRC_ERROR;
 	}
+	return AMRC_SUCCESS;
+}
 
-	task = malloc(sizeof(*task));
-	if (task == NULL)
-		return AMRC_ERROR;
+/* Queues a ready task, applying <overflow> when full.
+ * @Returns AMRC_SUCCESS when queued or run by the caller / AMRC_ERROR. Accounted in tasks_created until then */
+static amrc_t lam_thread_pool_place(lam_thread_pool_t *tp, lam_thread_pool_task_t *task, lam_thread_pool_deque_t *deque,
+		lam_thread_pool_overflow_t overflow, amtime_t timeout)
+{
+	void *ret;
+	amrc_t rc;
+
+	rc = lam_thread_pool_enqueue(tp, task, deque, (overflow == LIBAM_THREAD_POOL_OVERFLOW_GROW ? am_true : am_false));
+	if (rc != AMRC_SUCCESS) {
+		/* A worker waiting for room could be waiting on itself */
+		if (overflow == LIBAM_THREAD_POOL_OVERFLOW_BLOCK && worker_tp == tp)
+			overflow = LIBAM_THREAD_POOL_OVERFLOW_CALLER_RUNS;
+
+		if (overflow == LIBAM_THREAD_POOL_OVERFLOW_BLOCK) {
+			rc = lam_thread_pool_enqueue_wait(tp, task, timeout);
+		}
+		else if (overflow == LIBAM_THREAD_POOL_OVERFLOW_CALLER_RUNS) {
+			amsync_dec(&tp->tasks_created);
+			amsync_inc(&tp->tasks_caller_run);
+			debug_log("tp %lu full, caller runs task (%p)\n", tp->id, task->arg);
+
+			ret = task->func(task->arg);
+			if (task->ret_ptr != NULL)
+				*task->ret_ptr = ret;
+			lam_thread_pool_task_complete(tp, task);
+			return AMRC_SUCCESS;
+		}
+		if (rc != AMRC_SUCCESS)
+			return AMRC_ERROR;
+	}
+	lam_thread_pool_signal(tp, 1);
+
+	debug_log("tp %lu enqueued task %lu-%lu (%p)\n", tp->id, tp->id, task->id, task->arg);
+	return AMRC_SUCCESS;
+}
+
+/* Fills in a task of resolved <func>, see lam_thread_pool_func_resolve(), about to be queued on <depth> tasks.
+ * Starts a thread for it when none is idle
+ * @Returns AMRC_SUCCESS / AMRC_ERROR, then it is not accounted in tasks_created */
+static amrc_t lam_thread_pool_prepare(lam_thread_pool_t* tp, lam_thread_pool_task_t* task, lam_thread_func_t func, void* arg, void** ret_ptr,
+		uint64_t depth)
+{
 	task->id = amsync_inc(&tp->tasks_created) + 1;
 	task->func = func;
 	task->arg = arg;
@@ -396,7 +1426,7 @@ amrc_t lam_thread_pool_run(lam_thread_pool_t* tp, lam_thread_func_t func, void*
 
 	/* Accounting */
 	task->queue_time = amtime_now();
-	task->queue_depth = amstack_get_size(tp->tasks_queue);
+	task->queue_depth = depth;
 	task->active_thread_count = tp->active_thread_count;
 	task->idle_thread_count = tp->idle_thread_count;
 	if (task->idle_thread_count > task->active_thread_count) {
@@ -405,19 +1435,563 @@ amrc_t lam_thread_pool_run(lam_thread_pool_t* tp, lam_thread_func_t func, void*
 	}
 
 	/* Figure out if we need to start thread */
-	if (task->idle_thread_count == 0) {
-		rc = lam_thread_pool_start_thread(tp);
-		if (rc != AMRC_SUCCESS) {
-			free(task);
-			return AMRC_ERROR;
-		}
+	if (task->idle_thread_count == 0 && lam_thread_pool_start_thread(tp) != AMRC_SUCCESS) {
+		amsync_dec(&tp->tasks_created);
+		return AMRC_ERROR;
 	}
+	return AMRC_SUCCESS;
+}
+
+/* Queues a task of resolved <func>, see lam_thread_pool_func_resolve()
+ * @Returns AMRC_SUCCESS / AMRC_ERROR */
+static amrc_t lam_thread_pool_submit(lam_thread_pool_t* tp, lam_thread_pool_task_t* task, lam_thread_func_t func, void* arg, void** ret_ptr,
+		lam_thread_pool_overflow_t overflow, amtime_t timeout)
+{
+	lam_thread_pool_deque_t *deque = NULL;
+	uint64_t depth;
+
+	if (worker_tp == tp)
+		deque = worker_deque;
+
+	depth = (deque != NULL ? lam_thread_pool_deque_size(deque) : lam_thread_pool_queue_size(tp) + tp->overflow_count);
+	if (lam_thread_pool_prepare(tp, task, func, arg, ret_ptr, depth) != AMRC_SUCCESS)
+		return AMRC_ERROR;
 
 	/* Queue task */
-	rc = amstack_push(tp->tasks_queue, task);
-	if (rc != AMRC_SUCCESS)
+	if (lam_thread_pool_place(tp, task, deque, overflow, timeout) != AMRC_SUCCESS) {
+		amsync_dec(&tp->tasks_created);
+		return AMRC_ERROR;
+	}
+	return AMRC_SUCCESS;
+}
+
+/* Queues, starts threads and wakes workers for up to LAM_THREAD_POOL_BATCH tasks at once.
+ * @Returns number of tasks queued or run by the caller, from the start of the batch */
+static uint64_t lam_thread_pool_batch_chunk(lam_thread_pool_t* tp, const lam_thread_func_t* funcs, void* const* args, void** rets, uint64_t count)
+{
+	lam_thread_pool_task_t *tasks[LAM_THREAD_POOL_BATCH];
+	lam_thread_pool_deque_t *deque = NULL;
+	lam_thread_pool_task_t *task;
+	uint64_t active;
+	uint64_t idle;
+	uint64_t depth;
+	uint64_t base;
+	uint64_t queued = 0;
+	uint64_t wanted;
+	uint64_t i;
+	amtime_t now;
+
+	/* Descriptors */
+	i = amstack_pop_bulk(tp->free_tasks, (void**) tasks, count);
+	for (; i < count; i++) {
+		tasks[i] = malloc(sizeof(*tasks[i]));
+		if (tasks[i] == NULL) {
+			count = i;
+			break;
+		}
+		tasks[i]->pooled = 1;
+	}
+	if (count == 0)
+		return 0;
+
+	if (worker_tp == tp)
+		deque = worker_deque;
+
+	/* Accounting, once for the whole chunk */
+	base = amsync_add(&tp->tasks_created, count);
+	now = amtime_now();
+	depth = (deque != NULL ? lam_thread_pool_deque_size(deque) : lam_thread_pool_queue_size(tp) + tp->overflow_count);
+	active = tp->active_thread_count;
+	idle = tp->idle_thread_count;
+	active = _MAX(active, idle);
+
+	for (i = 0; i < count; i++) {
+		task = tasks[i];
+		task->id = base + i + 1;
+		task->func = (funcs != NULL ? funcs[i] : NULL);
+		lam_thread_pool_func_resolve(tp, &task->func); /* Checked by the caller */
+		task->arg = args[i];
+		task->ret_ptr = (rets != NULL ? &rets[i] : NULL);
+		task->queue_time = now;
+		task->queue_depth = depth + i;
+		task->active_thread_count = active;
+		task->idle_thread_count = idle;
+	}
+
+	/* As many threads as the chunk can keep busy, capped by the CPUs, and by max_threads when starting them */
+	wanted = _MIN(count, tp->cpu_count);
+	for (i = idle; i < wanted; i++) {
+		if (lam_thread_pool_start_thread(tp) != AMRC_SUCCESS) {
+			if (active == 0 && i == idle)
+				goto undo;
+			break;
+		}
+	}
+
+	/* One reservation per queue, overflow policy for whatever did not fit */
+	if (deque != NULL)
+		queued = lam_thread_pool_deque_push_bulk(deque, tasks, count);
+	if (queued < count && !(tp->config.overflow == LIBAM_THREAD_POOL_OVERFLOW_GROW && tp->overflow_count > 0))
+		queued += lam_thread_pool_queue_push_bulk(tp, (void**) &tasks[queued], count - queued);
+	if (queued > 0)
+		lam_thread_pool_signal(tp, queued);
+	debug_log("tp %lu enqueued tasks %lu-%lu to %lu-%lu\n", tp->id, tp->id, base + 1, tp->id, base + queued);
+
+	for (; queued < count; queued++) {
+		if (lam_thread_pool_place(tp, tasks[queued], deque, tp->config.overflow, tp->config.submit_timeout) != AMRC_SUCCESS)
+			break;
+	}
+	if (queued == count)
+		return count;
+
+	/* The rest is not queued */
+	amsync_sub(&tp->tasks_created, count - queued);
+	for (i = queued; i < count; i++)
+		lam_thread_pool_task_free(tp, tasks[i]);
+	return queued;
+
+undo:
+	amsync_sub(&tp->tasks_created, count);
+	for (i = 0; i < count; i++)
+		lam_thread_pool_task_free(tp, tasks[i]);
+	return 0;
+}
+
+uint64_t lam_thread_pool_run_batch(lam_thread_pool_t* tp, const lam_thread_func_t* funcs, void* const* args, void** rets, uint64_t count)
+{
+	lam_thread_func_t func;
+	uint64_t queued = 0;
+	uint64_t chunk;
+	uint64_t done;
+	uint64_t i;
+
+	if (tp == NULL || tp->drain_signal)
+		{abort(); return 0;}
+
+	if (args == NULL)
+		return 0;
+
+	/* All or nothing on functions, so the batch is not cut short halfway for it */
+	for (i = 0; i < count; i++) {
+		func = (funcs != NULL ? funcs[i] : NULL);
+		if (lam_thread_pool_func_resolve(tp, &func) != AMRC_SUCCESS)
+			return 0;
+		if (funcs == NULL)
+			break;
+	}
+
+	while (queued < count) {
+		chunk = _MIN(count - queued, LAM_THREAD_POOL_BATCH);
+		done = lam_thread_pool_batch_chunk(tp, (funcs != NULL ? &funcs[queued] : NULL), &args[queued],
+				(rets != NULL ? &rets[queued] : NULL), chunk);
+		queued += done;
+		if (done < chunk)
+			break;
+	}
+	return queued;
+}
+
+static amrc_t lam_thread_pool_run_overflow(lam_thread_pool_t* tp, lam_thread_func_t func, void* arg, void** ret_ptr,
+		lam_thread_pool_overflow_t overflow, amtime_t timeout)
+{
+	lam_thread_pool_task_t *task;
+
+	if (tp == NULL || tp->drain_signal)
+		{abort(); return AMRC_ERROR;}
+
+	if (lam_thread_pool_func_resolve(tp, &func) != AMRC_SUCCESS)
+		return AMRC_ERROR;
+
+	task = lam_thread_pool_task_alloc(tp);
+	if (task == NULL)
+		return AMRC_ERROR;
+
+	/* On success, the descriptor is the worker's, or already recycled if the caller ran it */
+	if (lam_thread_pool_submit(tp, task, func, arg, ret_ptr, overflow, timeout) != AMRC_SUCCESS) {
+		lam_thread_pool_task_free(tp, task);
+		return AMRC_ERROR;
+	}
+	return AMRC_SUCCESS;
+}
+
+/* Queue a task to execute via the thread pool.
+ * Tasks queued by the pool's own workers go to the worker's deque, where idle workers steal them from.
+ * Descriptors are recycled, steady state submission does not allocate.
+ * When the queue is full, config.overflow decides what happens.
+ * @Returns AMRC_SUCCESS / AMRC_ERROR. Nothing is queued when errors happen */
+amrc_t lam_thread_pool_run(lam_thread_pool_t* tp, lam_thread_func_t func, void* arg, void** ret_ptr)
+{
+	return lam_thread_pool_run_overflow(tp, func, arg, ret_ptr, tp->config.overflow, tp->config.submit_timeout);
+}
+
+amrc_t lam_thread_pool_try_run(lam_thread_pool_t* tp, lam_thread_func_t func, void* arg, void** ret_ptr)
+{
+	return lam_thread_pool_run_overflow(tp, func, arg, ret_ptr, LIBAM_THREAD_POOL_OVERFLOW_FAIL, 0);
+}
+
+amrc_t lam_thread_pool_run_timeout(lam_thread_pool_t* tp, lam_thread_func_t func, void* arg, void** ret_ptr, amtime_t timeout)
+{
+	return lam_thread_pool_run_overflow(tp, func, arg, ret_ptr, LIBAM_THREAD_POOL_OVERFLOW_BLOCK, timeout);
+}
+
+amrc_t lam_thread_pool_run_task(lam_thread_pool_t* tp, lam_thread_pool_task_t* task, lam_thread_func_t func, void* arg, void** ret_ptr)
+{
+	if (tp == NULL || tp->drain_signal)
+		{abort(); return AMRC_ERROR;}
+
+	if (task == NULL || lam_thread_pool_func_resolve(tp, &func) != AMRC_SUCCESS)
+		return AMRC_ERROR;
+
+	task->pooled = 0;
+	task->done = LIBAM_THREAD_POOL_TASK_PENDING;
+	return lam_thread_pool_submit(tp, task, func, arg, ret_ptr, tp->config.overflow, tp->config.submit_timeout);
+}
+
+amrc_t lam_thread_pool_run_on_node(lam_thread_pool_t* tp, uint64_t node, lam_thread_func_t func, void* arg, void** ret_ptr)
+{
+	lam_thread_pool_task_t *task;
+	lam_thread_pool_node_t *target;
+
+	if (tp == NULL || tp->drain_signal)
+		{abort(); return AMRC_ERROR;}
+
+	if (node >= lam_thread_pool_node_count(tp))
+		return AMRC_ERROR;
+
+	/* No worker is bound to a node, any of them may run the task */
+	if (tp->nodes == NULL)
+		return lam_thread_pool_run_overflow(tp, func, arg, ret_ptr, LIBAM_THREAD_POOL_OVERFLOW_FAIL, 0);
+
+	if (lam_thread_pool_func_resolve(tp, &func) != AMRC_SUCCESS)
+		return AMRC_ERROR;
+	target = &tp->nodes[node];
+
+	task = lam_thread_pool_task_alloc(tp);
+	if (task == NULL)
+		return AMRC_ERROR;
+
+	if (lam_thread_pool_prepare(tp, task, func, arg, ret_ptr, lam_thread_pool_ring_size(target->ring)) != AMRC_SUCCESS)
+		goto free_task;
+	if (lam_thread_pool_ring_push(target->ring, task) != AMRC_SUCCESS) {
+		amsync_dec(&tp->tasks_created);
+		goto free_task;
+	}
+
+	lam_thread_pool_node_signal(tp, target);
+
+	debug_log("tp %lu enqueued task %lu-%lu on node %lu (%p)\n", tp->id, tp->id, task->id, node, task->arg);
+	return AMRC_SUCCESS;
+
+free_task:
+	lam_thread_pool_task_free(tp, task);
+	return AMRC_ERROR;
+}
+
+lam_thread_pool_future_t* lam_thread_pool_async(lam_thread_pool_t* tp, lam_thread_pool_future_t* future, lam_thread_func_t func, void* arg)
+{
+	if (future == NULL)
+		return NULL;
+
+	future->tp = tp;
+	future->ret = NULL;
+	if (lam_thread_pool_run_task(tp, &future->task, func, arg, &future->ret) != AMRC_SUCCESS)
+		return NULL;
+	return future;
+}
+
+/* Registers as waiting on <future>, so its completion wakes waiters
+ * @Returns am_true if it is already done */
+static inline ambool_t lam_thread_pool_future_watch(lam_thread_pool_future_t* future)
+{
+	uint32_t state = __atomic_load_n(&future->task.done, __ATOMIC_ACQUIRE);
+
+	if (state == LIBAM_THREAD_POOL_TASK_PENDING &&
+			!amsync_swap(&future->task.done, LIBAM_THREAD_POOL_TASK_PENDING, LIBAM_THREAD_POOL_TASK_WAITED))
+		state = __atomic_load_n(&future->task.done, __ATOMIC_ACQUIRE); /* Lost to the completion */
+	return (state == LIBAM_THREAD_POOL_TASK_DONE ? am_true : am_false);
+}
+
+/* Workers waiting on their own pool run its tasks meanwhile, the one waited on may be behind them in their deque
+ * @Returns am_true if a task ran */
+static ambool_t lam_thread_pool_future_help(lam_thread_pool_t* tp)
+{
+	lam_thread_pool_task_t *task;
+
+	if (worker_tp != tp || tp == NULL)
+		return am_false;
+
+	task = lam_thread_pool_task_get(tp, worker_deque, worker_node, worker_id);
+	if (task == NULL)
+		return am_false;
+
+	/* Part of the busy period of the task waiting */
+	lam_thread_pool_task_exec(tp, task, worker_stats);
+	(*worker_busy)++;
+	return am_true;
+}
+
+/* @Returns time left to <deadline>, 0 for no deadline / AMTIME_MAX when past it */
+static inline amtime_t lam_thread_pool_time_left(amtime_t deadline)
+{
+	amtime_t now;
+
+	if (deadline == 0)
+		return 0;
+	now = amtime_now();
+	return (now >= deadline ? AMTIME_MAX : deadline - now);
+}
+
+amrc_t lam_thread_pool_future_wait_timeout(lam_thread_pool_future_t* future, amtime_t timeout, void** ret)
+{
+	amtime_t deadline = (timeout > 0 ? amtime_now() + timeout : 0);
+	amtime_t left;
+
+	while (!lam_thread_pool_future_done(future)) {
+		if (lam_thread_pool_future_help(future->tp))
+			continue;
+
+		left = lam_thread_pool_time_left(deadline);
+		if (left == AMTIME_MAX)
+			return AMRC_ERROR;
+		if (lam_thread_pool_future_watch(future))
+			break;
+		lam_thread_pool_futex_wait(&future->task.done, LIBAM_THREAD_POOL_TASK_WAITED, left);
+	}
+
+	if (ret != NULL)
+		*ret = future->ret;
+	return AMRC_SUCCESS;
+}
+
+void* lam_thread_pool_future_wait(lam_thread_pool_future_t* future)
+{
+	void *ret;
+
+	lam_thread_pool_future_wait_timeout(future, 0, &ret);
+	return ret;
+}
+
+amrc_t lam_thread_pool_future_wait_all(lam_thread_pool_future_t* futures, uint64_t count, amtime_t timeout)
+{
+	amtime_t deadline = (timeout > 0 ? amtime_now() + timeout : 0);
+	amtime_t left;
+	uint64_t i;
+
+	for (i = 0; i < count; i++) {
+		left = lam_thread_pool_time_left(deadline);
+		if (left == AMTIME_MAX && !lam_thread_pool_future_done(&futures[i]))
+			return AMRC_ERROR;
+		if (lam_thread_pool_future_wait_timeout(&futures[i], (left == AMTIME_MAX ? 0 : left), NULL) != AMRC_SUCCESS)
+			return AMRC_ERROR;
+	}
+	return AMRC_SUCCESS;
+}
+
+amrc_t lam_thread_pool_future_wait_any(lam_thread_pool_future_t* futures, uint64_t count, amtime_t timeout, uint64_t* index)
+{
+	amtime_t deadline = (timeout > 0 ? amtime_now() + timeout : 0);
+	lam_thread_pool_t *tp;
+	amtime_t left;
+	uint32_t seq;
+	uint64_t i;
+
+	if (count == 0)
 		return AMRC_ERROR;
+	tp = futures[0].tp;
+
+	while (1) {
+		/* Read before watching, completions of watched futures move it on */
+		seq = tp->complete_seq;
+		for (i = 0; i < count; i++) {
+			if (lam_thread_pool_future_watch(&futures[i])) {
+				if (index != NULL)
+					*index = i;
+				return AMRC_SUCCESS;
+			}
+		}
+
+		if (lam_thread_pool_future_help(tp))
+			continue;
+
+		left = lam_thread_pool_time_left(deadline);
+		if (left == AMTIME_MAX)
+			return AMRC_ERROR;
+		lam_thread_pool_futex_wait(&tp->complete_seq, seq, left);
+	}
+}
+
+/* Shared by all pieces of a parallel loop, lives on the stack of its caller */
+typedef struct lam_parallel_desc {
+	lam_thread_pool_t *tp;
+	uint64_t grain;
+	lam_parallel_func_t func;
+	lam_parallel_reduce_func_t reduce; /* Replaces func for reductions */
+	lam_parallel_join_func_t join;
+	void *ctx;
+	const void *identity;
+	uint32_t size;
+} lam_parallel_desc_t;
+
+/* A piece of the range, and its partial result */
+typedef struct lam_parallel_job {
+	const lam_parallel_desc_t *desc;
+	uint64_t begin;
+	uint64_t end;
+	uint8_t acc[LAM_PARALLEL_ACC_MAX] __attribute__((aligned(16)));
+} lam_parallel_job_t;
+
+typedef struct lam_parallel_child {
+	lam_thread_pool_future_t future;
+	lam_parallel_job_t job;
+} lam_parallel_child_t;
+
+static void lam_parallel_run(lam_parallel_job_t *job);
+
+/* Pieces running on this thread's stack. Those waiting on their halves run others on top of them */
+static __thread uint32_t parallel_depth;
+
+static void* lam_parallel_task(void *arg)
+{
+	lam_parallel_run(arg);
+	return NULL;
+}
+
+/* Halves are only worth handing out when someone is there to take them: thieves emptied the worker's own deque,
+ * or the shared queue has fewer tasks than idle workers. Workers past LAM_THREAD_POOL_DEQUE_COUNT have no deque */
+static inline ambool_t lam_parallel_demand(lam_thread_pool_t *tp)
+{
+	if (worker_tp == tp && worker_deque != NULL)
+		return (lam_thread_pool_deque_size(worker_deque) == 0 ? am_true : am_false);
+	return (lam_thread_pool_queue_size(tp) < _MAX(tp->idle_thread_count, 1) ? am_true : am_false);
+}
+
+/* Queues <child>, failing rather than waiting when full: the caller keeps the range then */
+static amrc_t lam_parallel_spawn(lam_thread_pool_t *tp, lam_parallel_child_t *child)
+{
+	lam_thread_pool_future_t *future = &child->future;
+
+	future->tp = tp;
+	future->ret = NULL;
+	future->task.pooled = 0;
+	future->task.done = LIBAM_THREAD_POOL_TASK_PENDING;
+	return lam_thread_pool_submit(tp, &future->task, lam_parallel_task, &child->job, &future->ret,
+			LIBAM_THREAD_POOL_OVERFLOW_FAIL, 0);
+}
+
+static inline void lam_parallel_body(lam_parallel_job_t *job, uint64_t begin, uint64_t end)
+{
+	const lam_parallel_desc_t *desc = job->desc;
+
+	if (desc->reduce != NULL)
+		desc->reduce(begin, end, desc->ctx, job->acc);
+	else
+		desc->func(begin, end, desc->ctx);
+}
+
+/* Lazy binary splitting: the range is run a grain at a time, and halved whenever there is demand for work.
+ * Halves handed out are split the same way by whoever runs them */
+static void lam_parallel_run(lam_parallel_job_t *job)
+{
+	const lam_parallel_desc_t *desc = job->desc;
+	lam_parallel_child_t children[LAM_THREAD_POOL_PARALLEL_SPLITS];
+	lam_parallel_child_t *child;
+	uint64_t begin = job->begin;
+	uint64_t end = job->end;
+	uint64_t count = 0;
+	uint64_t mid;
+	ambool_t split;
+
+	/* Pieces past the depth run their whole range, waiting on nothing, so the stack is bounded */
+	split = (++parallel_depth <= LAM_THREAD_POOL_PARALLEL_DEPTH ? am_true : am_false);
+
+	while (end - begin > desc->grain) {
+		if (split && count < LAM_THREAD_POOL_PARALLEL_SPLITS && lam_parallel_demand(desc->tp)) {
+			mid = begin + (end - begin) / 2;
+			child = &children[count];
+			child->job.desc = desc;
+			child->job.begin = mid;
+			child->job.end = end;
+			if (desc->size > 0)
+				memcpy(child->job.acc, desc->identity, desc->size);
+			if (lam_parallel_spawn(desc->tp, child) == AMRC_SUCCESS) {
+				count++;
+				end = mid;
+				continue;
+			}
+		}
+		lam_parallel_body(job, begin, begin + desc->grain);
+		begin += desc->grain;
+	}
+	lam_parallel_body(job, begin, end);
+
+	/* Nearest half first, partial results are joined in range order */
+	while (count-- > 0) {
+		child = &children[count];
+		lam_thread_pool_future_wait(&child->future);
+		if (desc->join != NULL)
+			desc->join(job->acc, child->job.acc, desc->ctx);
+	}
+	parallel_depth--;
+}
+
+static amrc_t lam_parallel(lam_parallel_desc_t *desc, uint64_t begin, uint64_t end, void* result)
+{
+	lam_parallel_job_t job;
+	lam_thread_pool_t *tp = desc->tp;
+
+	if (tp == NULL || tp->drain_signal)
+		{abort(); return AMRC_ERROR;}
+
+	if (begin >= end)
+		return AMRC_SUCCESS;
 
-	debug_log("tp %lu enqueued task %lu-%lu (%p)\n", tp->id, tp->id, task->id, arg);
+	if (desc->grain == 0)
+		desc->grain = _MAX((end - begin) / (tp->cpu_count * LAM_THREAD_POOL_PARALLEL_CHUNKS), 1);
+
+	job.desc = desc;
+	job.begin = begin;
+	job.end = end;
+	if (desc->size > 0)
+		memcpy(job.acc, desc->identity, desc->size);
+
+	lam_parallel_run(&job);
+
+	if (result != NULL)
+		memcpy(result, job.acc, desc->size);
 	return AMRC_SUCCESS;
 }
+
+amrc_t lam_parallel_for(lam_thread_pool_t* tp, uint64_t begin, uint64_t end, uint64_t grain, lam_parallel_func_t func, void* ctx)
+{
+	lam_parallel_desc_t desc = {
+		.tp = tp,
+		.grain = grain,
+		.func = func,
+		.ctx = ctx,
+	};
+
+	if (func == NULL)
+		return AMRC_ERROR;
+	return lam_parallel(&desc, begin, end, NULL);
+}
+
+amrc_t lam_parallel_reduce(lam_thread_pool_t* tp, uint64_t begin, uint64_t end, uint64_t grain, lam_parallel_reduce_func_t func,
+		lam_parallel_join_func_t join, void* ctx, void* result, uint32_t size)
+{
+	uint8_t identity[LAM_PARALLEL_ACC_MAX] __attribute__((aligned(16)));
+	lam_parallel_desc_t desc = {
+		.tp = tp,
+		.grain = grain,
+		.reduce = func,
+		.join = join,
+		.ctx = ctx,
+		.identity = identity,
+		.size = size,
+	};
+
+	if (func == NULL || join == NULL || result == NULL || size == 0 || size > LAM_PARALLEL_ACC_MAX)
+		return AMRC_ERROR;
+
+	memcpy(identity, result, size);
+	return lam_parallel(&desc, begin, end, result);
+}
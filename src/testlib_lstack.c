@@ -83,6 +83,8 @@ static volatile uint64_t meddles = 0;
 
 static threadlist_t* tl = NULL;
 static amlstack_t stack;
+static amlstack_tagged_t tagged_stack;
+static ambool_t use_tagged = am_false;
 static object_t* all_objects = NULL;
 
 /**
@@ -90,6 +92,21 @@ static object_t* all_objects = NULL;
  * -----------------------------------------------------------------------------
  */
 
+static inline void stack_push(amlstack_node_t* node)
+{
+	if (use_tagged)
+		amlstack_tagged_push(&tagged_stack, node);
+	else
+		amlstack_push(&stack, node);
+}
+
+static inline amlstack_node_t* stack_pop()
+{
+	if (use_tagged)
+		return amlstack_tagged_pop(&tagged_stack);
+	return amlstack_pop(&stack);
+}
+
 void* reader_thread_func(void* data)
 {
 	thread_ctx_t* ent = (thread_ctx_t*)data;
@@ -105,7 +122,7 @@ void* reader_thread_func(void* data)
 	while (!signal_go); // Bustwait for signal
 	while (ops_done < ent->target_capacity) {
 		do {
-			node = amlstack_pop(&stack);
+			node = stack_pop();
 		} while (node == NULL);
 		obj = container_of(node, object_t, node);
 		obj->record[obj->record_index] = opid;
@@ -136,7 +153,7 @@ void* writer_thread_func(void* data)
 		ent->objects[ops_done] = NULL;
 		obj->record[obj->record_index] = opid;
 		obj->record_index = (obj->record_index + 1) % RECORD_LENGTH;
-		amlstack_push(&stack, &obj->node);
+		stack_push(&obj->node);
 		ops_done++;
 		ent->progress = ops_done;
 		amsync_inc(&writes);
@@ -162,7 +179,7 @@ void* meddler_thread_func(void* data)
 	while (!signal_stop) {
 		obj = NULL;
 		do {
-			node = amlstack_pop(&stack);
+			node = stack_pop();
 		} while (node == NULL && !signal_stop);
 		if (signal_stop)
 			break;
@@ -173,7 +190,7 @@ void* meddler_thread_func(void* data)
 			printf("ERROR: Meddler thread %d caught with object id %lu\n", ent->id, obj->object_id);
 			break;
 		}
-		amlstack_push(&stack, &obj->node);
+		stack_push(&obj->node);
 
 		ops_done++;
 		ent->progress = ops_done;
@@ -208,6 +225,7 @@ static void globals_term()
 {
 	fflush(stdout);
 	amlstack_term(&stack);
+	amlstack_tagged_term(&tagged_stack);
 
 	if (all_objects != NULL)
 		free(all_objects);
@@ -225,6 +243,7 @@ static amrc_t globals_init()
 	all_objects = NULL;
 
 	amlstack_init(&stack);
+	amlstack_tagged_init(&tagged_stack);
 
 	all_objects = malloc(sizeof(*all_objects) * WRITE_OBJECTS);
 	if (all_objects == NULL) {
@@ -709,7 +728,8 @@ int main()
 
 	printf("libam testing of amlstack_t starting.");
 	fflush(stdout);
-	for (i = 0; i < 3; i++) {
+	for (i = 0; i < 6; i++) {
+		use_tagged = (i >= 3);
 		run_readers(cpu_numbers);
 		printf(".");
 		fflush(stdout);
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef NDEBUG
+#include <stdio.h>
+#undef assert
+#define assert(cond) do {if (!(cond)) { fprintf(stderr, "Assertion '" #cond "' failed at %s:%d\n", __FILE__, __LINE__); fflush(stderr); abort(); }} while(0)
+#else
+#include <assert.h>
+#endif
+
+#include "libam/libam_time.h"
+#include "libam/libam_replace.h"
+#include "libam/libam_atomic.h"
+#include "libam/libam_pool.h"
+#include "libam/libam_objcache.h"
+
+/**
+ * TYPES & CONSTANTS
+ * -----------------------------------------------------------------------------
+ */
+
+enum {
+	OBJECTS = 200,
+	LIMITED_FREE = 64,
+
+	MT_THREADS = 8,
+	MT_ITERATIONS = 20000,
+	MT_BATCH = 100,
+
+	OBJECT_MAGIC = 0x0B1EC7,
+};
+
+typedef struct object {
+	pthread_mutex_t lock;
+	uint32_t magic; /* Set by the constructor only */
+	volatile uint32_t owner; /* 0 while cached */
+	uint64_t uses;
+	uint8_t payload[200];
+} object_t;
+
+typedef struct counters {
+	volatile uint64_t ctors;
+	volatile uint64_t dtors;
+	volatile ambool_t fail_ctor;
+} counters_t;
+
+/**
+ * GLOBALS
+ * -----------------------------------------------------------------------------
+ */
+
+static volatile uint32_t owner_seq = 0;
+
+#define UNUSED_SYM(x) (void)(x)
+
+/**
+ * FUNCTIONS
+ * -----------------------------------------------------------------------------
+ */
+
+static amrc_t object_ctor(void* ptr, void* user_data)
+{
+	counters_t* counters = user_data;
+	object_t* obj = ptr;
+
+	if (counters->fail_ctor)
+		return AMRC_ERROR;
+
+	assert(obj->magic != OBJECT_MAGIC);
+	if (pthread_mutex_init(&obj->lock, NULL) != 0)
+		return AMRC_ERROR;
+	obj->magic = OBJECT_MAGIC;
+	obj->owner = 0;
+	obj->uses = 0;
+	amsync_inc(&counters->ctors);
+	return AMRC_SUCCESS;
+}
+
+static void object_dtor(void* ptr, void* user_data)
+{
+	counters_t* counters = user_data;
+	object_t* obj = ptr;
+
+	assert(obj->magic == OBJECT_MAGIC && obj->owner == 0);
+	pthread_mutex_destroy(&obj->lock);
+	obj->magic = 0;
+	amsync_inc(&counters->dtors);
+}
+
+static amobjcache_t* cache_create(ampool_t* pool, counters_t* counters, uint64_t max_free)
+{
+	amobjcache_config_t config = {
+		.size = sizeof(object_t),
+		.ctor = object_ctor,
+		.dtor = object_dtor,
+		.user_data = counters,
+		.max_free = max_free,
+	};
+
+	memset(counters, 0, sizeof(*counters));
+	return amobjcache_alloc(pool, &config);
+}
+
+/* Objects come back as they were put back, constructed once */
+static void run_reuse(ampool_t* pool)
+{
+	amobjcache_stats_t stats;
+	amobjcache_t* cache;
+	counters_t counters;
+	object_t* obj;
+	object_t* again;
+
+	cache = cache_create(pool, &counters, 0);
+	assert(cache != NULL);
+
+	obj = amobjcache_get(cache);
+	assert(obj != NULL && obj->magic == OBJECT_MAGIC && obj->uses == 0);
+	pthread_mutex_lock(&obj->lock);
+	obj->uses++;
+	pthread_mutex_unlock(&obj->lock);
+	amobjcache_put(cache, obj);
+
+	again = amobjcache_get(cache);
+	assert(again == obj && again->uses == 1);
+	assert(counters.ctors == 1 && counters.dtors == 0);
+
+	amobjcache_get_stats(cache, &stats);
+	assert(stats.used == 1 && stats.cached == 0 && stats.constructed == 1 && stats.destructed == 0);
+	amobjcache_put(cache, again);
+
+	amobjcache_free(cache);
+	assert(counters.dtors == 1);
+	assert(ampool_get_size(pool) == 0);
+}
+
+/* Slots overflow into the depot, up to max_free, and trim empties both */
+static void run_depot(ampool_t* pool, uint64_t max_free)
+{
+	static object_t* objs[OBJECTS];
+	amobjcache_stats_t stats;
+	amobjcache_t* cache;
+	counters_t counters;
+	uint64_t released;
+	uint64_t i;
+
+	cache = cache_create(pool, &counters, max_free);
+	assert(cache != NULL);
+
+	for (i = 0; i < OBJECTS; i++) {
+		objs[i] = amobjcache_get(cache);
+		assert(objs[i] != NULL && objs[i]->magic == OBJECT_MAGIC);
+	}
+	for (i = 0; i < OBJECTS; i++)
+		amobjcache_put(cache, objs[i]);
+
+	amobjcache_get_stats(cache, &stats);
+	assert(stats.used == 0 && stats.constructed == OBJECTS);
+	if (max_free == 0)
+		assert(stats.cached == OBJECTS && stats.destructed == 0);
+	else
+		assert(stats.cached <= max_free + AMOBJCACHE_MAG_SIZE * 2 && stats.cached + stats.destructed == OBJECTS);
+
+	/* Served from the cache, nothing new is constructed */
+	for (i = 0; i < stats.cached; i++) {
+		objs[i] = amobjcache_get(cache);
+		assert(objs[i] != NULL && objs[i]->magic == OBJECT_MAGIC);
+	}
+	assert(counters.ctors == OBJECTS);
+	for (i = 0; i < stats.cached; i++)
+		amobjcache_put(cache, objs[i]);
+
+	released = amobjcache_trim(cache);
+	assert(released == stats.cached);
+	UNUSED_SYM(released);
+	assert(counters.dtors == OBJECTS);
+	assert(ampool_get_size(pool) == 0);
+
+	amobjcache_get_stats(cache, &stats);
+	assert(stats.used == 0 && stats.cached == 0 && stats.destructed == OBJECTS);
+
+	amobjcache_free(cache);
+}
+
+/* A failing constructor fails the get, and the object goes back to the pool */
+static void run_ctor_failure(ampool_t* pool)
+{
+	amobjcache_t* cache;
+	counters_t counters;
+
+	cache = cache_create(pool, &counters, 0);
+	assert(cache != NULL);
+
+	counters.fail_ctor = am_true;
+	assert(amobjcache_get(cache) == NULL);
+	assert(ampool_get_size(pool) == 0);
+
+	counters.fail_ctor = am_false;
+	amobjcache_put(cache, amobjcache_get(cache));
+
+	amobjcache_free(cache);
+	assert(counters.ctors == 1 && counters.dtors == 1);
+}
+
+static void* run_thread(void* arg)
+{
+	amobjcache_t* cache = arg;
+	object_t* objs[MT_BATCH];
+	uint32_t owner = amsync_inc(&owner_seq) + 1;
+	uint64_t count;
+	uint64_t i;
+	uint64_t j;
+
+	for (i = 0; i < MT_ITERATIONS; i++) {
+		count = 1 + (i * 7) % MT_BATCH;
+		for (j = 0; j < count; j++) {
+			objs[j] = amobjcache_get(cache);
+			assert(objs[j] != NULL && objs[j]->magic == OBJECT_MAGIC);
+			assert(amsync_swap(&objs[j]->owner, 0, owner)); /* Never handed out twice */
+			objs[j]->uses++;
+		}
+		for (j = 0; j < count; j++) {
+			assert(amsync_swap(&objs[j]->owner, owner, 0));
+			amobjcache_put(cache, objs[j]);
+		}
+	}
+	UNUSED_SYM(owner);
+	return NULL;
+}
+
+/* Objects gotten and put back by threads, they travel between slots through the depot */
+static void run_threaded(ampool_t* pool)
+{
+	pthread_t threads[MT_THREADS];
+	amobjcache_stats_t stats;
+	amobjcache_t* cache;
+	counters_t counters;
+	uint64_t i;
+	int rc;
+
+	cache = cache_create(pool, &counters, 0);
+	assert(cache != NULL);
+
+	for (i = 0; i < MT_THREADS; i++) {
+		rc = pthread_create(&threads[i], NULL, run_thread, cache);
+		assert(rc == 0);
+	}
+	for (i = 0; i < MT_THREADS; i++) {
+		rc = pthread_join(threads[i], NULL);
+		assert(rc == 0);
+	}
+	UNUSED_SYM(rc);
+
+	amobjcache_get_stats(cache, &stats);
+	assert(stats.used == 0 && stats.constructed == counters.ctors);
+	assert(stats.cached == stats.constructed && stats.constructed <= MT_THREADS * (MT_BATCH + AMOBJCACHE_MAG_SIZE * 2));
+
+	amobjcache_free(cache);
+	assert(counters.dtors == counters.ctors);
+	assert(ampool_get_size(pool) == 0);
+}
+
+int main(UNUSED int argc, UNUSED const char** argv)
+{
+	static const ampool_flags_t variants[] = {
+		AMPOOL_VALIDATE_ON_FREE,
+		AMPOOL_VALIDATE_ON_FREE | AMPOOL_THREAD_CACHE,
+		AMPOOL_VALIDATE_ON_FREE | AMPOOL_COMPACT | AMPOOL_FAST,
+	};
+	ampool_t* pool;
+	amtime_t start;
+	uint64_t v;
+
+	ampool_init();
+
+	printf("libam testing of amobjcache_t starting.");
+	fflush(stdout);
+	start = amtime_now();
+	for (v = 0; v < ARRAY_SIZE(variants); v++) {
+		pool = ampool_pool_alloc_flags(NULL, variants[v]);
+		assert(pool != NULL);
+
+		run_reuse(pool);
+		run_depot(pool, 0);
+		run_depot(pool, LIMITED_FREE);
+		run_ctor_failure(pool);
+		run_threaded(pool);
+		printf(".");
+		fflush(stdout);
+
+		ampool_pool_free(pool);
+	}
+
+	ampool_term();
+
+	printf("\nlibam testing of amobjcache_t done successfully (%.2lf seconds)!\n", ((double)amtime_now() - start) / ((double)AMTIME_SEC));
+}
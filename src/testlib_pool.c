@@ -29,9 +29,28 @@ enum {
 	MIN_SIZE = 8,
 	MAX_SIZE = 1024,
 	ROUNDS = 10240,
+
+	MT_THREADS = 4,
+	MT_SLOTS = 1024,
+	MT_ITERATIONS = 100000,
+	MT_MAX_SIZE = 16 * 1024,
+
+	ARENA_OBJECTS = 4096,
+	ARENA_BLOCK = 16 * 1024,
+
+	TRIM_OBJECTS = 1000,
+	BULK_OBJECTS = 300,
+	HIERARCHY_ITERATIONS = 20000,
+	PROFILE_OBJECTS = 1000,
+	HUGE_OBJECTS = 1000,
+	HUGE_REGION = 2 * 1024 * 1024,
+	GUARD_SIZE = 100, /* Leaves slack in its size class for the canary */
 };
 
 #define static_pool_name "Sequential_test_pool"
+#define arena_pool_name "Arena_test_pool"
+static const char profile_site_a[] = "Profile_site_A"; /* Sites are told apart by address */
+static const char profile_site_b[] = "Profile_site_B";
 
 typedef enum status {
 	ALLOCATED,
@@ -51,6 +70,7 @@ typedef struct {
 	void* ptr;
 	uint64_t object_id;
 	uint64_t size;
+	uint64_t accounted; /* Size as accounted by the pool */
 	uint64_t seq;
 	status_t status;
 	uint8_t data[MAX_SIZE];
@@ -91,7 +111,7 @@ static volatile uint64_t allocated_size = 0;
 	}
 }*/
 
-static ampool_t* prep() {
+static ampool_t* prep(const ampool_config_t* config) {
 	uint64_t i;
 
 	for (i = 0; i < OBJECTS; i++) {
@@ -110,7 +130,7 @@ static ampool_t* prep() {
 	allocated_size = 0;
 	used_objects = 0;
 
-	return ampool_pool_alloc_flags_named(NULL, AMPOOL_VALIDATE_ON_FREE, static_pool_name);
+	return ampool_pool_alloc_config_named(NULL, config, static_pool_name);
 }
 
 static action_t action_randomizer() {
@@ -160,7 +180,9 @@ static void func_allocate(ampool_t* pool)
 		assert(obj->ptr);
 
 		obj->status = ALLOCATED;
-		amsync_add(&allocated_size, obj->size);
+		obj->accounted = ampool_elem_size(pool, obj->ptr);
+		assert(obj->accounted >= obj->size);
+		amsync_add(&allocated_size, obj->accounted);
 
 		memset(obj->data, 0x33, sizeof(obj->data));
 		memcpy(obj->data, &obj->seq, sizeof(obj->seq));
@@ -191,9 +213,12 @@ static void func_free(ampool_t* pool)
 		amsync_dec(&used_objects);
 		assert(memcmp(obj->data, obj->ptr, obj->size) == 0);
 		//printf("%lu-%lu:\tFRE: Seq %lu, freeing object %lu with size %lu\n", used_objects, free_objects, obj->seq, obj->object_id, obj->size);
-		pool->free(pool, obj->ptr, obj->size);
+		if (obj->seq & 1)
+			ampool_free(pool, obj->ptr);
+		else
+			ampool_free_sized(pool, obj->ptr, obj->size);
 		obj->ptr = NULL;
-		amsync_sub(&allocated_size, obj->size);
+		amsync_sub(&allocated_size, obj->accounted);
 		obj->status = FREED;
 		amsync_inc(&free_objects);
 
@@ -225,9 +250,10 @@ static void func_realloc(ampool_t* pool)
 		obj->ptr = pool->realloc(pool, obj->ptr, obj->size, new_size, (char*)obj->object_id);
 		assert(obj->ptr);
 		assert(memcmp(obj->data, obj->ptr, _MIN(obj->size, new_size)) == 0);
-		amsync_sub(&allocated_size, obj->size);
-		amsync_add(&allocated_size, new_size);
+		amsync_sub(&allocated_size, obj->accounted);
 		obj->size = new_size;
+		obj->accounted = ampool_elem_size(pool, obj->ptr);
+		amsync_add(&allocated_size, obj->accounted);
 
 		obj->seq = amsync_inc(&seq);
 		memset(obj->data, 0x33, sizeof(obj->data));
@@ -255,26 +281,58 @@ static ampool_t* stat_pool;
 static amrc_t fnuc_test_cb(const ampool_elem_diag_t* di, UNUSED void* user_data)
 {
 	uint64_t obj_id = (uint64_t)di->elem_name;
-	object_t* obj = &all_objects[obj_id - 1];
+	object_t* obj;
+
+	/* Compact pools keep no names, look the object up by address */
+	if (di->elem_name == NULL) {
+		for (obj_id = 1; obj_id <= OBJECTS; obj_id++) {
+			if (all_objects[obj_id - 1].status == ALLOCATED && all_objects[obj_id - 1].ptr == di->elem)
+				break;
+		}
+		assert(obj_id <= OBJECTS);
+	}
+	obj = &all_objects[obj_id - 1];
 
 	assert(di->pool == stat_pool);
 	assert(strcmp(di->pool_name, static_pool_name) == 0);
 
 	assert(obj->object_id == obj_id);
 	assert(obj->ptr == di->elem);
-	assert(obj->size == di->elem_size);
+	assert(obj->accounted == di->elem_size);
 	assert(obj->status == ALLOCATED);
 	assert(memcmp(obj->data, di->elem, obj->size) == 0);
 
 	stat_elems ++;
-	stat_size += obj->size;
+	stat_size += obj->accounted;
 	obj_stats[obj_id - 1]++;
 
 	return AMRC_SUCCESS;
 }
 
+static amrc_t pool_diag_cb(const ampool_diag_t* di, void* user_data)
+{
+	uint64_t node_total = 0;
+	uint32_t i;
+
+	if (di->pool != stat_pool)
+		return AMRC_SUCCESS;
+
+	assert(di->size == allocated_size);
+	assert(di->elements == used_objects);
+	assert(di->nodes >= 1 && di->nodes <= AMPOOL_MAX_NODES);
+	for (i = 0; i < AMPOOL_MAX_NODES; i++) {
+		assert(i < di->nodes || di->node_size[i] == 0);
+		node_total += di->node_size[i];
+	}
+	assert(node_total <= di->size);
+
+	(*(uint64_t*)user_data)++;
+	return AMRC_SUCCESS;
+}
+
 static void func_test(ampool_t* pool)
 {
+	uint64_t diag_hits = 0;
 	object_t* obj;
 	uint64_t i;
 	uint64_t verify_size = 0;
@@ -295,7 +353,7 @@ static void func_test(ampool_t* pool)
 			assert(obj->status == FREED);
 		else {
 			assert(obj->status == ALLOCATED);
-			verify_size += obj->size;
+			verify_size += obj->accounted;
 			verify_elems ++;
 		}
 	}
@@ -304,6 +362,9 @@ static void func_test(ampool_t* pool)
 	assert(verify_elems == stat_elems);
 	assert(verify_size == allocated_size);
 	assert(verify_elems == used_objects);
+
+	ampool_diag(pool_diag_cb, &diag_hits);
+	assert(diag_hits == 1);
 }
 
 static void func_term(ampool_t* pool)
@@ -312,7 +373,7 @@ static void func_term(ampool_t* pool)
 	pool->pool_free(pool);
 }
 
-static void run_until_done(uint64_t seed) {
+static void run_until_done(uint64_t seed, const ampool_config_t* config) {
 	ampool_t* pool;
 	action_t act;
 
@@ -322,7 +383,7 @@ static void run_until_done(uint64_t seed) {
 	fflush(stdout);
 	srand(seed);
 
-	pool = prep();
+	pool = prep(config);
 	func_test(pool);
 
 	while (1) {
@@ -339,15 +400,625 @@ static void run_until_done(uint64_t seed) {
 	}
 }
 
+/* Multi-threaded alloc/free, where half of the frees are done by a different thread than the allocating one */
+typedef struct mt_ctx {
+	ampool_t* pool;
+	uint64_t seed;
+	void* volatile* slots;
+} mt_ctx_t;
+
+static void* mt_worker(void* arg)
+{
+	mt_ctx_t* ctx = arg;
+	unsigned int seed = ctx->seed;
+	uint64_t i;
+	uint64_t slot;
+	uint32_t size;
+	void* ptr;
+
+	for (i = 0; i < MT_ITERATIONS; i++) {
+		slot = rand_r(&seed) % MT_SLOTS;
+		ptr = ctx->slots[slot];
+		if (ptr != NULL) {
+			if (amsync_swap(&ctx->slots[slot], ptr, NULL))
+				ctx->pool->free(ctx->pool, ptr, *(uint32_t*)ptr);
+			continue;
+		}
+
+		size = (rand_r(&seed) % (MT_MAX_SIZE - MIN_SIZE)) + MIN_SIZE;
+		ptr = ctx->pool->alloc(ctx->pool, size, __LOCATION__);
+		assert(ptr != NULL);
+		*(uint32_t*)ptr = size;
+		if (!amsync_swap(&ctx->slots[slot], NULL, ptr))
+			ctx->pool->free(ctx->pool, ptr, size);
+	}
+
+	return NULL;
+}
+
+static void run_threaded(const ampool_config_t* config)
+{
+	void* volatile slots[MT_SLOTS];
+	pthread_t threads[MT_THREADS];
+	mt_ctx_t ctx[MT_THREADS];
+	ampool_t* pool;
+	uint64_t i;
+	int rc;
+
+	memset((void*)slots, 0, sizeof(slots));
+	pool = ampool_pool_alloc_config_named(NULL, config, static_pool_name);
+	assert(pool != NULL);
+
+	for (i = 0; i < MT_THREADS; i++) {
+		ctx[i].pool = pool;
+		ctx[i].seed = amtime_now() + i;
+		ctx[i].slots = slots;
+		rc = pthread_create(&threads[i], NULL, mt_worker, &ctx[i]);
+		assert(rc == 0);
+	}
+	for (i = 0; i < MT_THREADS; i++) {
+		rc = pthread_join(threads[i], NULL);
+		assert(rc == 0);
+	}
+	UNUSED_SYM(rc);
+
+	for (i = 0; i < MT_SLOTS; i++)
+		if (slots[i] != NULL)
+			pool->free(pool, slots[i], *(uint32_t*)slots[i]);
+	assert(pool->get_size(pool) == 0);
+
+	pool->pool_free(pool);
+}
+
+typedef struct arena_ctx {
+	ampool_t* arena;
+	unsigned int seed;
+	uint8_t id;
+	uint8_t* ptrs[ARENA_OBJECTS];
+	uint32_t sizes[ARENA_OBJECTS];
+} arena_ctx_t;
+
+static void* arena_worker(void* arg)
+{
+	arena_ctx_t* ctx = arg;
+	uint64_t i;
+	uint64_t j;
+
+	for (i = 0; i < ARENA_OBJECTS; i++) {
+		ctx->sizes[i] = MIN_SIZE + rand_r(&ctx->seed) % (ARENA_BLOCK / 2);
+		ctx->ptrs[i] = ampool_alloc(ctx->arena, ctx->sizes[i]);
+		assert(ctx->ptrs[i] != NULL);
+		for (j = 0; j < ctx->sizes[i]; j++)
+			assert(ctx->ptrs[i][j] == 0);
+		memset(ctx->ptrs[i], ctx->id, ctx->sizes[i]);
+	}
+	return NULL;
+}
+
+static amrc_t arena_diag_cb(const ampool_diag_t* di, void* user_data)
+{
+	ampool_t* arena = user_data;
+
+	if (di->pool != arena)
+		return AMRC_SUCCESS;
+
+	assert(strcmp(di->pool_name, arena_pool_name) == 0);
+	assert(di->parent != NULL && strcmp(di->parent_name, static_pool_name) == 0);
+	assert(di->size == ampool_get_size(arena));
+	assert(di->elements == MT_THREADS * ARENA_OBJECTS + 1);
+	assert(di->reserved >= di->size);
+	return AMRC_ERROR; /* Found it, stop */
+}
+
+/* Arenas: concurrent bump allocation into zeroed, non-overlapping memory, in-place realloc of the last object,
+ * and release along with the parent pool */
+static void run_arena()
+{
+	pthread_t threads[MT_THREADS];
+	arena_ctx_t* ctx;
+	ampool_t* parent;
+	ampool_t* arena;
+	uint8_t* ptr;
+	uint8_t* newptr;
+	uint64_t size;
+	uint64_t i;
+	uint64_t j;
+	uint64_t k;
+	int rc;
+
+	ctx = malloc(sizeof(*ctx) * MT_THREADS);
+	assert(ctx != NULL);
+
+	parent = ampool_pool_alloc_flags_named(NULL, AMPOOL_VALIDATE_ON_FREE, static_pool_name);
+	assert(parent != NULL);
+	arena = ampool_arena_alloc_named(parent, ARENA_BLOCK, arena_pool_name);
+	assert(arena != NULL);
+
+	for (i = 0; i < MT_THREADS; i++) {
+		ctx[i].arena = arena;
+		ctx[i].seed = amtime_now() + i;
+		ctx[i].id = i + 1;
+		rc = pthread_create(&threads[i], NULL, arena_worker, &ctx[i]);
+		assert(rc == 0);
+	}
+	size = 0;
+	for (i = 0; i < MT_THREADS; i++) {
+		rc = pthread_join(threads[i], NULL);
+		assert(rc == 0);
+		for (j = 0; j < ARENA_OBJECTS; j++) {
+			for (k = 0; k < ctx[i].sizes[j]; k++)
+				assert(ctx[i].ptrs[j][k] == ctx[i].id);
+			size += (ctx[i].sizes[j] + 15) & ~15UL;
+		}
+	}
+	UNUSED_SYM(rc);
+	assert(ampool_get_size(arena) == size);
+
+	/* Free is a no-op */
+	ampool_free_sized(arena, ctx[0].ptrs[0], ctx[0].sizes[0]);
+	assert(ampool_get_size(arena) == size);
+
+	/* Last object of the block grows in place, with the growth zeroed */
+	ptr = ampool_alloc(arena, 100);
+	assert(ptr != NULL);
+	memset(ptr, 0xAB, 100);
+	newptr = ampool_realloc(arena, ptr, 100, 200);
+	assert(newptr == ptr);
+	for (k = 0; k < 200; k++)
+		assert(newptr[k] == (k < 100 ? 0xAB : 0));
+	assert(ampool_get_size(arena) == size + 208);
+	UNUSED_SYM(newptr);
+
+	ampool_diag(arena_diag_cb, arena);
+
+	ampool_pool_free(parent); /* Takes the arena along */
+	free(ctx);
+}
+
+static amrc_t realloc_diag_cb(const ampool_diag_t* di, void* user_data)
+{
+	uint64_t* counts = user_data;
+
+	if (strcmp(di->pool_name, static_pool_name) != 0)
+		return AMRC_SUCCESS;
+	counts[0] = di->realloc_inplace;
+	counts[1] = di->realloc_moved;
+	return AMRC_ERROR; /* Found it, stop */
+}
+
+/* Reallocs within the size class keep the pointer, and both kinds are counted */
+static void run_realloc(ampool_flags_t flags)
+{
+	ampool_t* pool;
+	uint8_t* ptr;
+	uint8_t* newptr;
+	uint64_t counts[2];
+	uint64_t k;
+
+	pool = ampool_pool_alloc_flags_named(NULL, flags, static_pool_name);
+	assert(pool != NULL);
+
+	/* 100 and 104 share the 97-112 class */
+	ptr = ampool_alloc(pool, 100);
+	assert(ptr != NULL);
+	memset(ptr, 0xAB, 100);
+	newptr = ampool_realloc(pool, ptr, 100, 104);
+	assert(newptr == ptr);
+	for (k = 0; k < 104; k++)
+		assert(newptr[k] == (k < 100 ? 0xAB : 0));
+
+	/* Out of the class, must move */
+	ptr = ampool_realloc(pool, newptr, 104, 90);
+	assert(ptr != NULL);
+	for (k = 0; k < 90; k++)
+		assert(ptr[k] == 0xAB);
+
+	/* Oversized, may or may not move */
+	ptr = ampool_realloc(pool, ptr, 90, 4000);
+	assert(ptr != NULL);
+	newptr = ampool_realloc(pool, ptr, 4000, 100000);
+	assert(newptr != NULL);
+	for (k = 0; k < 100000; k++)
+		assert(newptr[k] == (k < 90 ? 0xAB : 0));
+
+	counts[0] = counts[1] = 0;
+	ampool_diag(realloc_diag_cb, counts);
+	assert(counts[0] >= 1 && counts[1] >= 2 && counts[0] + counts[1] == 4);
+	UNUSED_SYM(counts);
+	UNUSED_SYM(newptr);
+
+	ampool_free(pool, newptr);
+	assert(ampool_get_size(pool) == 0);
+	ampool_pool_free(pool);
+}
+
+static amrc_t trim_diag_cb(const ampool_diag_t* di, void* user_data)
+{
+	uint64_t* trimmed = user_data;
+
+	if (strcmp(di->pool_name, static_pool_name) != 0)
+		return AMRC_SUCCESS;
+	*trimmed = di->trimmed;
+	return AMRC_ERROR; /* Found it, stop */
+}
+
+/* Free memory is only released once it stayed free for a whole trim period, or when asked for all of it */
+static void run_trim(const ampool_config_t* config)
+{
+	static void* ptrs[TRIM_OBJECTS];
+	ampool_t* pool;
+	uint64_t released;
+	uint64_t trimmed;
+	uint64_t i;
+
+	pool = ampool_pool_alloc_config_named(NULL, config, static_pool_name);
+	assert(pool != NULL);
+
+	for (i = 0; i < TRIM_OBJECTS; i++) {
+		ptrs[i] = ampool_alloc(pool, 100);
+		assert(ptrs[i] != NULL);
+	}
+	for (i = 0; i < TRIM_OBJECTS; i++)
+		ampool_free(pool, ptrs[i]);
+
+	/* Nothing was free at the start of the period */
+	released = ampool_trim(pool, am_false);
+	assert(released == 0);
+
+	released = ampool_trim(pool, am_false);
+	/* Hugepage slabs stay with the pool for reuse */
+	assert((config->flags & (AMPOOL_FAST | AMPOOL_HUGEPAGE)) ? released == 0 : released > 0);
+	released += ampool_trim(pool, am_true);
+
+	trimmed = 0;
+	ampool_diag(trim_diag_cb, &trimmed);
+	assert(trimmed == released);
+	UNUSED_SYM(trimmed);
+
+	/* Still usable afterwards */
+	for (i = 0; i < TRIM_OBJECTS; i++) {
+		ptrs[i] = ampool_alloc(pool, 100);
+		assert(ptrs[i] != NULL);
+	}
+	for (i = 0; i < TRIM_OBJECTS; i++)
+		ampool_free(pool, ptrs[i]);
+	assert(ampool_get_size(pool) == 0);
+
+	ampool_trim(NULL, am_true);
+	ampool_pool_free(pool);
+}
+
+/* Batches come back zeroed and distinct, and may be freed in bulk, in mixed batches or one by one */
+static void run_bulk(const ampool_config_t* config)
+{
+	static const uint32_t sizes[] = { 100, 2000, 100000 };
+	static uint8_t* ptrs[BULK_OBJECTS * ARRAY_SIZE(sizes)];
+	ampool_t* pool;
+	uint64_t accounted;
+	uint64_t i;
+	uint64_t j;
+	uint64_t k;
+	amrc_t rc;
+
+	pool = ampool_pool_alloc_config_named(NULL, config, static_pool_name);
+	assert(pool != NULL);
+
+	accounted = 0;
+	for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+		rc = ampool_alloc_bulk(pool, sizes[j], BULK_OBJECTS, (void**)&ptrs[j * BULK_OBJECTS]);
+		assert(rc == AMRC_SUCCESS);
+		for (i = j * BULK_OBJECTS; i < (j + 1) * BULK_OBJECTS; i++) {
+			for (k = 0; k < _MIN(sizes[j], 1024); k++)
+				assert(ptrs[i][k] == 0);
+			memset(ptrs[i], (uint8_t)i, sizes[j]);
+			accounted += ampool_elem_size(pool, ptrs[i]);
+		}
+	}
+	UNUSED_SYM(rc);
+	assert(ampool_get_size(pool) == accounted);
+
+	for (i = 0; i < ARRAY_SIZE(ptrs); i++)
+		for (k = 0; k < sizes[i / BULK_OBJECTS]; k += 64)
+			assert(ptrs[i][k] == (uint8_t)i);
+
+	/* Sized batch, mixed batch, then one by one */
+	ampool_free_bulk(pool, (void**)ptrs, BULK_OBJECTS / 2, sizes[0]);
+	ampool_free_bulk(pool, (void**)&ptrs[BULK_OBJECTS / 2], BULK_OBJECTS * 2, 0);
+	for (i = BULK_OBJECTS * 5 / 2; i < ARRAY_SIZE(ptrs); i++)
+		ampool_free(pool, ptrs[i]);
+	assert(ampool_get_size(pool) == 0);
+
+	/* Again, reusing what was freed */
+	rc = ampool_alloc_bulk(pool, sizes[0], BULK_OBJECTS, (void**)ptrs);
+	assert(rc == AMRC_SUCCESS);
+	for (i = 0; i < BULK_OBJECTS; i++)
+		for (k = 0; k < sizes[0]; k++)
+			assert(ptrs[i][k] == 0);
+	ampool_free_bulk(pool, (void**)ptrs, BULK_OBJECTS, sizes[0]);
+	assert(ampool_get_size(pool) == 0);
+
+	ampool_pool_free(pool);
+}
+
+typedef struct hierarchy_ctx {
+	ampool_t* parent;
+	volatile uint64_t* running;
+	uint64_t diag_count;
+} hierarchy_ctx_t;
+
+/* Child pools (and grandchildren) created and freed under a shared parent, as per connection pools would be */
+static void* hierarchy_worker(void* arg)
+{
+	hierarchy_ctx_t* ctx = arg;
+	ampool_t* child;
+	ampool_t* grandchild;
+	void* ptr;
+	uint64_t i;
+
+	for (i = 0; i < HIERARCHY_ITERATIONS; i++) {
+		child = ampool_pool_alloc_flags_named(ctx->parent, AMPOOL_VALIDATE_ON_FREE, static_pool_name);
+		assert(child != NULL);
+		grandchild = ampool_arena_alloc_named(child, 0, arena_pool_name);
+		assert(grandchild != NULL);
+
+		ptr = ampool_alloc(child, 64);
+		assert(ptr != NULL);
+		ptr = ampool_alloc(grandchild, 64);
+		assert(ptr != NULL);
+		UNUSED_SYM(ptr);
+
+		if (i & 1)
+			ampool_pool_free(grandchild);
+		ampool_pool_free(child); /* Takes what is left along */
+	}
+
+	amsync_dec(ctx->running);
+	return NULL;
+}
+
+static amrc_t hierarchy_diag_cb(const ampool_diag_t* di, void* user_data)
+{
+	hierarchy_ctx_t* ctx = user_data;
+
+	assert(di->pool != NULL && di->pool_name != NULL);
+	if (di->parent == ctx->parent)
+		assert(strcmp(di->pool_name, static_pool_name) == 0);
+	ctx->diag_count++;
+	return AMRC_SUCCESS;
+}
+
+/* Pools come and go under a shared parent, while the hierarchy is walked */
+static void run_hierarchy()
+{
+	pthread_t threads[MT_THREADS];
+	hierarchy_ctx_t ctx;
+	volatile uint64_t running = MT_THREADS;
+	uint64_t i;
+	int rc;
+
+	ctx.parent = ampool_pool_alloc_flags_named(NULL, AMPOOL_VALIDATE_ON_FREE, static_pool_name);
+	assert(ctx.parent != NULL);
+	ctx.running = &running;
+	ctx.diag_count = 0;
+
+	for (i = 0; i < MT_THREADS; i++) {
+		rc = pthread_create(&threads[i], NULL, hierarchy_worker, &ctx);
+		assert(rc == 0);
+	}
+	while (running > 0) {
+		ampool_diag(hierarchy_diag_cb, &ctx);
+		ampool_trim(NULL, am_true);
+	}
+	for (i = 0; i < MT_THREADS; i++) {
+		rc = pthread_join(threads[i], NULL);
+		assert(rc == 0);
+	}
+	UNUSED_SYM(rc);
+
+	ctx.diag_count = 0;
+	ampool_diag(hierarchy_diag_cb, &ctx);
+	assert(ctx.diag_count == 1);
+
+	ampool_pool_free(ctx.parent);
+}
+
+static amrc_t profile_cb(const ampool_profile_t* pp, void* user_data)
+{
+	ampool_profile_t* sites = user_data;
+
+	assert(pp->sample_rate == 1);
+	sites[pp->site == profile_site_a ? 0 : 1] = *pp;
+	return AMRC_SUCCESS;
+}
+
+/* Live bytes and counts per call site, with every allocation sampled */
+static void run_profile()
+{
+	static void* ptrs[PROFILE_OBJECTS];
+	const ampool_config_t config = { .flags = AMPOOL_VALIDATE_ON_FREE | AMPOOL_PROFILE, .profile_rate = 1 };
+	ampool_profile_t sites[2];
+	ampool_t* pool;
+	uint64_t i;
+
+	pool = ampool_pool_alloc_config_named(NULL, &config, static_pool_name);
+	assert(pool != NULL);
+
+	for (i = 0; i < PROFILE_OBJECTS; i++) {
+		ptrs[i] = pool->alloc(pool, (i & 1) ? 2000 : 100, (i & 1) ? profile_site_b : profile_site_a);
+		assert(ptrs[i] != NULL);
+	}
+	/* Free half of site A, grow all of site B in place */
+	for (i = 0; i < PROFILE_OBJECTS; i += 4)
+		ampool_free(pool, ptrs[i]);
+	for (i = 1; i < PROFILE_OBJECTS; i += 2)
+		ptrs[i] = ampool_realloc(pool, ptrs[i], 2000, 2040);
+
+	memset(sites, 0, sizeof(sites));
+	ampool_profile(pool, profile_cb, sites);
+	assert(sites[0].site == profile_site_a && sites[1].site == profile_site_b);
+	assert(sites[0].allocs == PROFILE_OBJECTS / 2 && sites[0].frees == PROFILE_OBJECTS / 4);
+	assert(sites[0].live_count == PROFILE_OBJECTS / 4 && sites[0].live_bytes == PROFILE_OBJECTS / 4 * 100);
+	assert(sites[1].allocs == PROFILE_OBJECTS / 2 && sites[1].frees == 0);
+	assert(sites[1].live_count == PROFILE_OBJECTS / 2 && sites[1].live_bytes == PROFILE_OBJECTS / 2 * 2040);
+
+	ampool_pool_free(pool);
+}
+
+static amrc_t hugepage_diag_cb(const ampool_diag_t* di, void* user_data)
+{
+	uint64_t* hugepage_bytes = user_data;
+
+	if (strcmp(di->pool_name, static_pool_name) != 0)
+		return AMRC_SUCCESS;
+	*hugepage_bytes = di->hugepage_bytes;
+	return AMRC_ERROR; /* Found it, stop */
+}
+
+static inline uintptr_t huge_region(const void* ptr)
+{
+	return (uintptr_t)ptr / HUGE_REGION;
+}
+
+/* Size classes share hugepage regions, and slabs given up by one class are reused by others */
+static void run_hugepage()
+{
+	static void* ptrs[HUGE_OBJECTS];
+	const ampool_config_t config = { .flags = AMPOOL_VALIDATE_ON_FREE | AMPOOL_HUGEPAGE };
+	uint64_t hugepage_bytes;
+	ampool_t* pool;
+	void* small;
+	void* large;
+	uint64_t i;
+
+	pool = ampool_pool_alloc_config_named(NULL, &config, static_pool_name);
+	assert(pool != NULL);
+
+	small = ampool_alloc(pool, 16);
+	large = ampool_alloc(pool, 512);
+	assert(small != NULL && large != NULL);
+	assert(huge_region(small) == huge_region(large));
+
+	for (i = 0; i < HUGE_OBJECTS; i++) {
+		ptrs[i] = ampool_alloc(pool, 100);
+		assert(ptrs[i] != NULL && huge_region(ptrs[i]) == huge_region(small));
+	}
+	for (i = 0; i < HUGE_OBJECTS; i++)
+		ampool_free(pool, ptrs[i]);
+	ampool_trim(pool, am_true);
+
+	for (i = 0; i < HUGE_OBJECTS; i++) {
+		ptrs[i] = ampool_alloc(pool, 300);
+		assert(ptrs[i] != NULL && huge_region(ptrs[i]) == huge_region(small));
+	}
+
+	/* Depends on the system, either a whole region or none */
+	hugepage_bytes = UINT64_MAX;
+	ampool_diag(hugepage_diag_cb, &hugepage_bytes);
+	assert(hugepage_bytes == 0 || hugepage_bytes == HUGE_REGION);
+	UNUSED_SYM(hugepage_bytes);
+
+	for (i = 0; i < HUGE_OBJECTS; i++)
+		ampool_free(pool, ptrs[i]);
+	ampool_free(pool, small);
+	ampool_free(pool, large);
+	assert(ampool_get_size(pool) == 0);
+	ampool_pool_free(pool);
+}
+
+static void guard_cb(const ampool_guard_report_t* report, void* user_data)
+{
+	ampool_guard_report_t* last = user_data;
+
+	*last = *report;
+}
+
+/* Every allocation guarded, each kind of corruption is reported with its allocation site */
+static void run_guard()
+{
+	const ampool_config_t config = { .flags = AMPOOL_GUARD, .guard_rate = 1 };
+	ampool_guard_report_t report;
+	ampool_t* pool;
+	uint8_t* ptr;
+	void* other;
+	uint64_t i;
+
+	ampool_guard_handler(guard_cb, &report);
+	pool = ampool_pool_alloc_config_named(NULL, &config, static_pool_name);
+	assert(pool != NULL);
+
+	/* Overflow into the canary */
+	memset(&report, 0, sizeof(report));
+	ptr = pool->alloc(pool, GUARD_SIZE, profile_site_a);
+	assert(ptr != NULL);
+	ptr[GUARD_SIZE + 1] ^= 0xFF;
+	ampool_free(pool, ptr);
+	assert(report.error == AMPOOL_GUARD_OVERFLOW && report.offset == GUARD_SIZE + 1);
+	assert(report.elem == ptr && report.elem_size == GUARD_SIZE && report.elem_name == profile_site_a);
+	assert(report.pool == pool && strcmp(report.pool_name, static_pool_name) == 0);
+
+	/* Double free while quarantined is ignored */
+	memset(&report, 0, sizeof(report));
+	ampool_free(pool, ptr);
+	assert(report.error == AMPOOL_GUARD_DOUBLE_FREE && report.elem == ptr);
+	assert(ampool_get_size(pool) == 0);
+
+	/* Write after free, caught as the chunk leaves the quarantine */
+	memset(&report, 0, sizeof(report));
+	ptr = pool->alloc(pool, GUARD_SIZE, profile_site_b);
+	assert(ptr != NULL);
+	ampool_free(pool, ptr);
+	ptr[10] ^= 0xFF;
+	for (i = 0; i < AMPOOL_GUARD_QUARANTINE; i++) {
+		assert(report.elem == NULL);
+		other = ampool_alloc(pool, GUARD_SIZE);
+		assert(other != NULL);
+		ampool_free(pool, other);
+	}
+	assert(report.error == AMPOOL_GUARD_USE_AFTER_FREE && report.offset == 10);
+	assert(report.elem == ptr && report.elem_name == profile_site_b);
+
+	assert(ampool_get_size(pool) == 0);
+	ampool_pool_free(pool);
+	ampool_guard_handler(NULL, NULL);
+}
+
 /* Status: We currently have very rudimentary functional tests
  * TODO: hierarchical add/delete pools
- * TODO: multi-threaded alloc/free
  * TODO: Verify overflow protections are working
  * TODO: Verify overflow data
  */
 int main(UNUSED int argc, UNUSED const char** argv)
 {
+	static const struct {
+		ampool_config_t config;
+		uint64_t rounds;
+	} variants[] = {
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE }, .rounds = ROUNDS },
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE | AMPOOL_THREAD_CACHE }, .rounds = ROUNDS / 4 },
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE | AMPOOL_SLAB }, .rounds = ROUNDS / 4 },
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE | AMPOOL_SLAB | AMPOOL_THREAD_CACHE }, .rounds = ROUNDS / 4 },
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE | AMPOOL_COMPACT }, .rounds = ROUNDS / 4 },
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE | AMPOOL_COMPACT | AMPOOL_THREAD_CACHE }, .rounds = ROUNDS / 4 },
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE | AMPOOL_FAST }, .rounds = ROUNDS / 4 },
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE | AMPOOL_FAST | AMPOOL_THREAD_CACHE }, .rounds = ROUNDS / 4 },
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE | AMPOOL_FAST | AMPOOL_COMPACT }, .rounds = ROUNDS / 4 },
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE | AMPOOL_NUMA | AMPOOL_THREAD_CACHE }, .rounds = ROUNDS / 4 },
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE | AMPOOL_HUGEPAGE | AMPOOL_THREAD_CACHE }, .rounds = ROUNDS / 4 },
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE | AMPOOL_HUGEPAGE | AMPOOL_COMPACT | AMPOOL_NUMA }, .rounds = ROUNDS / 4 },
+		/* Size classes above 512 bytes, with and without retention caps */
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE, .max_pooled = 64 * 1024 }, .rounds = ROUNDS / 4 },
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE, .max_pooled = 64 * 1024, .retain_bytes = 4096 }, .rounds = ROUNDS / 4 },
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE | AMPOOL_THREAD_CACHE, .max_pooled = 64 * 1024, .retain_bytes = 4096 }, .rounds = ROUNDS / 4 },
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE | AMPOOL_COMPACT | AMPOOL_FAST, .max_pooled = 64 * 1024 }, .rounds = ROUNDS / 4 },
+		/* Every allocation sampled, names go through the profile table */
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE | AMPOOL_PROFILE, .max_pooled = 64 * 1024, .profile_rate = 1 }, .rounds = ROUNDS / 4 },
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE | AMPOOL_PROFILE | AMPOOL_FAST | AMPOOL_THREAD_CACHE, .profile_rate = 3 }, .rounds = ROUNDS / 4 },
+		/* Guarded, any false report aborts */
+		{ .config = { .flags = AMPOOL_VALIDATE_ON_FREE | AMPOOL_GUARD | AMPOOL_THREAD_CACHE, .max_pooled = 64 * 1024, .guard_rate = 1 }, .rounds = ROUNDS / 4 },
+		{ .config = { .flags = AMPOOL_GUARD | AMPOOL_FAST | AMPOOL_PROFILE, .profile_rate = 5, .guard_rate = 3 }, .rounds = ROUNDS / 4 },
+	};
 	uint64_t i;
+	uint64_t v;
 	amtime_t start;
 
 	ampool_init();
@@ -355,12 +1026,27 @@ int main(UNUSED int argc, UNUSED const char** argv)
 	printf("libam testing of ampool_t starting.");
 	fflush(stdout);
 	start = amtime_now();
-	for (i = 0; i < ROUNDS; i++) {
-		run_until_done(0);
-		if ((i & 0xFFF) == 0)
-			printf(".");
-		fflush(stdout);
+	for (v = 0; v < ARRAY_SIZE(variants); v++) {
+		for (i = 0; i < variants[v].rounds; i++) {
+			run_until_done(0, &variants[v].config);
+			if ((i & 0xFFF) == 0)
+				printf(".");
+			fflush(stdout);
+		}
+		run_threaded(&variants[v].config);
+	}
+	for (v = 0; v < ARRAY_SIZE(variants); v++) {
+		run_realloc(variants[v].config.flags);
+		run_trim(&variants[v].config);
+		run_bulk(&variants[v].config);
 	}
+	run_arena();
+	run_hierarchy();
+	run_profile();
+	run_hugepage();
+	run_guard();
+
+	ampool_term();
 
 	printf("\nlibam testing of amstack_t done successfully (%.2lf seconds)!\n", ((double)amtime_now() - start) / ((double)AMTIME_SEC));
 }
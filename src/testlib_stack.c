@@ -574,6 +574,39 @@ static void init_cpu_array(uint64_t* cpu_number_array, uint64_t array_len)
 	add_cpu_number(cpu_number_array, array_len, procs * 2);
 }
 
+/* Bulk operations fill and drain in order, and stop at the edges */
+static void run_bulk()
+{
+	object_t* in[STACK_SIZE + 2];
+	object_t* out[STACK_SIZE + 2];
+	amstack_t* stk;
+	uint64_t count;
+	uint64_t i;
+
+	stk = amstack_alloc(STACK_SIZE);
+	assert(stk != NULL);
+	for (i = 0; i < ARRAY_SIZE(in); i++)
+		in[i] = &all_objects[i];
+
+	count = amstack_push_bulk(stk, (void**)in, 3);
+	assert(count == 3 && amstack_get_size(stk) == 3);
+	count = amstack_push_bulk(stk, (void**)&in[3], ARRAY_SIZE(in) - 3);
+	assert(count == STACK_SIZE - 3 && amstack_get_size(stk) == STACK_SIZE);
+	assert(amstack_push_bulk(stk, (void**)in, 1) == 0);
+
+	count = amstack_pop_bulk(stk, (void**)out, 2);
+	assert(count == 2 && out[0] == in[STACK_SIZE - 1] && out[1] == in[STACK_SIZE - 2]);
+	assert(amstack_pop(stk, (void**)&out[0]) == AMRC_SUCCESS && out[0] == in[STACK_SIZE - 3]);
+	count = amstack_pop_bulk(stk, (void**)out, ARRAY_SIZE(out));
+	assert(count == STACK_SIZE - 3 && amstack_get_size(stk) == 0);
+	for (i = 0; i < count; i++)
+		assert(out[i] == in[count - 1 - i]);
+	assert(amstack_pop_bulk(stk, (void**)out, 1) == 0);
+
+	amstack_free(stk);
+	(void)count;
+}
+
 /* Basic idea - Have three groups of threads - Readers, writers, and meddlers
  * Writers simply deplete their pools of objects into the stack as fast as they can.
  * Meddlers take out an object from the stack, and put it back
@@ -603,6 +636,7 @@ int main()
 
 	printf("libam testing of amstack_t starting.");
 	fflush(stdout);
+	run_bulk();
 	for (i = 0; i < 2; i++) {
 		run_readers(cpu_numbers);
 		printf(".");
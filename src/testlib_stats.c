@@ -370,6 +370,63 @@ static amrc_t test_amstat_upd_test_special_cases()
 	return (errors > 0 ? AMRC_ERROR : AMRC_SUCCESS);
 }
 
+static amrc_t test_amstat_hist()
+{
+	static const uint64_t vals[] = { 0, 1, 3, 4, 5, 7, 8, 1000, 1023, 1024, 123456789, UINT64_MAX / 3, UINT64_MAX };
+	uint32_t errors = 0;
+	amstat_hist_t hist;
+	amstat_hist_t other;
+	uint64_t expected;
+	uint64_t val;
+	uint64_t i;
+
+	amstat_hist_init(&hist);
+	if (amstat_hist_percentile(&hist, 50) != 0) {
+		err("Failed to validate empty histogram\n");
+		errors++;
+	}
+
+	/* A single value comes back within 25% above it, never under it */
+	for (i = 0; i < ARRAY_SIZE(vals); i++) {
+		amstat_hist_init(&hist);
+		amstat_hist_upd(&hist, vals[i]);
+		val = amstat_hist_percentile(&hist, 99);
+		if (val < vals[i] || (val - vals[i]) > vals[i] / 4) {
+			err("Failed to validate value %lu, received %lu\n", vals[i], val);
+			errors++;
+		}
+		if (amstat_hist_bucket(vals[i]) >= AMSTAT_HIST_BUCKETS) {
+			err("Failed to validate bucket of value %lu\n", vals[i]);
+			errors++;
+		}
+	}
+
+	/* 1..1000, percentiles land in the bucket of the matching rank */
+	amstat_hist_init(&hist);
+	amstat_hist_init(&other);
+	for (i = 1; i <= 1000; i++)
+		amstat_hist_upd((i & 1 ? &hist : &other), i);
+	amstat_hist_add(&hist, &other);
+	if (hist.num != 1000) {
+		err("Failed to validate histogram count %lu\n", hist.num);
+		errors++;
+	}
+	for (i = 1; i <= 100; i++) {
+		expected = i * 10;
+		val = amstat_hist_percentile(&hist, (double)i);
+		if (amstat_hist_bucket(val) != amstat_hist_bucket(expected)) {
+			err("Failed to validate percentile %lu, expected %lu, received %lu\n", i, expected, val);
+			errors++;
+		}
+	}
+	if (amstat_hist_percentile(&hist, 0) != 1) {
+		err("Failed to validate percentile 0\n");
+		errors++;
+	}
+
+	return (errors > 0 ? AMRC_ERROR : AMRC_SUCCESS);
+}
+
 int main()
 {
 	amrc_t rc;
@@ -380,6 +437,7 @@ int main()
 			TEST(test_amstat_upd_sum),
 			TEST(test_amstat_upd_ss),
 			TEST(test_amstat_upd_test_special_cases),
+			TEST(test_amstat_hist),
 	};
 	test_set_t set = {
 			.name = "stats_tests",
@@ -1,7 +1,11 @@
+#define _GNU_SOURCE
 #include <string.h>
 #include <time.h>
+#include <sched.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <sys/sysinfo.h>
 
 #include "libam/libam_thread_pool.h"
@@ -19,6 +23,8 @@
 #include <assert.h>
 #endif
 
+#define UNUSED_SYM(x) (void)(x)
+
 typedef enum task_flags {
 	FLAG_NONE	= 0 << 0,
 	FLAG_RETURN	= 1 << 0, /* Set & check return code */
@@ -167,10 +173,1008 @@ static amrc_t check_default_func()
 	return AMRC_SUCCESS;
 }
 
+enum nested_defaults {
+	NESTED_DEPTH = 12, /* Tasks form a binary tree, 2^(NESTED_DEPTH + 1) - 1 of them */
+};
+
+typedef struct nested_ctx {
+	lam_thread_pool_t* tp;
+	volatile uint64_t done;
+	volatile uint64_t depth_done[NESTED_DEPTH + 1];
+} nested_ctx_t;
+
+typedef struct nested_task {
+	nested_ctx_t* ctx;
+	uint64_t depth;
+} nested_task_t;
+
+static void* nested_task_func(void* arg)
+{
+	nested_task_t* task = arg;
+	nested_task_t* child;
+	uint64_t i;
+	amrc_t rc;
+
+	/* Children are queued on this worker's deque, other workers steal them */
+	if (task->depth < NESTED_DEPTH) {
+		for (i = 0; i < 2; i++) {
+			child = malloc(sizeof(*child));
+			assert(child != NULL);
+			child->ctx = task->ctx;
+			child->depth = task->depth + 1;
+			rc = lam_thread_pool_run(task->ctx->tp, NULL, child, NULL);
+			assert(rc == AMRC_SUCCESS);
+			UNUSED_SYM(rc);
+		}
+	}
+
+	amsync_inc(&task->ctx->depth_done[task->depth]);
+	amsync_inc(&task->ctx->done);
+	free(task);
+	return NULL;
+}
+
+static amrc_t check_nested(uint64_t thread_count)
+{
+	struct timespec poll_time = { .tv_sec = 0, .tv_nsec = AMTIME_MSEC };
+	const uint64_t total = (2UL << NESTED_DEPTH) - 1;
+	lam_thread_pool_config_t config;
+	lam_thread_pool_stats_t stats;
+	nested_task_t* root;
+	nested_ctx_t ctx;
+	uint64_t i;
+	amrc_t rc;
+
+	memset(&config, 0, sizeof(config));
+	config.min_threads = thread_count;
+	config.max_threads = thread_count;
+	config.poll_freq = AMTIME_MSEC;
+	config.default_func = nested_task_func;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.tp = lam_thread_pool_create(&config);
+	assert(ctx.tp != NULL);
+
+	root = malloc(sizeof(*root));
+	assert(root != NULL);
+	root->ctx = &ctx;
+	root->depth = 0;
+	rc = lam_thread_pool_run(ctx.tp, NULL, root, NULL);
+	assert(rc == AMRC_SUCCESS);
+
+	while (ctx.done < total)
+		nanosleep(&poll_time, NULL);
+
+	rc = lam_thread_pool_destroy(ctx.tp, &stats);
+	assert(rc == AMRC_SUCCESS);
+	assert(stats.tasks_created == total);
+	assert(stats.busy_task_num.sum == total);
+	for (i = 0; i <= NESTED_DEPTH; i++)
+		assert(ctx.depth_done[i] == 1UL << i);
+	UNUSED_SYM(rc);
+	return AMRC_SUCCESS;
+}
+
+enum order_defaults {
+	ORDER_TASKS = 256,
+};
+
+typedef struct order_ctx {
+	volatile ambool_t gate_open;
+	volatile uint64_t next;
+	uint64_t order[ORDER_TASKS];
+} order_ctx_t;
+
+typedef struct order_task {
+	order_ctx_t* ctx;
+	uint64_t index;
+} order_task_t;
+
+static void* order_gate_func(void* arg)
+{
+	struct timespec poll_time = { .tv_sec = 0, .tv_nsec = AMTIME_MSEC };
+	order_ctx_t* ctx = arg;
+
+	while (!ctx->gate_open)
+		nanosleep(&poll_time, NULL);
+	return NULL;
+}
+
+static void* order_task_func(void* arg)
+{
+	order_task_t* task = arg;
+	task->ctx->order[amsync_inc(&task->ctx->next)] = task->index;
+	return NULL;
+}
+
+/* With a single worker held up, queued tasks run in queue order, or the reverse of it */
+static amrc_t check_order(lam_thread_pool_flags_t flags, ambool_t fifo)
+{
+	struct timespec poll_time = { .tv_sec = 0, .tv_nsec = AMTIME_MSEC };
+	static order_task_t tasks[ORDER_TASKS];
+	static order_ctx_t ctx;
+	lam_thread_pool_config_t config;
+	lam_thread_pool_stats_t stats;
+	lam_thread_pool_t* tp;
+	uint64_t i;
+	amrc_t rc;
+
+	memset(&config, 0, sizeof(config));
+	config.flags = flags | LIBAM_THREAD_POOL_FUNC_OVERRIDE;
+	config.min_threads = 1;
+	config.max_threads = 1;
+	config.poll_freq = AMTIME_MSEC;
+	config.backlog = ORDER_TASKS;
+	config.default_func = order_task_func;
+	tp = lam_thread_pool_create(&config);
+	assert(tp != NULL);
+
+	memset(&ctx, 0, sizeof(ctx));
+	while (lam_thread_pool_get_idle_thread_count(tp) == 0)
+		nanosleep(&poll_time, NULL);
+	rc = lam_thread_pool_run(tp, order_gate_func, &ctx, NULL);
+	assert(rc == AMRC_SUCCESS);
+	while (lam_thread_pool_get_idle_thread_count(tp) > 0)
+		nanosleep(&poll_time, NULL);
+
+	for (i = 0; i < ORDER_TASKS; i++) {
+		tasks[i].ctx = &ctx;
+		tasks[i].index = i;
+		rc = lam_thread_pool_run(tp, NULL, &tasks[i], NULL);
+		assert(rc == AMRC_SUCCESS);
+	}
+	ctx.gate_open = am_true;
+	while (ctx.next < ORDER_TASKS)
+		nanosleep(&poll_time, NULL);
+
+	rc = lam_thread_pool_destroy(tp, &stats);
+	assert(rc == AMRC_SUCCESS);
+	UNUSED_SYM(rc);
+
+	for (i = 0; i < ORDER_TASKS; i++)
+		assert(ctx.order[i] == (fifo ? i : ORDER_TASKS - 1 - i));
+
+	/* Delays grow with queue position either way, the percentiles come out of them */
+	assert(stats.task_delay_hist.num == ORDER_TASKS + 1);
+	assert(stats.task_delay_p50 <= stats.task_delay_p90 && stats.task_delay_p90 <= stats.task_delay_p99);
+	assert(stats.task_delay_p99 <= stats.task_delay_p999 && stats.task_delay_p999 >= stats.task_delay.max);
+	return AMRC_SUCCESS;
+}
+
+enum descriptor_defaults {
+	DESCRIPTOR_TASKS = 64,
+	DESCRIPTOR_ROUNDS = 16,
+};
+
+/* Caller-owned descriptors run like pooled ones, and can be reused once done */
+static amrc_t check_task_descriptors()
+{
+	struct timespec poll_time = { .tv_sec = 0, .tv_nsec = AMTIME_MSEC };
+	static lam_thread_pool_task_t descriptors[DESCRIPTOR_TASKS];
+	static task_t tasks[DESCRIPTOR_TASKS];
+	lam_thread_pool_config_t config;
+	lam_thread_pool_stats_t stats;
+	lam_thread_pool_t* tp;
+	uint64_t round;
+	uint64_t i;
+	amrc_t rc;
+
+	memset(&config, 0, sizeof(config));
+	config.min_threads = 2;
+	config.max_threads = 4;
+	config.poll_freq = AMTIME_MSEC;
+	config.backlog = DESCRIPTOR_TASKS;
+	tp = lam_thread_pool_create(&config);
+	assert(tp != NULL);
+
+	for (round = 0; round < DESCRIPTOR_ROUNDS; round++) {
+		for (i = 0; i < DESCRIPTOR_TASKS; i++) {
+			memset(&tasks[i], 0, sizeof(tasks[i]));
+			tasks[i].id = round * DESCRIPTOR_TASKS + i;
+			tasks[i].flags = FLAG_RETURN;
+			rc = lam_thread_pool_run_task(tp, &descriptors[i], task_function_default, &tasks[i], &tasks[i].check_ret);
+			assert(rc == AMRC_SUCCESS);
+		}
+		for (i = 0; i < DESCRIPTOR_TASKS; i++) {
+			while (!lam_thread_pool_task_done(&descriptors[i]))
+				nanosleep(&poll_time, NULL);
+			rc = task_check(&tasks[i], NULL);
+			assert(rc == AMRC_SUCCESS);
+		}
+	}
+
+	/* Without a function to run, nothing is queued */
+	rc = lam_thread_pool_run_task(tp, &descriptors[0], NULL, &tasks[0], NULL);
+	assert(rc == AMRC_ERROR);
+
+	rc = lam_thread_pool_destroy(tp, &stats);
+	assert(rc == AMRC_SUCCESS);
+	assert(stats.tasks_created == DESCRIPTOR_TASKS * DESCRIPTOR_ROUNDS);
+	assert(stats.busy_task_num.sum == DESCRIPTOR_TASKS * DESCRIPTOR_ROUNDS);
+	UNUSED_SYM(rc);
+	return AMRC_SUCCESS;
+}
+
+enum blocking_defaults {
+	BLOCKING_PINGS = 200,
+	BLOCKING_BURST = 64,
+	BLOCKING_MAX_THREADS = 4,
+};
+
+/* Parked workers wake up for each task, and extra workers still stop on idle_timeout */
+static amrc_t check_blocking(amtime_t spin_time)
+{
+	struct timespec poll_time = { .tv_sec = 0, .tv_nsec = 100 * AMTIME_USEC * 1000 };
+	static task_t tasks[BLOCKING_BURST];
+	lam_thread_pool_config_t config;
+	lam_thread_pool_stats_t stats;
+	lam_thread_pool_task_t descriptor;
+	lam_thread_pool_t* tp;
+	task_t task;
+	uint64_t i;
+	amrc_t rc;
+
+	memset(&config, 0, sizeof(config));
+	config.flags = LIBAM_THREAD_POOL_BLOCKING;
+	config.min_threads = 1;
+	config.max_threads = BLOCKING_MAX_THREADS;
+	config.idle_timeout = 20 * AMTIME_MSEC;
+	config.spin_time = spin_time;
+	config.backlog = BLOCKING_BURST;
+	config.default_func = task_function_default;
+	tp = lam_thread_pool_create(&config);
+	assert(tp != NULL);
+
+	/* One task at a time, the worker is parked (or spinning) every time one is queued */
+	for (i = 0; i < BLOCKING_PINGS; i++) {
+		memset(&task, 0, sizeof(task));
+		task.id = i;
+		task.flags = FLAG_RETURN;
+		rc = lam_thread_pool_run_task(tp, &descriptor, NULL, &task, &task.check_ret);
+		assert(rc == AMRC_SUCCESS);
+		while (!lam_thread_pool_task_done(&descriptor))
+			sched_yield();
+		rc = task_check(&task, NULL);
+		assert(rc == AMRC_SUCCESS);
+	}
+
+	/* A burst of slow tasks starts extra workers, which then park and time out */
+	for (i = 0; i < BLOCKING_BURST; i++) {
+		memset(&tasks[i], 0, sizeof(tasks[i]));
+		tasks[i].id = i;
+		tasks[i].sleep_for = AMTIME_MSEC * 1000; /* Nanoseconds, 1ms */
+		rc = lam_thread_pool_run(tp, NULL, &tasks[i], NULL);
+		assert(rc == AMRC_SUCCESS);
+	}
+	while (lam_thread_pool_get_thread_count(tp) > 1)
+		nanosleep(&poll_time, NULL);
+
+	rc = lam_thread_pool_destroy(tp, &stats);
+	assert(rc == AMRC_SUCCESS);
+	for (i = 0; i < BLOCKING_BURST; i++)
+		assert(tasks[i].check_done);
+	assert(stats.tasks_created == BLOCKING_PINGS + BLOCKING_BURST);
+	assert(stats.busy_task_num.sum == BLOCKING_PINGS + BLOCKING_BURST);
+	UNUSED_SYM(rc);
+	return AMRC_SUCCESS;
+}
+
+enum overflow_defaults {
+	OVERFLOW_BACKLOG = 4,
+	OVERFLOW_TASKS = 100,
+	OVERFLOW_TIMEOUT = 10 * AMTIME_MSEC,
+};
+
+static void* overflow_gate_opener(void* arg)
+{
+	struct timespec delay = { .tv_sec = 0, .tv_nsec = 2 * OVERFLOW_TIMEOUT * 1000 };
+	order_ctx_t* ctx = arg;
+
+	nanosleep(&delay, NULL);
+	ctx->gate_open = am_true;
+	return NULL;
+}
+
+/* A single worker is held up with a full backlog behind it, then the overflow policy kicks in */
+static amrc_t check_overflow(lam_thread_pool_overflow_t overflow)
+{
+	struct timespec poll_time = { .tv_sec = 0, .tv_nsec = AMTIME_MSEC };
+	static order_task_t tasks[OVERFLOW_TASKS];
+	static order_ctx_t ctx;
+	lam_thread_pool_config_t config;
+	lam_thread_pool_stats_t stats;
+	lam_thread_pool_t* tp;
+	pthread_t opener;
+	uint64_t queued = 0;
+	uint64_t i;
+	amtime_t start;
+	amrc_t rc;
+
+	memset(&config, 0, sizeof(config));
+	config.flags = LIBAM_THREAD_POOL_BLOCKING | LIBAM_THREAD_POOL_FUNC_OVERRIDE;
+	config.min_threads = 1;
+	config.max_threads = 1;
+	config.backlog = OVERFLOW_BACKLOG;
+	config.overflow = overflow;
+	config.default_func = order_task_func;
+	tp = lam_thread_pool_create(&config);
+	assert(tp != NULL);
+
+	memset(&ctx, 0, sizeof(ctx));
+	while (lam_thread_pool_get_idle_thread_count(tp) == 0)
+		nanosleep(&poll_time, NULL);
+	rc = lam_thread_pool_run(tp, order_gate_func, &ctx, NULL);
+	assert(rc == AMRC_SUCCESS);
+	while (lam_thread_pool_get_idle_thread_count(tp) > 0)
+		nanosleep(&poll_time, NULL);
+
+	for (i = 0; i < OVERFLOW_TASKS; i++) {
+		tasks[i].ctx = &ctx;
+		tasks[i].index = i;
+	}
+	for (; queued < OVERFLOW_BACKLOG; queued++) {
+		rc = lam_thread_pool_run(tp, NULL, &tasks[queued], NULL);
+		assert(rc == AMRC_SUCCESS);
+	}
+
+	/* Full, whatever the policy */
+	rc = lam_thread_pool_try_run(tp, NULL, &tasks[queued], NULL);
+	assert(rc == AMRC_ERROR);
+	start = amtime_now();
+	rc = lam_thread_pool_run_timeout(tp, NULL, &tasks[queued], NULL, OVERFLOW_TIMEOUT);
+	assert(rc == AMRC_ERROR && amtime_now() - start >= OVERFLOW_TIMEOUT);
+
+	switch (overflow) {
+	case LIBAM_THREAD_POOL_OVERFLOW_FAIL:
+		rc = lam_thread_pool_run(tp, NULL, &tasks[queued], NULL);
+		assert(rc == AMRC_ERROR);
+		ctx.gate_open = am_true;
+		break;
+
+	case LIBAM_THREAD_POOL_OVERFLOW_CALLER_RUNS:
+		rc = lam_thread_pool_run(tp, NULL, &tasks[queued], NULL);
+		assert(rc == AMRC_SUCCESS && ctx.next == 1 && ctx.order[0] == queued);
+		queued++;
+		ctx.gate_open = am_true;
+		break;
+
+	case LIBAM_THREAD_POOL_OVERFLOW_BLOCK:
+		/* Room is made once the gate opens, while this is waiting */
+		rc = pthread_create(&opener, NULL, overflow_gate_opener, &ctx);
+		assert(rc == 0);
+		for (; queued < OVERFLOW_TASKS; queued++) {
+			rc = lam_thread_pool_run(tp, NULL, &tasks[queued], NULL);
+			assert(rc == AMRC_SUCCESS);
+		}
+		assert(ctx.gate_open);
+		pthread_join(opener, NULL);
+		break;
+
+	case LIBAM_THREAD_POOL_OVERFLOW_GROW:
+		for (; queued < OVERFLOW_TASKS; queued++) {
+			rc = lam_thread_pool_run(tp, NULL, &tasks[queued], NULL);
+			assert(rc == AMRC_SUCCESS);
+		}
+		ctx.gate_open = am_true;
+		break;
+	}
+
+	while (ctx.next < queued)
+		nanosleep(&poll_time, NULL);
+
+	rc = lam_thread_pool_destroy(tp, &stats);
+	assert(rc == AMRC_SUCCESS);
+	UNUSED_SYM(rc);
+	UNUSED_SYM(start);
+
+	/* Nothing lost, and in order past the overflow as well */
+	assert(ctx.next == queued);
+	if (overflow != LIBAM_THREAD_POOL_OVERFLOW_CALLER_RUNS) {
+		for (i = 0; i < queued; i++)
+			assert(ctx.order[i] == i);
+	}
+	assert(stats.tasks_caller_run == (overflow == LIBAM_THREAD_POOL_OVERFLOW_CALLER_RUNS ? 1 : 0));
+	assert(stats.tasks_overflowed == (overflow == LIBAM_THREAD_POOL_OVERFLOW_GROW ? OVERFLOW_TASKS - OVERFLOW_BACKLOG : 0));
+	assert(stats.tasks_created == queued + 1 - stats.tasks_caller_run);
+	assert(stats.busy_task_num.sum == stats.tasks_created);
+	return AMRC_SUCCESS;
+}
+
+enum batch_defaults {
+	BATCH_TASKS = 1000,
+	BATCH_BACKLOG = 8,
+};
+
+/* Batches run every task once, with their own function and return slot, and stop short on a full backlog */
+static amrc_t check_batch(lam_thread_pool_flags_t flags)
+{
+	struct timespec poll_time = { .tv_sec = 0, .tv_nsec = AMTIME_MSEC };
+	static lam_thread_func_t funcs[BATCH_TASKS];
+	static void* args[BATCH_TASKS];
+	static void* rets[BATCH_TASKS];
+	static task_t tasks[BATCH_TASKS];
+	static order_task_t order_tasks[BATCH_TASKS];
+	static order_ctx_t ctx;
+	lam_thread_pool_config_t config;
+	lam_thread_pool_stats_t stats;
+	lam_thread_pool_t* tp;
+	stats_t expected;
+	stats_t received;
+	uint64_t queued;
+	uint64_t i;
+	amrc_t rc;
+
+	memset(&config, 0, sizeof(config));
+	config.flags = flags | LIBAM_THREAD_POOL_FUNC_OVERRIDE;
+	config.max_threads = 4;
+	config.backlog = BATCH_TASKS / 4;
+	config.overflow = LIBAM_THREAD_POOL_OVERFLOW_GROW;
+	config.default_func = task_function_default;
+	tp = lam_thread_pool_create(&config);
+	assert(tp != NULL);
+
+	/* Mixed functions, past the backlog */
+	memset(&expected, 0, sizeof(expected));
+	memset(&received, 0, sizeof(received));
+	for (i = 0; i < BATCH_TASKS; i++) {
+		task_parametrize(&tasks[i], i, &expected);
+		funcs[i] = (tasks[i].flags & FLAG_FUNC ? task_function_custom : NULL);
+		args[i] = &tasks[i];
+		rets[i] = NULL;
+	}
+	queued = lam_thread_pool_run_batch(tp, funcs, args, rets, BATCH_TASKS);
+	assert(queued == BATCH_TASKS);
+
+	rc = lam_thread_pool_destroy(tp, &stats);
+	assert(rc == AMRC_SUCCESS);
+	assert(stats.tasks_created == BATCH_TASKS && stats.busy_task_num.sum == BATCH_TASKS);
+	for (i = 0; i < BATCH_TASKS; i++) {
+		/* Return slots are filled for every task, keep those the check expects */
+		if (tasks[i].flags & FLAG_RETURN)
+			tasks[i].check_ret = rets[i];
+		else
+			assert(rets[i] == (void*)(tasks[i].id + (uint64_t)&tasks[i]));
+		task_check(&tasks[i], &received);
+	}
+	assert(memcmp(&expected, &received, sizeof(received)) == 0);
+
+	/* A held up worker, the batch stops at the backlog */
+	memset(&config, 0, sizeof(config));
+	config.flags = flags | LIBAM_THREAD_POOL_FUNC_OVERRIDE;
+	config.min_threads = 1;
+	config.max_threads = 1;
+	config.backlog = BATCH_BACKLOG;
+	config.default_func = order_task_func;
+	tp = lam_thread_pool_create(&config);
+	assert(tp != NULL);
+
+	memset(&ctx, 0, sizeof(ctx));
+	while (lam_thread_pool_get_idle_thread_count(tp) == 0)
+		nanosleep(&poll_time, NULL);
+	rc = lam_thread_pool_run(tp, order_gate_func, &ctx, NULL);
+	assert(rc == AMRC_SUCCESS);
+	while (lam_thread_pool_get_idle_thread_count(tp) > 0)
+		nanosleep(&poll_time, NULL);
+
+	for (i = 0; i < BATCH_TASKS; i++) {
+		order_tasks[i].ctx = &ctx;
+		order_tasks[i].index = i;
+		args[i] = &order_tasks[i];
+	}
+	queued = lam_thread_pool_run_batch(tp, NULL, args, NULL, BATCH_TASKS);
+	assert(queued == BATCH_BACKLOG);
+	ctx.gate_open = am_true;
+	while (ctx.next < queued)
+		nanosleep(&poll_time, NULL);
+
+	rc = lam_thread_pool_destroy(tp, &stats);
+	assert(rc == AMRC_SUCCESS);
+	assert(stats.tasks_created == BATCH_BACKLOG + 1);
+	for (i = 0; i < queued; i++)
+		assert(ctx.order[i] == ((flags & LIBAM_THREAD_POOL_FIFO) ? i : queued - 1 - i));
+	UNUSED_SYM(rc);
+	UNUSED_SYM(queued);
+	return AMRC_SUCCESS;
+}
+
+enum future_defaults {
+	FUTURE_TASKS = 64,
+	FUTURE_TIMEOUT = 10 * AMTIME_MSEC,
+	FUTURE_FIB = 16,
+	FUTURE_FIB_RESULT = 987,
+};
+
+static void* future_gate_func(void* arg)
+{
+	order_gate_func(arg);
+	return (void*)0x600D;
+}
+
+static lam_thread_pool_t* fib_tp;
+
+/* Waits on futures of its own pool, from within a worker, with far more waiting tasks than workers */
+static void* future_fib_func(void* arg)
+{
+	uint64_t n = (uint64_t)arg;
+	lam_thread_pool_future_t futures[2];
+	uint64_t sum = 0;
+	uint64_t i;
+
+	if (n < 2)
+		return (void*)n;
+
+	for (i = 0; i < 2; i++) {
+		if (lam_thread_pool_async(fib_tp, &futures[i], future_fib_func, (void*)(n - 1 - i)) == NULL)
+			abort();
+	}
+	for (i = 0; i < 2; i++)
+		sum += (uint64_t)lam_thread_pool_future_wait(&futures[i]);
+	return (void*)sum;
+}
+
+static amrc_t check_futures(lam_thread_pool_flags_t flags)
+{
+	static lam_thread_pool_future_t futures[FUTURE_TASKS];
+	static task_t tasks[FUTURE_TASKS];
+	lam_thread_pool_future_t gate;
+	lam_thread_pool_config_t config;
+	lam_thread_pool_stats_t stats;
+	lam_thread_pool_t* tp;
+	order_ctx_t ctx;
+	uint64_t index;
+	amtime_t start;
+	void* ret;
+	uint64_t i;
+	amrc_t rc;
+
+	memset(&config, 0, sizeof(config));
+	config.flags = flags | LIBAM_THREAD_POOL_FUNC_OVERRIDE;
+	config.min_threads = 2;
+	config.max_threads = 2;
+	config.backlog = FUTURE_TASKS * 2;
+	config.overflow = LIBAM_THREAD_POOL_OVERFLOW_CALLER_RUNS; /* Fork-join outgrows any backlog */
+	config.default_func = task_function_default;
+	tp = lam_thread_pool_create(&config);
+	assert(tp != NULL);
+
+	/* Held up task, times out, then completes */
+	memset(&ctx, 0, sizeof(ctx));
+	assert(lam_thread_pool_async(tp, &gate, future_gate_func, &ctx) == &gate);
+	start = amtime_now();
+	rc = lam_thread_pool_future_wait_timeout(&gate, FUTURE_TIMEOUT, &ret);
+	assert(rc == AMRC_ERROR && amtime_now() - start >= FUTURE_TIMEOUT && !lam_thread_pool_future_done(&gate));
+
+	/* The other worker still runs tasks, any of them beats the gate */
+	for (i = 0; i < FUTURE_TASKS; i++) {
+		memset(&tasks[i], 0, sizeof(tasks[i]));
+		tasks[i].id = i;
+		tasks[i].flags = FLAG_RETURN;
+		assert(lam_thread_pool_async(tp, &futures[i], NULL, &tasks[i]) == &futures[i]);
+	}
+	rc = lam_thread_pool_future_wait_any(futures, FUTURE_TASKS, 0, &index);
+	assert(rc == AMRC_SUCCESS && index < FUTURE_TASKS && lam_thread_pool_future_done(&futures[index]));
+	rc = lam_thread_pool_future_wait_any(&gate, 1, FUTURE_TIMEOUT, &index);
+	assert(rc == AMRC_ERROR);
+
+	rc = lam_thread_pool_future_wait_all(futures, FUTURE_TASKS, 0);
+	assert(rc == AMRC_SUCCESS);
+	for (i = 0; i < FUTURE_TASKS; i++) {
+		tasks[i].check_ret = futures[i].ret;
+		rc = task_check(&tasks[i], NULL);
+		assert(rc == AMRC_SUCCESS);
+	}
+	rc = lam_thread_pool_future_wait_all(&gate, 1, FUTURE_TIMEOUT);
+	assert(rc == AMRC_ERROR);
+
+	ctx.gate_open = am_true;
+	ret = lam_thread_pool_future_wait(&gate);
+	assert(ret == (void*)0x600D);
+
+	/* Fork-join from within the workers */
+	fib_tp = tp;
+	assert(lam_thread_pool_async(tp, &gate, future_fib_func, (void*)FUTURE_FIB) == &gate);
+	ret = lam_thread_pool_future_wait(&gate);
+	assert(ret == (void*)FUTURE_FIB_RESULT);
+
+	rc = lam_thread_pool_destroy(tp, &stats);
+	assert(rc == AMRC_SUCCESS);
+	assert(stats.busy_task_num.sum == stats.tasks_created);
+	assert(stats.busy_task_num.num < stats.tasks_created / 8); /* Tasks run while waiting are part of the waiting one's busy period */
+	assert(stats.tasks_created + stats.tasks_caller_run == 1 + FUTURE_TASKS + 3193); /* Gate, tasks, and 3193 calls for fib(16) */
+	UNUSED_SYM(rc);
+	UNUSED_SYM(start);
+	UNUSED_SYM(index);
+	UNUSED_SYM(ret);
+	return AMRC_SUCCESS;
+}
+
+enum {
+	PARALLEL_RANGE = 100000,
+	PARALLEL_FINE_RANGE = 5000, /* Run a single index at a time */
+	PARALLEL_BASE = 1000, /* Ranges do not start at 0 */
+};
+
+typedef struct parallel_order {
+	uint64_t first;
+	uint64_t last; /* Past the last index folded */
+	uint64_t folded; /* 0 for the identity */
+	uint64_t in_order;
+} parallel_order_t;
+
+static volatile uint32_t parallel_visits[PARALLEL_BASE + PARALLEL_RANGE];
+static lam_thread_pool_t* parallel_tp;
+
+static void parallel_visit_func(uint64_t begin, uint64_t end, void* ctx)
+{
+	uint64_t i;
+
+	assert(ctx == (void*)parallel_visits && begin < end);
+	for (i = begin; i < end; i++)
+		amsync_inc(&parallel_visits[i]);
+}
+
+static void parallel_sum_func(uint64_t begin, uint64_t end, UNUSED void* ctx, void* acc)
+{
+	uint64_t i;
+
+	for (i = begin; i < end; i++)
+		*(uint64_t*)acc += i;
+}
+
+static void parallel_sum_join(void* acc, const void* other, UNUSED void* ctx)
+{
+	*(uint64_t*)acc += *(const uint64_t*)other;
+}
+
+/* Not commutative, pieces must be folded and joined in range order */
+static void parallel_order_func(uint64_t begin, uint64_t end, UNUSED void* ctx, void* acc)
+{
+	parallel_order_t* order = acc;
+
+	if (order->folded == 0)
+		order->first = begin;
+	else if (order->last != begin)
+		order->in_order = 0;
+	order->last = end;
+	order->folded += end - begin;
+}
+
+static void parallel_order_join(void* acc, const void* other, UNUSED void* ctx)
+{
+	const parallel_order_t* right = other;
+	parallel_order_t* left = acc;
+
+	if (right->folded == 0)
+		return;
+	if (left->folded == 0) {
+		*left = *right;
+		return;
+	}
+	if (left->last != right->first || !right->in_order)
+		left->in_order = 0;
+	left->last = right->last;
+	left->folded += right->folded;
+}
+
+static amrc_t parallel_check_visits(uint64_t begin, uint64_t end, uint64_t grain)
+{
+	amrc_t rc;
+	uint64_t i;
+
+	memset((void*)parallel_visits, 0, sizeof(parallel_visits));
+	rc = lam_parallel_for(parallel_tp, begin, end, grain, parallel_visit_func, (void*)parallel_visits);
+	assert(rc == AMRC_SUCCESS);
+	for (i = 0; i < ARRAY_SIZE(parallel_visits); i++)
+		assert(parallel_visits[i] == (i >= begin && i < end ? 1 : 0));
+	UNUSED_SYM(rc);
+	return AMRC_SUCCESS;
+}
+
+/* Reductions from within a worker of the pool, whose pieces are stolen off its deque */
+static void* parallel_nested_func(UNUSED void* arg)
+{
+	parallel_order_t order;
+	uint64_t sum = 0;
+
+	if (lam_parallel_reduce(parallel_tp, 0, PARALLEL_RANGE, 0, parallel_sum_func, parallel_sum_join, NULL, &sum, sizeof(sum)) != AMRC_SUCCESS)
+		abort();
+
+	memset(&order, 0, sizeof(order));
+	order.in_order = 1;
+	if (lam_parallel_reduce(parallel_tp, 0, PARALLEL_RANGE, 1, parallel_order_func, parallel_order_join, NULL, &order, sizeof(order)) != AMRC_SUCCESS)
+		abort();
+	if (!order.in_order || order.folded != PARALLEL_RANGE)
+		abort();
+	return (void*)sum;
+}
+
+static amrc_t check_parallel(lam_thread_pool_flags_t flags, uint64_t thread_count)
+{
+	lam_thread_pool_config_t config;
+	lam_thread_pool_stats_t stats;
+	lam_thread_pool_future_t future;
+	parallel_order_t order;
+	uint64_t sum;
+	void* ret;
+	amrc_t rc;
+
+	memset(&config, 0, sizeof(config));
+	config.flags = flags;
+	config.min_threads = thread_count;
+	config.max_threads = thread_count;
+	parallel_tp = lam_thread_pool_create(&config);
+	assert(parallel_tp != NULL);
+
+	/* Every index exactly once, whatever the grain */
+	parallel_check_visits(PARALLEL_BASE, PARALLEL_BASE + PARALLEL_RANGE, 0);
+	parallel_check_visits(PARALLEL_BASE, PARALLEL_BASE + PARALLEL_FINE_RANGE, 1);
+	parallel_check_visits(PARALLEL_BASE, PARALLEL_BASE + PARALLEL_RANGE, 999);
+	parallel_check_visits(PARALLEL_BASE, PARALLEL_BASE + PARALLEL_RANGE, PARALLEL_RANGE * 2); /* Caller runs it all */
+	parallel_check_visits(PARALLEL_BASE, PARALLEL_BASE, 0);
+
+	/* Partial results joined in range order */
+	sum = 0;
+	rc = lam_parallel_reduce(parallel_tp, PARALLEL_BASE, PARALLEL_BASE + PARALLEL_RANGE, 0, parallel_sum_func, parallel_sum_join, NULL, &sum, sizeof(sum));
+	assert(rc == AMRC_SUCCESS && sum == (PARALLEL_BASE * 2 + PARALLEL_RANGE - 1) * (uint64_t)PARALLEL_RANGE / 2);
+
+	memset(&order, 0, sizeof(order));
+	order.in_order = 1;
+	rc = lam_parallel_reduce(parallel_tp, PARALLEL_BASE, PARALLEL_BASE + PARALLEL_FINE_RANGE, 1, parallel_order_func, parallel_order_join, NULL, &order, sizeof(order));
+	assert(rc == AMRC_SUCCESS && order.in_order && order.first == PARALLEL_BASE && order.last == PARALLEL_BASE + PARALLEL_FINE_RANGE);
+	assert(order.folded == PARALLEL_FINE_RANGE);
+
+	/* The identity comes back as is on empty ranges, and results must fit */
+	sum = 7;
+	rc = lam_parallel_reduce(parallel_tp, 5, 5, 0, parallel_sum_func, parallel_sum_join, NULL, &sum, sizeof(sum));
+	assert(rc == AMRC_SUCCESS && sum == 7);
+	rc = lam_parallel_reduce(parallel_tp, 0, 1, 0, parallel_sum_func, parallel_sum_join, NULL, &sum, LAM_PARALLEL_ACC_MAX + 1);
+	assert(rc == AMRC_ERROR);
+	rc = lam_parallel_for(parallel_tp, 0, 1, 0, NULL, NULL);
+	assert(rc == AMRC_ERROR);
+
+	/* From within a worker */
+	assert(lam_thread_pool_async(parallel_tp, &future, parallel_nested_func, NULL) == &future);
+	ret = lam_thread_pool_future_wait(&future);
+	assert(ret == (void*)((PARALLEL_RANGE - 1) * (uint64_t)PARALLEL_RANGE / 2));
+
+	rc = lam_thread_pool_destroy(parallel_tp, &stats);
+	assert(rc == AMRC_SUCCESS);
+	assert(stats.busy_task_num.sum == stats.tasks_created && stats.tasks_created > 1); /* Halves were handed out */
+	UNUSED_SYM(rc);
+	UNUSED_SYM(ret);
+	return AMRC_SUCCESS;
+}
+
+enum {
+	DEQUELESS_WORKERS = 80, /* Past the 64 deques of a pool */
+	DEQUELESS_RANGE = 1000,
+};
+
+static volatile uint64_t dequeless_arrived;
+
+static void parallel_count_func(uint64_t begin, uint64_t end, void* ctx)
+{
+	amsync_add((volatile uint64_t*)ctx, end - begin);
+}
+
+/* Held until every worker has a task, so workers without a deque run some of them */
+static void* parallel_dequeless_func(UNUSED void* arg)
+{
+	volatile uint64_t count = 0;
+
+	amsync_inc(&dequeless_arrived);
+	while (dequeless_arrived < DEQUELESS_WORKERS)
+		sched_yield();
+
+	if (lam_parallel_for(parallel_tp, 0, DEQUELESS_RANGE, 1, parallel_count_func, (void*)&count) != AMRC_SUCCESS)
+		abort();
+	return (void*)count;
+}
+
+static amrc_t check_parallel_dequeless()
+{
+	static lam_thread_pool_future_t futures[DEQUELESS_WORKERS];
+	lam_thread_pool_config_t config;
+	uint64_t i;
+	amrc_t rc;
+
+	memset(&config, 0, sizeof(config));
+	config.min_threads = DEQUELESS_WORKERS;
+	config.backlog = DEQUELESS_WORKERS * 2;
+	config.overflow = LIBAM_THREAD_POOL_OVERFLOW_CALLER_RUNS;
+	parallel_tp = lam_thread_pool_create(&config);
+	assert(parallel_tp != NULL);
+
+	dequeless_arrived = 0;
+	for (i = 0; i < DEQUELESS_WORKERS; i++)
+		assert(lam_thread_pool_async(parallel_tp, &futures[i], parallel_dequeless_func, NULL) == &futures[i]);
+	for (i = 0; i < DEQUELESS_WORKERS; i++)
+		assert(lam_thread_pool_future_wait(&futures[i]) == (void*)DEQUELESS_RANGE);
+
+	rc = lam_thread_pool_destroy(parallel_tp, NULL);
+	assert(rc == AMRC_SUCCESS);
+	UNUSED_SYM(rc);
+	return AMRC_SUCCESS;
+}
+
+enum {
+	SMALL_STACK_TASKS = 16,
+};
+
+/* Nested parallel loops on the smallest stacks, their pieces piling up on workers helping while they wait */
+static amrc_t check_parallel_stack()
+{
+	static lam_thread_pool_future_t futures[SMALL_STACK_TASKS];
+	lam_thread_pool_config_t config;
+	uint64_t i;
+	amrc_t rc;
+
+	memset(&config, 0, sizeof(config));
+	config.flags = LIBAM_THREAD_POOL_BLOCKING;
+	config.min_threads = 4;
+	config.max_threads = 4;
+	config.backlog = SMALL_STACK_TASKS * 2;
+	config.overflow = LIBAM_THREAD_POOL_OVERFLOW_CALLER_RUNS;
+	config.stack_size = 1; /* Raised to LAM_THREAD_POOL_STACK_MIN */
+	parallel_tp = lam_thread_pool_create(&config);
+	assert(parallel_tp != NULL);
+
+	for (i = 0; i < SMALL_STACK_TASKS; i++)
+		assert(lam_thread_pool_async(parallel_tp, &futures[i], parallel_nested_func, NULL) == &futures[i]);
+	for (i = 0; i < SMALL_STACK_TASKS; i++)
+		assert(lam_thread_pool_future_wait(&futures[i]) == (void*)((PARALLEL_RANGE - 1) * (uint64_t)PARALLEL_RANGE / 2));
+
+	rc = lam_thread_pool_destroy(parallel_tp, NULL);
+	assert(rc == AMRC_SUCCESS);
+	UNUSED_SYM(rc);
+	return AMRC_SUCCESS;
+}
+
+enum {
+	PLACEMENT_STACK_SIZE = 1024 * 1024,
+	PLACEMENT_TASKS = 16, /* Per node */
+	PLACEMENT_BACKLOG = 1024, /* Without affinity, tasks of all nodes share the queue */
+};
+
+typedef struct placement_ctx {
+	cpu_set_t allowed; /* Of the process */
+	int64_t cpu; /* Pinned to, -1 for anywhere within allowed */
+	volatile uint64_t ran;
+} placement_ctx_t;
+
+/* Workers run where they are placed, on stacks of the configured size */
+static void* placement_func(void* arg)
+{
+	placement_ctx_t* ctx = arg;
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+	cpu_set_t outside;
+	size_t stack_size;
+
+	if (pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+		abort();
+	if (ctx->cpu >= 0 && (CPU_COUNT(&cpus) != 1 || !CPU_ISSET(ctx->cpu, &cpus)))
+		abort();
+	CPU_XOR(&outside, &cpus, &ctx->allowed);
+	CPU_AND(&outside, &outside, &cpus);
+	if (CPU_COUNT(&cpus) == 0 || CPU_COUNT(&outside) != 0)
+		abort();
+
+	if (pthread_getattr_np(pthread_self(), &attr) != 0 || pthread_attr_getstacksize(&attr, &stack_size) != 0)
+		abort();
+	pthread_attr_destroy(&attr);
+	if (stack_size < PLACEMENT_STACK_SIZE || stack_size >= PLACEMENT_STACK_SIZE * 2)
+		abort();
+
+	amsync_inc(&ctx->ran);
+	return NULL;
+}
+
+static amrc_t check_placement(lam_thread_pool_affinity_t affinity, lam_thread_pool_flags_t flags)
+{
+	lam_thread_pool_config_t config;
+	lam_thread_pool_t* tp;
+	placement_ctx_t ctx;
+	uint32_t cpu = 0;
+	uint64_t nodes;
+	uint64_t i;
+	amrc_t rc;
+
+	memset(&ctx, 0, sizeof(ctx));
+	rc = (sched_getaffinity(0, sizeof(ctx.allowed), &ctx.allowed) == 0 ? AMRC_SUCCESS : AMRC_ERROR);
+	assert(rc == AMRC_SUCCESS);
+	while (!CPU_ISSET(cpu, &ctx.allowed))
+		cpu++;
+	ctx.cpu = (affinity == LIBAM_THREAD_POOL_AFFINITY_CPUS ? (int64_t)cpu : -1);
+
+	memset(&config, 0, sizeof(config));
+	config.flags = flags;
+	config.min_threads = 2;
+	config.max_threads = 4;
+	config.backlog = PLACEMENT_BACKLOG;
+	config.affinity = affinity;
+	config.stack_size = PLACEMENT_STACK_SIZE;
+	if (affinity == LIBAM_THREAD_POOL_AFFINITY_CPUS) {
+		config.cpus = &cpu;
+		config.cpus_len = 1;
+	}
+	tp = lam_thread_pool_create(&config);
+	assert(tp != NULL);
+
+	/* Whether workers are bound to the node or not, its tasks run */
+	nodes = lam_thread_pool_get_node_count(tp);
+	assert(nodes >= 1);
+	for (i = 0; i < nodes * PLACEMENT_TASKS; i++) {
+		rc = lam_thread_pool_run_on_node(tp, i % nodes, placement_func, &ctx, NULL);
+		assert(rc == AMRC_SUCCESS);
+	}
+	rc = lam_thread_pool_run_on_node(tp, nodes, placement_func, &ctx, NULL);
+	assert(rc == AMRC_ERROR);
+	rc = lam_thread_pool_run(tp, placement_func, &ctx, NULL);
+	assert(rc == AMRC_SUCCESS);
+
+	while (ctx.ran < nodes * PLACEMENT_TASKS + 1)
+		usleep(100);
+
+	rc = lam_thread_pool_destroy(tp, NULL);
+	assert(rc == AMRC_SUCCESS);
+
+	/* CPUs past what a cpu_set_t holds */
+	cpu = CPU_SETSIZE;
+	config.cpus = &cpu;
+	config.cpus_len = 1;
+	assert(lam_thread_pool_create(&config) == NULL);
+	UNUSED_SYM(rc);
+	return AMRC_SUCCESS;
+}
+
 static amrc_t check_functional_tests()
 {
 	/* Check basic operations */
 	check_default_func();
+
+	/* Check caller-owned descriptors */
+	check_task_descriptors();
+
+	/* Check parking and wakeups */
+	check_blocking(0);
+	check_blocking(50 * AMTIME_USEC);
+
+	/* Check queue ordering */
+	check_order(LIBAM_THREAD_POOL_NONE, am_false);
+	check_order(LIBAM_THREAD_POOL_FIFO, am_true);
+	check_order(LIBAM_THREAD_POOL_BLOCKING, am_true);
+	check_order(LIBAM_THREAD_POOL_BLOCKING | LIBAM_THREAD_POOL_LIFO, am_false);
+
+	/* Check full backlog policies */
+	check_overflow(LIBAM_THREAD_POOL_OVERFLOW_FAIL);
+	check_overflow(LIBAM_THREAD_POOL_OVERFLOW_CALLER_RUNS);
+	check_overflow(LIBAM_THREAD_POOL_OVERFLOW_BLOCK);
+	check_overflow(LIBAM_THREAD_POOL_OVERFLOW_GROW);
+
+	/* Check futures */
+	check_futures(LIBAM_THREAD_POOL_NONE);
+	check_futures(LIBAM_THREAD_POOL_BLOCKING);
+
+	/* Check batches */
+	check_batch(LIBAM_THREAD_POOL_LIFO);
+	check_batch(LIBAM_THREAD_POOL_FIFO | LIBAM_THREAD_POOL_BLOCKING);
+
+	/* Check parallel loops */
+	check_parallel(LIBAM_THREAD_POOL_NONE, 4);
+	check_parallel(LIBAM_THREAD_POOL_BLOCKING, get_nprocs());
+	check_parallel_dequeless();
+	check_parallel_stack();
+
+	/* Check worker placement and node queues */
+	check_placement(LIBAM_THREAD_POOL_AFFINITY_NONE, LIBAM_THREAD_POOL_NONE);
+	check_placement(LIBAM_THREAD_POOL_AFFINITY_CPUS, LIBAM_THREAD_POOL_BLOCKING);
+	check_placement(LIBAM_THREAD_POOL_AFFINITY_NUMA, LIBAM_THREAD_POOL_BLOCKING);
+
+	/* Check tasks queued from within workers */
+	check_nested(1);
+	check_nested(4);
+	check_nested(get_nprocs() * 2);
 	/* TODO */
 
 	/* Check flags function */
@@ -287,7 +1291,7 @@ void stats_print(lam_thread_pool_stats_t* stats)
 	printf("\n");
 }
 
-static void run_threaded_test(uint64_t workers, uint64_t thread_min, uint64_t thread_max)
+static void run_threaded_test(uint64_t workers, uint64_t thread_min, uint64_t thread_max, lam_thread_pool_flags_t flags)
 {
 	thread_ctx_t ctx[2];
 	lam_thread_pool_t* worker_tp;
@@ -310,7 +1314,7 @@ static void run_threaded_test(uint64_t workers, uint64_t thread_min, uint64_t th
 	assert(worker_tp != NULL);
 
 	memset(&test_config, 0, sizeof(test_config));
-	test_config.flags = LIBAM_THREAD_POOL_FUNC_OVERRIDE;
+	test_config.flags = flags | LIBAM_THREAD_POOL_FUNC_OVERRIDE;
 	test_config.poll_freq = AMTIME_MSEC * 1;
 	test_config.min_threads = thread_min;
 	test_config.max_threads = thread_max;
@@ -398,9 +1402,9 @@ int main()
 	for (i = 1; i <= 2; i++) {
 		num_cpu = cpu_numbers;
 		while (*num_cpu != UINT64_MAX) {
-			run_threaded_test(i, *num_cpu, *num_cpu);
-			run_threaded_test(i, 0, *num_cpu);
-			run_threaded_test(i, *num_cpu, 0);
+			run_threaded_test(i, *num_cpu, *num_cpu, LIBAM_THREAD_POOL_NONE);
+			run_threaded_test(i, 0, *num_cpu, LIBAM_THREAD_POOL_BLOCKING);
+			run_threaded_test(i, *num_cpu, 0, LIBAM_THREAD_POOL_FIFO);
 			num_cpu++;
 		}
 		printf(".");